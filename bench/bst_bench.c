@@ -0,0 +1,70 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Lookup latency of a single bucket as it grows with sorted inserts
+ * (the "c a", "c b", ... pattern of the inputs), which is the worst
+ * case for the unbalanced tree.
+ * Usage: bst-bench [max_files] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../lib/bst.h"
+
+#define SAMPLES 20000
+
+static long elapsed_ns(struct timespec* start, struct timespec* stop) {
+    return (stop->tv_sec - start->tv_sec) * 1000000000L +
+           (stop->tv_nsec - start->tv_nsec);
+}
+
+static int cmp_long(const void* a, const void* b) {
+    long x = *(const long*) a, y = *(const long*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    long maxFiles = argc > 1 ? atol(argv[1]) : 1000000;
+    static long latency[SAMPLES];
+    char name[32];
+    node* root = NULL;
+    nodePool pool;
+    long files = 0, checkpoint;
+    int inserted;
+
+#ifdef AVL
+    printf("# tree=avl\n");
+#else
+    printf("# tree=plain\n");
+#endif
+    printf("%10s %10s %10s %10s\n", "files", "p50_ns", "p99_ns", "max_ns");
+
+    pool_init(&pool);
+    srand(42);
+    for (checkpoint = 1000; checkpoint <= maxFiles; checkpoint *= 10) {
+        for (; files < checkpoint; files++) {
+            sprintf(name, "f%09ld", files);
+            root = insert(&pool, root, name, 0, (int) files + 1, &inserted);
+        }
+
+        for (int i = 0; i < SAMPLES; i++) {
+            struct timespec start, stop;
+            sprintf(name, "f%09ld", rand() % files);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            node* p = search(root, name);
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+
+            if (!p) {
+                fprintf(stderr, "bst-bench: %s not found\n", name);
+                exit(EXIT_FAILURE);
+            }
+            latency[i] = elapsed_ns(&start, &stop);
+        }
+
+        qsort(latency, SAMPLES, sizeof(long), cmp_long);
+        printf("%10ld %10ld %10ld %10ld\n", files, latency[SAMPLES / 2],
+               latency[SAMPLES * 99 / 100], latency[SAMPLES - 1]);
+    }
+
+    pool_destroy(&pool);
+    return 0;
+}
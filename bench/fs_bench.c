@@ -0,0 +1,459 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Microbenchmarks of lib/hash, lib/bst and the fs.c API, without the
+ * server or the input parser in the way:
+ *   hash  hash_key over names of a few lengths, and how evenly hash()
+ *         spreads sequential names over the buckets
+ *   bst   insert, search and remove_item on one tree, keys in order and
+ *         shuffled
+ *   fs    create, lookup, rename and delete on a whole fs, for 1 to
+ *         max_threads threads (powers of two), each initial bucket count
+ *         and key order; lookups also with a zipfian skew; and the
+ *         creates again, BATCH_OPS at a time through applyBatch
+ * Results are one JSON object per line, to be kept and compared over
+ * time (see bench/fs_bench.sh). ns_per_op is wall time over the ops of
+ * all threads; allocs_per_op and bytes_per_op count the malloc family
+ * called by the code under test (linked with --wrap).
+ * The locks are those of the build: fs-bench-nosync, -mutex, -rwlock
+ * and -seqlock; nosync only runs one thread. The tree operations delay
+ * by -d cycles, 0 by default (DELAY is what the server uses).
+ * Usage: fs-bench [-s hash,bst,fs] [-t max_threads] [-b buckets,...]
+ *                 [-n ops_per_thread] [-k keys] [-d delay] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include "../fs.h"
+#include "../lib/bst.h"
+#include "../lib/hash.h"
+#include "../stats.h"
+
+#if defined (RWLOCK)
+    #define FLAVOUR "rwlock"
+#elif defined (SEQLOCK)
+    #define FLAVOUR "seqlock"
+#elif defined (MUTEX)
+    #define FLAVOUR "mutex"
+#else
+    #define FLAVOUR "nosync"
+#endif
+
+#ifdef AVL
+    #define TREE "avl"
+#else
+    #define TREE "plain"
+#endif
+
+#define NAME_SIZE    32
+#define HASH_NAMES   (1 << 20)
+#define HASH_BUCKETS 1024       /* for the spread of the names */
+#define ZIPF_SKEW    0.99
+#define PLAIN_IN_ORDER_MAX  10000  /* the plain tree in order is a list */
+#define BATCH_OPS    1024       /* creates per applyBatch */
+
+int numBuckets;     /* fs.c reads it, set per run */
+
+static char* suites = "hash,bst,fs";
+static char* bucketList = "1,256";
+static int maxThreads;
+static long opsPerThread = 100000, keys = 100000;
+
+/* Allocations made by this thread, see __wrap_malloc */
+static __thread long allocs, allocBytes;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    allocs++;
+    allocBytes += size;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    allocs++;
+    allocBytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+    allocs++;
+    allocBytes += size;
+    return __real_realloc(p, size);
+}
+
+static long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static void* xmalloc(size_t size) {
+    void* p = malloc(size);
+    if (!p) {
+        perror("fs-bench: malloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void usage(char* appName) {
+    fprintf(stderr, "Usage: %s [-s hash,bst,fs] [-t max_threads] [-b buckets,...] "
+            "[-n ops_per_thread] [-k keys] [-d delay]\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+/* One line of results; extra is more "key": value pairs, or "" */
+static void report(const char* suite, const char* op, const char* order, int threads,
+                   int buckets, long ops, long ns, long allocated, long bytes, const char* extra) {
+    printf("{\"suite\": \"%s\", \"op\": \"%s\", \"order\": \"%s\", \"flavour\": \"%s\", "
+           "\"tree\": \"%s\", \"delay\": %d, \"threads\": %d, \"buckets\": %d, \"ops\": %ld, "
+           "\"ns_per_op\": %.1f, \"mops\": %.3f, \"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f%s}\n",
+           suite, op, order, FLAVOUR, TREE, bstDelay, threads, buckets, ops,
+           (double) ns / ops, ops * 1e3 / ns, (double) allocated / ops, (double) bytes / ops, extra);
+    fflush(stdout);
+}
+
+static char* names(const char* prefix, long count) {
+    char* all = xmalloc(count * NAME_SIZE);
+    long i;
+
+    for (i = 0; i < count; i++)
+        snprintf(all + i * NAME_SIZE, NAME_SIZE, "%s%07ld", prefix, i);
+    return all;
+}
+
+static void shuffle(long* order, long count, unsigned int seed) {
+    long i;
+
+    for (i = 0; i < count; i++)
+        order[i] = i;
+    for (i = count - 1; i > 0; i--) {
+        long j = rand_r(&seed) % (i + 1), t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+}
+
+/* ---- hash ---- */
+
+static void bench_hash() {
+    static const int lengths[] = { 8, 32, MAX_INPUT_SIZE - 1 };
+    char* all = xmalloc((size_t) HASH_NAMES * MAX_INPUT_SIZE);
+    int* load = xmalloc(HASH_BUCKETS * sizeof(int));
+    volatile uint64_t sink = 0;
+    size_t l;
+    long i;
+
+    for (l = 0; l < sizeof(lengths) / sizeof(int); l++) {
+        char op[16], extra[64];
+        int max = 0;
+
+        for (i = 0; i < HASH_NAMES; i++) {
+            char* name = all + i * MAX_INPUT_SIZE;
+            int n = snprintf(name, MAX_INPUT_SIZE, "f%07ld", i);
+            while (n < lengths[l])
+                name[n++] = 'x';
+            name[n] = '\0';
+        }
+        long start = now_ns();
+        for (i = 0; i < HASH_NAMES; i++)
+            sink += hash_key(all + i * MAX_INPUT_SIZE);
+        long ns = now_ns() - start;
+
+        /* load of the fullest bucket against the average, 1.0 is perfect */
+        memset(load, 0, HASH_BUCKETS * sizeof(int));
+        for (i = 0; i < HASH_NAMES; i++) {
+            int b = hash(all + i * MAX_INPUT_SIZE, HASH_BUCKETS);
+            if (++load[b] > max)
+                max = load[b];
+        }
+        snprintf(op, sizeof(op), "hash_key_%d", lengths[l]);
+        snprintf(extra, sizeof(extra), ", \"max_load_ratio\": %.3f",
+                 (double) max * HASH_BUCKETS / HASH_NAMES);
+        report("hash", op, "seq", 1, HASH_BUCKETS, HASH_NAMES, ns, 0, 0, extra);
+    }
+    free(load);
+    free(all);
+}
+
+/* ---- bst ---- */
+
+static void bench_bst_order(const char* orderName, int shuffled) {
+    long count = !shuffled && !strcmp(TREE, "plain") && keys > PLAIN_IN_ORDER_MAX
+                 ? PLAIN_IN_ORDER_MAX : keys;
+    char* all = names("f", count);
+    long* order = xmalloc(count * sizeof(long));
+    long* lookups = xmalloc(count * sizeof(long));
+    node* root = NULL;
+    nodePool pool;
+    long i, start, a, b;
+    int inserted, inumber;
+
+    if (shuffled)
+        shuffle(order, count, 42);
+    else
+        for (i = 0; i < count; i++)
+            order[i] = i;
+    shuffle(lookups, count, 7);
+    pool_init(&pool);
+
+    a = allocs, b = allocBytes, start = now_ns();
+    for (i = 0; i < count; i++)
+        root = insert(&pool, root, all + order[i] * NAME_SIZE, 0, (int) i + 1, &inserted);
+    report("bst", "insert", orderName, 1, 1, count, now_ns() - start, allocs - a, allocBytes - b, "");
+
+    a = allocs, b = allocBytes, start = now_ns();
+    for (i = 0; i < count; i++)
+        if (!search(root, all + lookups[i] * NAME_SIZE)) {
+            fprintf(stderr, "fs-bench: %s not found\n", all + lookups[i] * NAME_SIZE);
+            exit(EXIT_FAILURE);
+        }
+    report("bst", "search", orderName, 1, 1, count, now_ns() - start, allocs - a, allocBytes - b, "");
+
+    a = allocs, b = allocBytes, start = now_ns();
+    for (i = 0; i < count; i++)
+        root = remove_item(&pool, root, all + order[i] * NAME_SIZE, &inumber);
+    report("bst", "remove", orderName, 1, 1, count, now_ns() - start, allocs - a, allocBytes - b, "");
+
+    pool_destroy(&pool);
+    free(lookups);
+    free(order);
+    free(all);
+}
+
+static void bench_bst() {
+    bench_bst_order("seq", 0);
+    bench_bst_order("uniform", 1);
+}
+
+/* ---- fs ---- */
+
+typedef enum { OP_CREATE, OP_LOOKUP, OP_RENAME, OP_DELETE, OP_BATCH } fsOp;
+static const char* opNames[] = { "create", "lookup", "rename", "delete", "batch_create" };
+
+typedef struct worker {
+    pthread_t tid;
+    fsOp op;
+    char* mine;             /* names of this thread, "<id>-<n>" */
+    char* renamed;          /* what they are renamed to */
+    long* order;            /* of the names, or of the keys for lookups */
+    long allocs, allocBytes;
+    long errors;
+} worker;
+
+static tecnicofs* fs;
+static char* sharedKeys;
+static double* zipfCdf;
+static pthread_barrier_t startLine;
+
+static void init_zipf() {
+    double sum = 0;
+    long i;
+
+    zipfCdf = xmalloc(keys * sizeof(double));
+    for (i = 0; i < keys; i++)
+        zipfCdf[i] = (sum += 1.0 / pow(i + 1, ZIPF_SKEW));
+    for (i = 0; i < keys; i++)
+        zipfCdf[i] /= sum;
+}
+
+static long pick_zipf(unsigned int* seed) {
+    double u = (double) rand_r(seed) / ((double) RAND_MAX + 1);
+    long low = 0, high = keys - 1;
+
+    while (low < high) {
+        long mid = (low + high) / 2;
+        if (zipfCdf[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* The names of OP_CREATE, created BATCH_OPS at a time */
+static void run_batch(worker* w) {
+    batchOp ops[BATCH_OPS];
+    long i, j, n;
+
+    for (i = 0; i < opsPerThread; i += n) {
+        n = opsPerThread - i < BATCH_OPS ? opsPerThread - i : BATCH_OPS;
+        for (j = 0; j < n; j++) {
+            ops[j].opcode = 'c';
+            ops[j].path = w->mine + w->order[i + j] * NAME_SIZE;
+            ops[j].inumber = obtainNewInumber(fs);
+        }
+        applyBatch(fs, ops, n, getuid(), DEFAULT_PERMISSIONS);
+        for (j = 0; j < n; j++)
+            if (ops[j].result < 0)
+                w->errors++;
+    }
+}
+
+static void* run_worker(void* arg) {
+    worker* w = (worker*) arg;
+    long i;
+
+    pthread_barrier_wait(&startLine);
+    allocs = allocBytes = 0;
+    if (w->op == OP_BATCH)
+        run_batch(w);
+    for (i = 0; i < opsPerThread && w->op != OP_BATCH; i++) {
+        long k = w->order[i];
+        int result;
+
+        switch (w->op) {
+            case OP_CREATE:
+                result = create(fs, w->mine + k * NAME_SIZE, obtainNewInumber(fs));
+                break;
+            case OP_LOOKUP:
+                result = lookup(fs, sharedKeys + k * NAME_SIZE);
+                break;
+            case OP_RENAME:
+                result = renameFile(fs, w->mine + k * NAME_SIZE, w->renamed + k * NAME_SIZE);
+                break;
+            default:
+                result = delete(fs, w->mine + k * NAME_SIZE);
+        }
+        if (result < 0)
+            w->errors++;
+    }
+    w->allocs = allocs;
+    w->allocBytes = allocBytes;
+    return NULL;
+}
+
+/* order: "seq", "uniform" (shuffled, or picked at random for lookups)
+ * or "zipf" (lookups only) */
+static void bench_fs_run(fsOp op, const char* order, int threads, int buckets) {
+    worker* workers = xmalloc(threads * sizeof(worker));
+    long totalAllocs = 0, totalBytes = 0, errors = 0, i;
+    int t;
+
+    numBuckets = buckets;
+    fs = new_tecnicofs(NULL);
+    if (op == OP_LOOKUP)
+        for (i = 0; i < keys; i++)
+            create(fs, sharedKeys + i * NAME_SIZE, obtainNewInumber(fs));
+
+    for (t = 0; t < threads; t++) {
+        worker* w = &workers[t];
+        unsigned int seed = 42 + t;
+        char prefix[16];
+
+        w->op = op;
+        w->errors = 0;
+        snprintf(prefix, sizeof(prefix), "%d-", t);
+        w->mine = op == OP_LOOKUP ? NULL : names(prefix, opsPerThread);
+        snprintf(prefix, sizeof(prefix), "%d+", t);
+        w->renamed = op == OP_RENAME ? names(prefix, opsPerThread) : NULL;
+        w->order = xmalloc(opsPerThread * sizeof(long));
+
+        if (op == OP_LOOKUP)
+            for (i = 0; i < opsPerThread; i++)
+                w->order[i] = !strcmp(order, "zipf") ? pick_zipf(&seed)
+                            : !strcmp(order, "seq") ? i % keys : rand_r(&seed) % keys;
+        else if (!strcmp(order, "seq"))
+            for (i = 0; i < opsPerThread; i++)
+                w->order[i] = i;
+        else
+            shuffle(w->order, opsPerThread, seed);
+
+        if (op == OP_RENAME || op == OP_DELETE)
+            for (i = 0; i < opsPerThread; i++)
+                create(fs, w->mine + i * NAME_SIZE, obtainNewInumber(fs));
+    }
+
+    pthread_barrier_init(&startLine, NULL, threads + 1);
+    for (t = 0; t < threads; t++)
+        if (pthread_create(&workers[t].tid, NULL, run_worker, &workers[t]) != 0) {
+            perror("fs-bench: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    pthread_barrier_wait(&startLine);
+    long start = now_ns();
+    for (t = 0; t < threads; t++)
+        pthread_join(workers[t].tid, NULL);
+    long ns = now_ns() - start;
+    pthread_barrier_destroy(&startLine);
+
+    for (t = 0; t < threads; t++) {
+        totalAllocs += workers[t].allocs;
+        totalBytes += workers[t].allocBytes;
+        errors += workers[t].errors;
+        free(workers[t].mine);
+        free(workers[t].renamed);
+        free(workers[t].order);
+    }
+    char extra[64];
+    snprintf(extra, sizeof(extra), ", \"errors\": %ld, \"final_buckets\": %d",
+             errors, fs->sizeBuckets);
+    report("fs", opNames[op], order, threads, buckets, opsPerThread * threads, ns,
+           totalAllocs, totalBytes, extra);
+
+    free_tecnicofs(fs);
+    free(workers);
+}
+
+static void bench_fs() {
+    static const char* orders[] = { "seq", "uniform", "zipf" };
+    char* list = strdup(bucketList), *save, *token;
+    int op, threads;
+    size_t o;
+
+    sharedKeys = names("f", keys);
+    init_zipf();
+    for (token = strtok_r(list, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        int buckets = atoi(token);
+        if (buckets <= 0)
+            continue;
+        for (op = OP_CREATE; op <= OP_BATCH; op++)
+            for (o = 0; o < sizeof(orders) / sizeof(char*); o++) {
+                if (op != OP_LOOKUP && !strcmp(orders[o], "zipf"))
+                    continue;
+                for (threads = 1; threads <= maxThreads; threads *= 2)
+                    bench_fs_run(op, orders[o], threads, buckets);
+            }
+    }
+    free(zipfCdf);
+    free(sharedKeys);
+    free(list);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    maxThreads = cpus > 0 ? (int) cpus : 1;
+    bstDelay = 0;
+    stats_init();   /* fs.c records what the filters of the buckets do */
+    while ((opt = getopt(argc, argv, "s:t:b:n:k:d:")) != -1) {
+        switch (opt) {
+            case 's': suites = optarg; break;
+            case 't': maxThreads = atoi(optarg); break;
+            case 'b': bucketList = optarg; break;
+            case 'n': opsPerThread = atol(optarg); break;
+            case 'k': keys = atol(optarg); break;
+            case 'd': bstDelay = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (maxThreads <= 0 || opsPerThread <= 0 || keys <= 0 || bstDelay < 0)
+        usage(argv[0]);
+#if !defined (RWLOCK) && !defined (MUTEX) && !defined (SEQLOCK)
+    maxThreads = 1;
+#endif
+
+    if (strstr(suites, "hash"))
+        bench_hash();
+    if (strstr(suites, "bst"))
+        bench_bst();
+    if (strstr(suites, "fs"))
+        bench_fs();
+    return 0;
+}
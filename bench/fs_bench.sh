@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Runs bench/fs-bench for every lock flavour and keeps the JSON lines in
+# bench/results/, named after the date and the commit, to compare runs.
+# The arguments go to fs-bench (see bench/fs_bench.c), e.g. -d 5000 for
+# the DELAY of the server, -t 8 for up to 8 threads.
+# Usage: bench/fs_bench.sh [fs-bench options]
+
+mkdir -p bench/results
+out="bench/results/fs-$(date +%Y%m%d-%H%M%S)-$(git rev-parse --short HEAD 2> /dev/null || echo none).jsonl"
+
+for flavour in nosync mutex rwlock seqlock
+do
+    echo "${flavour}..." >&2
+    ./bench/fs-bench-${flavour} "$@" | tee -a "${out}"
+done
+echo "results in ${out}" >&2
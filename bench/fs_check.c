@@ -0,0 +1,319 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Checks of the fs.c API under concurrency, for the lock flavours that
+ * run threads (make check):
+ *   model  each thread creates, deletes, looks up and renames files of
+ *          its own and checks every result against what it knows of
+ *          them, while the files of all threads split the buckets from
+ *          one: a lookup that misses a file that is there, or finds one
+ *          that is not, is an error. Lookups of missing names end at the
+ *          Bloom filter of their bucket, read without its lock, and
+ *          only stay right if a split publishes its filters in order
+ *          (see split_bucket). The table only grows while it fills, so
+ *          the ops are spread over rounds that each start a new fs.
+ *   dump   each thread renames files of its own back and forth while one
+ *          more creates c0, c1, ... in order, and print_tecnicofs_tree
+ *          dumps the fs meanwhile: every dump is point in time if it has
+ *          each renamed file once, under one of its names, and the
+ *          created files from c0 up to some cN, each once.
+ * Prints one JSON line per suite and exits with 1 if any check failed.
+ * Usage: fs-check [-s model,dump] [-t threads] [-n ops_per_thread]
+ *                 [-k files_per_thread] [-r rounds] [-d dumps] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../fs.h"
+#include "../lib/bst.h"
+#include "../stats.h"
+
+#if defined (RWLOCK)
+    #define FLAVOUR "rwlock"
+#elif defined (SEQLOCK)
+    #define FLAVOUR "seqlock"
+#elif defined (MUTEX)
+    #define FLAVOUR "mutex"
+#else
+    #error "fs-check runs threads, build it with MUTEX, RWLOCK or SEQLOCK"
+#endif
+
+#define NAME_SIZE 48
+#define MAX_CREATED 200000      /* files the dump suite creates at most */
+
+int numBuckets = 1;     /* fs.c reads it: every check starts from one bucket */
+
+static char* suites = "model,dump";
+static int threads = 4;
+static long opsPerThread = 200000, files = 2000, rounds = 50, dumps = 40;
+
+static tecnicofs* fs;
+static long errors;
+static int stop;        /* set once the dump suite has done its dumps */
+
+static void usage(char* appName) {
+    fprintf(stderr, "Usage: %s [-s model,dump] [-t threads] [-n ops_per_thread] "
+            "[-k files_per_thread] [-r rounds] [-d dumps]\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+static void* xcalloc(size_t count, size_t size) {
+    void* p = calloc(count, size);
+    if (!p) {
+        perror("fs-check: calloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void report(const char* suite, long ops, long failed) {
+    printf("{\"suite\": \"%s\", \"flavour\": \"%s\", \"threads\": %d, \"ops\": %ld, "
+           "\"errors\": %ld}\n", suite, FLAVOUR, threads, ops, failed);
+    fflush(stdout);
+}
+
+static void fail(long* failed, const char* what, char* name, int result) {
+    if (++*failed <= 10)
+        fprintf(stderr, "fs-check: %s %s returned %d\n", what, name, result);
+}
+
+static void start_threads(pthread_t* tids, int count, void* (*run)(void*)) {
+    long i;
+
+    for (i = 0; i < count; i++)
+        if (pthread_create(&tids[i], NULL, run, (void*) i) != 0) {
+            perror("fs-check: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+}
+
+/* Files t%d_%ld of thread t, present[i] telling which exist */
+static void* model_thread(void* arg) {
+    long t = (long) arg, i, failed = 0;
+    char* present = xcalloc(files, 1);
+    char name1[NAME_SIZE], name2[NAME_SIZE];
+    unsigned int seed = t * 7919 + 1;
+
+    for (i = 0; i < opsPerThread / rounds; i++) {
+        long k1 = rand_r(&seed) % files, k2 = rand_r(&seed) % files;
+        int op = rand_r(&seed) % 4, result;
+
+        snprintf(name1, NAME_SIZE, "t%ld_%ld", t, k1);
+        snprintf(name2, NAME_SIZE, "t%ld_%ld", t, k2);
+        switch (op) {
+            case 0:
+                result = create(fs, name1, obtainNewInumber(fs));
+                if ((result > 0) != !present[k1])
+                    fail(&failed, "create", name1, result);
+                present[k1] = 1;
+                break;
+            case 1:
+                result = delete(fs, name1);
+                if ((result > 0) != present[k1])
+                    fail(&failed, "delete", name1, result);
+                present[k1] = 0;
+                break;
+            case 2:
+                result = lookup(fs, name1);
+                if ((result > 0) != present[k1])
+                    fail(&failed, "lookup", name1, result);
+                break;
+            default:
+                if (k1 == k2)
+                    break;
+                result = renameFile(fs, name1, name2);
+                if ((result > 0) != (present[k1] && !present[k2]))
+                    fail(&failed, "rename", name1, result);
+                else if (result > 0) {
+                    present[k1] = 0;
+                    present[k2] = 1;
+                }
+        }
+    }
+
+    /* and what is left is what it should be */
+    for (i = 0; i < files; i++) {
+        snprintf(name1, NAME_SIZE, "t%ld_%ld", t, i);
+        if ((lookup(fs, name1) > 0) != present[i])
+            fail(&failed, "final lookup", name1, lookup(fs, name1));
+    }
+    free(present);
+    __atomic_add_fetch(&errors, failed, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void check_model() {
+    pthread_t* tids = xcalloc(threads, sizeof(pthread_t));
+    long i, r;
+
+    errors = 0;
+    for (r = 0; r < rounds; r++) {
+        fs = new_tecnicofs(NULL);
+        start_threads(tids, threads, model_thread);
+        for (i = 0; i < threads; i++)
+            pthread_join(tids[i], NULL);
+        free_tecnicofs(fs);
+    }
+    report("model", threads * (opsPerThread / rounds) * rounds, errors);
+    free(tids);
+}
+
+/* Files r%d_%ld_0 of thread t, each renamed to r%d_%ld_1 and back */
+static void* rename_thread(void* arg) {
+    long t = (long) arg, k, failed = 0;
+    char* renamed = xcalloc(files, 1);
+    char name1[NAME_SIZE], name2[NAME_SIZE];
+    unsigned int seed = t * 7919 + 1;
+    int result;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        k = rand_r(&seed) % files;
+        snprintf(name1, NAME_SIZE, "r%ld_%ld_%d", t, k, renamed[k]);
+        snprintf(name2, NAME_SIZE, "r%ld_%ld_%d", t, k, !renamed[k]);
+        result = renameFile(fs, name1, name2);
+        if (result <= 0)
+            fail(&failed, "rename", name1, result);
+        renamed[k] = !renamed[k];
+    }
+    free(renamed);
+    __atomic_add_fetch(&errors, failed, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void* create_thread(void* arg) {
+    long i, failed = 0;
+    char name[NAME_SIZE];
+    int result;
+
+    (void) arg;
+    for (i = 0; i < MAX_CREATED && !__atomic_load_n(&stop, __ATOMIC_RELAXED); i++) {
+        snprintf(name, NAME_SIZE, "c%ld", i);
+        result = create(fs, name, obtainNewInumber(fs));
+        if (result <= 0)
+            fail(&failed, "create", name, result);
+        /* leave the renaming threads some time once the table is grown */
+        if (i % 64 == 0)
+            sched_yield();
+    }
+    __atomic_add_fetch(&errors, failed, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void dump_fail(long* failed, const char* what, char* name) {
+    if (++*failed <= 10)
+        fprintf(stderr, "fs-check: dump %s %s\n", what, name);
+}
+
+/* Counts each name in a dump; returns how many are wrong */
+static long check_dump(char* text, char* seen, char* created) {
+    char *line, *save, *name, missing[NAME_SIZE];
+    long i, t, k, last = -1, failed = 0;
+    int side, n;
+
+    memset(seen, 0, threads * files);
+    memset(created, 0, MAX_CREATED);
+    for (line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        for (name = line; *name == ' '; name++)
+            ;
+        if (!*name)
+            continue;
+        if (sscanf(name, "r%ld_%ld_%d%n", &t, &k, &side, &n) == 3 && !name[n] &&
+                t >= 0 && t < threads && k >= 0 && k < files && seen[t * files + k]++ == 0)
+            continue;
+        if (sscanf(name, "c%ld%n", &i, &n) == 1 && !name[n] &&
+                i >= 0 && i < MAX_CREATED && created[i]++ == 0) {
+            if (i > last)
+                last = i;
+            continue;
+        }
+        dump_fail(&failed, "has twice or did not expect", name);
+    }
+    for (i = 0; i < threads * files; i++)
+        if (!seen[i]) {
+            snprintf(missing, NAME_SIZE, "r%ld_%ld_*", i / files, i % files);
+            dump_fail(&failed, "is without", missing);
+        }
+    for (i = 0; i < last; i++)
+        if (!created[i]) {
+            snprintf(missing, NAME_SIZE, "c%ld", i);
+            dump_fail(&failed, "is without", missing);
+        }
+    return failed;
+}
+
+static void check_dump_suite() {
+    pthread_t* tids = xcalloc(threads + 1, sizeof(pthread_t));
+    char* seen = xcalloc(threads * files, 1);
+    char* created = xcalloc(MAX_CREATED, 1);
+    char name[NAME_SIZE];
+    char* text;
+    size_t length;
+    long i, k, failed = 0;
+
+    fs = new_tecnicofs(NULL);
+    errors = 0;
+    stop = 0;
+    for (i = 0; i < threads; i++)
+        for (k = 0; k < files; k++) {
+            snprintf(name, NAME_SIZE, "r%ld_%ld_0", i, k);
+            create(fs, name, obtainNewInumber(fs));
+        }
+    start_threads(tids, threads, rename_thread);
+    start_threads(tids + threads, 1, create_thread);
+
+    for (i = 0; i < dumps; i++) {
+        FILE* fp = open_memstream(&text, &length);
+        if (!fp) {
+            perror("fs-check: open_memstream");
+            exit(EXIT_FAILURE);
+        }
+        print_tecnicofs_tree(fp, fs);
+        fclose(fp);
+        failed += check_dump(text, seen, created);
+        free(text);
+        sched_yield();
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i <= threads; i++)
+        pthread_join(tids[i], NULL);
+    errors += failed;
+    report("dump", dumps, errors);
+    free_tecnicofs(fs);
+    free(created);
+    free(seen);
+    free(tids);
+}
+
+int main(int argc, char* argv[]) {
+    long failed = 0;
+    int opt;
+
+    bstDelay = 0;
+    stats_init();
+    while ((opt = getopt(argc, argv, "s:t:n:k:r:d:")) != -1) {
+        switch (opt) {
+            case 's': suites = optarg; break;
+            case 't': threads = atoi(optarg); break;
+            case 'n': opsPerThread = atol(optarg); break;
+            case 'k': files = atol(optarg); break;
+            case 'r': rounds = atol(optarg); break;
+            case 'd': dumps = atol(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (threads <= 0 || opsPerThread <= 0 || files <= 0 || rounds <= 0 ||
+            opsPerThread < rounds || dumps <= 0)
+        usage(argv[0]);
+
+    if (strstr(suites, "model")) {
+        check_model();
+        failed += errors;
+    }
+    if (strstr(suites, "dump")) {
+        check_dump_suite();
+        failed += errors;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Read throughput of large files: writes a file of the given size, then
+ * each client thread reads it whole, reads times, on its own connection.
+ * Run against a server with and without TECNICOFS_ZERO_COPY=off to
+ * compare sendfile with copying the data (see bench/read_bench.sh).
+ * Usage: read-bench socket megabytes reads clients */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../client/tecnicofs-client-api.h"
+
+#define FILE_NAME  "read_bench_file"
+
+static char* address;
+static size_t fileSize;
+static int reads;
+
+static long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static void fail(const char* what, int status) {
+    fprintf(stderr, "read-bench: %s failed (%d)\n", what, status);
+    exit(EXIT_FAILURE);
+}
+
+static void write_file() {
+    tfsClient client;
+    char* data = malloc(fileSize);
+    size_t i;
+    int fd, result;
+
+    if (!data || tfsMount(&client, address) < 0)
+        fail("setup", 0);
+    for (i = 0; i < fileSize; i++)
+        data[i] = 'a' + i % 26;
+
+    tfsDelete(&client, FILE_NAME);
+    if ((result = tfsCreateFile(&client, FILE_NAME, TFS_PERM_RW, TFS_PERM_READ)) < 0)
+        fail("create", result);
+    if ((fd = tfsOpen(&client, FILE_NAME, TFS_PERM_WRITE)) < 0)
+        fail("open", fd);
+    if ((result = tfsWrite(&client, fd, data, fileSize)) != (int) fileSize)
+        fail("write", result);
+    tfsClose(&client, fd);
+    tfsUnmount(&client);
+    free(data);
+}
+
+static void* reader(void* arg) {
+    tfsClient client;
+    char* data = malloc(fileSize);
+    int i, fd, result;
+    (void) arg;
+
+    if (!data || tfsMount(&client, address) < 0)
+        fail("setup", 0);
+    for (i = 0; i < reads; i++) {
+        if ((fd = tfsOpen(&client, FILE_NAME, TFS_PERM_READ)) < 0)
+            fail("open", fd);
+        if ((result = tfsRead(&client, fd, data, fileSize)) != (int) fileSize)
+            fail("read", result);
+        if (data[fileSize - 1] != 'a' + (fileSize - 1) % 26)
+            fail("check", 0);
+        tfsClose(&client, fd);
+    }
+    tfsUnmount(&client);
+    free(data);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int clients, i;
+
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s socket megabytes reads clients\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    address = argv[1];
+    fileSize = (size_t) atoi(argv[2]) << 20;
+    reads = atoi(argv[3]);
+    clients = atoi(argv[4]);
+    if (!fileSize || reads <= 0 || clients <= 0) {
+        fprintf(stderr, "read-bench: invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    write_file();
+
+    pthread_t* tid = malloc(clients * sizeof(pthread_t));
+    if (!tid) {
+        perror("read-bench: malloc");
+        exit(EXIT_FAILURE);
+    }
+    long start = now_ns();
+    for (i = 0; i < clients; i++)
+        if (pthread_create(&tid[i], NULL, reader, NULL) != 0) {
+            perror("read-bench: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    for (i = 0; i < clients; i++)
+        pthread_join(tid[i], NULL);
+    double seconds = (now_ns() - start) / 1e9;
+
+    double megabytes = (double) clients * reads * (fileSize >> 20);
+    printf("%d MiB x %d reads x %d clients: %.2f s, %.0f MiB/s\n",
+           atoi(argv[2]), reads, clients, seconds, megabytes / seconds);
+    free(tid);
+    return 0;
+}
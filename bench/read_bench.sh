@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Compares large reads sent with sendfile with reads copied through the
+# response buffer.
+# Usage: bench/read_bench.sh [megabytes] [reads] [clients]
+
+megabytes="${1:-64}"
+reads="${2:-20}"
+clients="${3:-4}"
+socket="/tmp/socket.unix.stream"
+
+for zero_copy in on off
+do
+    TECNICOFS_ZERO_COPY=${zero_copy} ./tecnicofs-rwlock -s "${socket}" /tmp/bench-read-out.txt 64 > /dev/null &
+    server=$!
+    while ! [ -S "${socket}" ]; do sleep 0.1; done
+
+    echo -n "zero_copy=${zero_copy} "
+    ./bench/read-bench "${socket}" "${megabytes}" "${reads}" "${clients}"
+
+    kill ${server}
+    wait ${server} 2> /dev/null
+    rm -f "${socket}"
+done
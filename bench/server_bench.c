@@ -0,0 +1,142 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Load for the server: each client thread opens short-lived connections
+ * and sends a few commands on each one, waiting for every reply.
+ * Usage: server-bench socket clients connections_per_client commands_per_connection */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include "../protocol.h"
+
+static char* address;
+static int connectionsPerClient, commandsPerConnection;
+
+typedef struct clientResult {
+    int id;
+    long* latency;  /* ns per command, connect included in the first one */
+    long count;
+} clientResult;
+
+static long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static int connect_server() {
+    struct sockaddr_un end_serv;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        perror("server-bench: socket");
+        exit(EXIT_FAILURE);
+    }
+    memset(&end_serv, 0, sizeof(end_serv));
+    end_serv.sun_family = AF_UNIX;
+    strncpy(end_serv.sun_path, address, sizeof(end_serv.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*) &end_serv, sizeof(end_serv)) < 0) {
+        perror("server-bench: connect");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void read_reply(int fd, tfsBuffer* in) {
+    tfsResponse response;
+    ssize_t n;
+
+    while (tfs_parse_response(in, &response) == 0) {
+        n = read(fd, buffer_reserve(in, 4096), 4096);
+        if (n <= 0) {
+            perror("server-bench: read");
+            exit(EXIT_FAILURE);
+        }
+        in->end += n;
+    }
+}
+
+static void* client(void* arg) {
+    clientResult* result = arg;
+    char name[64];
+    tfsBuffer in, out;
+    int c, i;
+
+    buffer_init(&in);
+    buffer_init(&out);
+    for (c = 0; c < connectionsPerClient; c++) {
+        long start = now_ns();
+        int fd = connect_server();
+
+        for (i = 0; i < commandsPerConnection; i++) {
+            sprintf(name, "bench_%d_%d_%d", result->id, c, i - i % 2);
+            tfs_encode_request(&out, i, i % 2 ? TFS_LOOKUP : TFS_CREATE, name, NULL);
+            if (write(fd, out.data + out.start, out.end - out.start) < 0) {
+                perror("server-bench: write");
+                exit(EXIT_FAILURE);
+            }
+            buffer_consume(&out, out.end - out.start);
+            read_reply(fd, &in);
+
+            long stop = now_ns();
+            result->latency[result->count++] = stop - start;
+            start = stop;
+        }
+        close(fd);
+    }
+    buffer_free(&in);
+    buffer_free(&out);
+    return NULL;
+}
+
+static int cmp_long(const void* a, const void* b) {
+    long x = *(const long*) a, y = *(const long*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int clients, i;
+
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s socket clients connections_per_client commands_per_connection\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    address = argv[1];
+    clients = atoi(argv[2]);
+    connectionsPerClient = atoi(argv[3]);
+    commandsPerConnection = atoi(argv[4]);
+
+    long perClient = (long) connectionsPerClient * commandsPerConnection;
+    pthread_t* tid = malloc(clients * sizeof(pthread_t));
+    clientResult* results = calloc(clients, sizeof(clientResult));
+    long* all = malloc(clients * perClient * sizeof(long));
+    if (!tid || !results || !all) {
+        perror("server-bench: malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    long start = now_ns();
+    for (i = 0; i < clients; i++) {
+        results[i].id = i;
+        results[i].latency = all + i * perClient;
+        pthread_create(&tid[i], NULL, client, &results[i]);
+    }
+    for (i = 0; i < clients; i++)
+        pthread_join(tid[i], NULL);
+    double seconds = (now_ns() - start) / 1e9;
+
+    long total = clients * perClient;
+    qsort(all, total, sizeof(long), cmp_long);
+    printf("clients=%d commands=%ld seconds=%.3f ops_per_s=%.0f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+           clients, total, seconds, total / seconds, all[total / 2] / 1e3,
+           all[total * 99 / 100] / 1e3, all[total - 1] / 1e3);
+
+    free(all);
+    free(results);
+    free(tid);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Compares the epoll worker pool with the thread per client model and
+# with the sharded owner threads.
+# Usage: bench/server_bench.sh [clients] [connections_per_client] [commands_per_connection]
+
+clients="${1:-32}"
+connections="${2:-200}"
+commands="${3:-4}"
+socket="/tmp/socket.unix.stream"
+
+for model in epoll threads shards
+do
+    TECNICOFS_SERVER=${model} ./tecnicofs-rwlock -s "${socket}" /tmp/bench-server-out.txt 64 > /dev/null &
+    server=$!
+    while ! [ -S "${socket}" ]; do sleep 0.1; done
+
+    echo -n "model=${model} "
+    ./bench/server-bench "${socket}" "${clients}" "${connections}" "${commands}"
+
+    kill ${server}
+    wait ${server} 2> /dev/null
+    rm -f "${socket}"
+done
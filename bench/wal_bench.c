@@ -0,0 +1,70 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Logged changes per second with an fsync per change against group
+ * commit, with threads appending and committing like the fs does.
+ * Usage: wal-bench [threads] [changes_per_thread] [dir] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../lib/timer.h"
+#include "../wal.h"
+
+static wal* log;
+static long changes;
+
+static void* worker(void* arg) {
+    long id = (long) arg, i;
+    char name[32];
+
+    for (i = 0; i < changes; i++) {
+        snprintf(name, sizeof(name), "f%ld-%ld", id, i);
+        wal_commit(log, wal_append(log, WAL_CREATE, name, NULL, (int) i + 1, 0));
+    }
+    return NULL;
+}
+
+static void run(char* dir, int threads, int syncEach) {
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    TIMER_T startTime, stopTime;
+    long i;
+
+    log = wal_open(dir, 0, syncEach);
+    TIMER_READ(startTime);
+    for (i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, worker, (void*) i);
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    TIMER_READ(stopTime);
+
+    double seconds = TIMER_DIFF_SECONDS(startTime, stopTime);
+    long total = threads * changes;
+    printf("%-6s %8d %10ld %10.0f %10ld %10.1f\n", syncEach ? "each" : "group",
+           threads, total, total / seconds, log->syncs, (double) total / log->syncs);
+
+    /* the segment is only needed while it is written */
+    wal_remove_old(log, log->lastLsn);
+    wal_close(log);
+    free(workers);
+}
+
+int main(int argc, char* argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    char tmpDir[] = "/tmp/wal-bench-XXXXXX";
+    char* dir = argc > 3 ? argv[3] : mkdtemp(tmpDir);
+
+    changes = argc > 2 ? atol(argv[2]) : 2000;
+    if (!dir || threads <= 0 || changes <= 0) {
+        fprintf(stderr, "Usage: %s [threads] [changes_per_thread] [dir]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-6s %8s %10s %10s %10s %10s\n", "sync", "threads", "changes",
+           "changes/s", "fsyncs", "per_fsync");
+    run(dir, threads, 1);
+    run(dir, threads, 0);
+    if (argc <= 3)
+        rmdir(dir);
+    return 0;
+}
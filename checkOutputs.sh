@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Runs each input that has expected outputs with one thread and one bucket,
+# where the result does not depend on the order of the threads, and compares
+# the messages (without the timings) and the output file with them.
+
+if [ $# -ne 2 ]
+then
+    echo "Usage: $0 inputdir expecteddir"
+    exit 1
+fi
+
+inputdir="${1}"
+expecteddir="${2}"
+outputdir=$(mktemp -d)
+failed=0
+
+for expected in $(ls ${expecteddir}/*-1.txt)
+do
+    name=$(basename "${expected}" -1.txt)
+    ./tecnicofs-nosync ${inputdir}/${name}.txt ${outputdir}/${name}-1.txt 1 1 | \
+    grep -v -e "^TecnicoFS completed in" -e "^  [a-zA-Z]*: [0-9]* commands" \
+    > ${outputdir}/${name}-1.out
+    if diff -u ${expecteddir}/${name}-1.out ${outputdir}/${name}-1.out && \
+       diff -u ${expected} ${outputdir}/${name}-1.txt
+    then
+        echo "InputFile=""${name}.txt" "ok"
+    else
+        echo "InputFile=""${name}.txt" "FAILED"
+        failed=1
+    fi
+done
+
+rm -rf ${outputdir}
+exit ${failed}
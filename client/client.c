@@ -0,0 +1,139 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Interactive client: reads commands in the format of the input
+   files ("c name", "r old new", ...) from stdin and prints the answers.
+   Files: "c name 32" (permissions of the owner and of the others),
+   "o name mode", "W fd text", "R fd [bytes]", "x fd", "s name".
+   "p dir/prefix" lists the names starting with prefix, "D -" dumps the
+   whole fs (or "D path", to a file), "S -" the stats of the server.
+   Usage: tecnicofs-client [socket] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "tecnicofs-client-api.h"
+#include "../server.h"
+
+static void printName(char* name, void* arg) {
+    (void) arg;
+    printf("  %s\n", name);
+}
+
+/* The file calls, which have an fd or data instead of a second name, and
+   the scans, which take more than one request.
+   Returns 0 if token is not one of them */
+static int fileCommand(tfsClient* client, char token, char* name, char* arg, int numTokens) {
+    char data[TFS_MAX_DATA];
+    tfsStat st;
+    size_t size;
+    int result, fd;
+
+    switch (token) {
+        case TFS_CREATE:
+            if (numTokens != 3)
+                return 0;
+            /* "c name 32": the owner may read and write, the others read */
+            result = tfsCreateFile(client, name, (arg[0] - '0') & TFS_PERM_RW,
+                                   (arg[1] ? arg[1] - '0' : 0) & TFS_PERM_RW);
+            break;
+        case TFS_OPEN:
+            result = tfsOpen(client, name, numTokens == 3 ? atoi(arg) : TFS_PERM_RW);
+            break;
+        case TFS_CLOSE:
+            result = tfsClose(client, atoi(name));
+            break;
+        case TFS_READ:
+            size = numTokens == 3 ? (size_t) atoi(arg) : sizeof(data);
+            result = tfsRead(client, atoi(name), data, size < sizeof(data) ? size : sizeof(data));
+            if (result > 0)
+                printf("%.*s\n", result, data);
+            break;
+        case TFS_WRITE:
+            result = tfsWrite(client, atoi(name), arg, numTokens == 3 ? strlen(arg) : 0);
+            break;
+        case TFS_SCAN:
+            result = tfsScan(client, name, printName, NULL);
+            break;
+        case TFS_DUMP:
+        case TFS_STATS:
+            /* "D -" to the standard output, "D path" to a file */
+            fflush(stdout);
+            fd = strcmp(name, "-") ? open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+            if (fd < 0) {
+                perror("Erro ao abrir ficheiro");
+                return 1;
+            }
+            result = token == TFS_DUMP ? tfsDump(client, fd) : tfsStats(client, fd);
+            if (fd != STDOUT_FILENO)
+                close(fd);
+            break;
+        case TFS_STAT:
+            result = tfsStatFile(client, name, &st);
+            if (result >= 0)
+                printf("type %d owner %u permissions %d%d size %llu\n", st.type, st.owner,
+                       st.ownerPermissions, st.othersPermissions, (unsigned long long) st.size);
+            break;
+        default:
+            return 0;
+    }
+    printf("Resposta Recebida: %d\n", result);
+    return 1;
+}
+
+/* Skips what is left of a line that did not fit in the buffer */
+static void skipLine(FILE* fp) {
+    int c;
+
+    while ((c = fgetc(fp)) != EOF && c != '\n')
+        ;
+}
+
+int main(int argc, char* argv[]) {
+    char line[MAX_INPUT_SIZE + TFS_MAX_DATA], format[32];
+    tfsClient client;
+
+    if (tfsMount(&client, argc > 1 ? argv[1] : UNIXSTR_PATH) < 0)
+        exit(EXIT_FAILURE);
+
+    /* one byte wider than what fits, so a name that is too long is seen
+       as one instead of being cut */
+    snprintf(format, sizeof(format), "%%c %%%ds %%%d[^\n]", MAX_INPUT_SIZE, TFS_MAX_DATA);
+    while (fgets(line, sizeof(line), stdin)) {
+        char token, name[MAX_INPUT_SIZE + 1], name2[TFS_MAX_DATA + 1];
+        /* the rest of the line is the second name, or what to write */
+        int numTokens = sscanf(line, format, &token, name, name2);
+        tfsResponse response;
+
+        if (!strchr(line, '\n') && !feof(stdin)) {
+            skipLine(stdin);
+            fprintf(stderr, "Invalid command: line too long\n");
+            continue;
+        }
+        if (numTokens < 1 || token == '#' || token == '\n')
+            continue;
+        /* a second name fits in MAX_INPUT_SIZE, what to write in TFS_MAX_DATA */
+        if (numTokens < 2 || (token == TFS_RENAME && numTokens != 3) ||
+                strlen(name) >= MAX_INPUT_SIZE || (numTokens == 3 &&
+                strlen(name2) >= (token == TFS_RENAME ? MAX_INPUT_SIZE : TFS_MAX_DATA))) {
+            fprintf(stderr, "Invalid command: %s", line);
+            continue;
+        }
+        if (fileCommand(&client, token, name, name2, numTokens))
+            continue;
+
+        tfsSend(&client, token, name, token == TFS_RENAME ? name2 : NULL);
+        if (tfsFlush(&client) < 0 || tfsReceive(&client, &response) < 0)
+            break;
+        printf("Resposta Recebida: status %d inumber %d\n", response.status, response.inumber);
+        if (token == TFS_LIST && response.status == TFS_OK) {
+            size_t i;
+            /* the payload is the names, each one '\0' terminated */
+            for (i = 0; i < response.payloadSize; i += strlen(response.payload + i) + 1)
+                printf("  %s\n", response.payload + i);
+        }
+    }
+
+    tfsUnmount(&client);
+    return 0;
+}
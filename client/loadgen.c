@@ -0,0 +1,269 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Load generator. Every thread has its own connection and keeps up to
+   `pipeline` requests in flight. The operations either come from a
+   script in the format of inputs/ (its lines are dealt round-robin to
+   the threads) or are synthesized from a mix of lookups, creates and
+   deletes over a key space with a zipfian skew.
+
+   Usage: tecnicofs-loadgen [-a socket] [-t threads] [-p pipeline]
+            [-f script [-R repeat]] |
+            [-n ops_per_thread] [-k keys] [-r read_ratio] [-z skew] [-l name_length] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include "tecnicofs-client-api.h"
+#include "../server.h"
+
+typedef struct operation {
+    char opcode;
+    char name1[MAX_INPUT_SIZE];
+    char name2[MAX_INPUT_SIZE];
+} operation;
+
+typedef struct worker {
+    pthread_t tid;
+    int id;
+    operation* ops;
+    long numOps;
+    long* latency;      /* ns per operation */
+    long errors;
+} worker;
+
+static char* address = UNIXSTR_PATH;
+static int threads = 4, pipelineDepth = 1, repeat = 1, nameLength = 16;
+static long opsPerThread = 100000, keys = 10000;
+static double readRatio = 0.9, skew = 0.0;
+static char* script = NULL;
+
+static double* zipfCdf;
+
+static long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static void usage(char* appName) {
+    fprintf(stderr, "Usage: %s [-a socket] [-t threads] [-p pipeline] "
+            "[-f script [-R repeat]] | [-n ops_per_thread] [-k keys] "
+            "[-r read_ratio] [-z skew] [-l name_length]\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+static void* xmalloc(size_t size) {
+    void* p = malloc(size);
+    if (!p) {
+        perror("loadgen: malloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* skew 0 is uniform, around 1 most accesses go to a few keys */
+static void init_zipf() {
+    double sum = 0;
+    long i;
+
+    zipfCdf = xmalloc(keys * sizeof(double));
+    for (i = 0; i < keys; i++)
+        zipfCdf[i] = (sum += 1.0 / pow(i + 1, skew));
+    for (i = 0; i < keys; i++)
+        zipfCdf[i] /= sum;
+}
+
+static long pick_key(unsigned int* seed) {
+    double u = (double) rand_r(seed) / ((double) RAND_MAX + 1);
+    long low = 0, high = keys - 1;
+
+    while (low < high) {
+        long mid = (low + high) / 2;
+        if (zipfCdf[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static void key_name(char* name, long key) {
+    /* the key number padded with 'x' up to nameLength */
+    int n = snprintf(name, MAX_INPUT_SIZE, "k%ld", key);
+    while (n < nameLength && n < MAX_INPUT_SIZE - 1)
+        name[n++] = 'x';
+    name[n] = '\0';
+}
+
+static void synthesize(worker* w) {
+    unsigned int seed = 42 + w->id;
+    long i;
+
+    w->numOps = opsPerThread;
+    w->ops = xmalloc(w->numOps * sizeof(operation));
+    for (i = 0; i < w->numOps; i++) {
+        operation* op = &w->ops[i];
+        double u = (double) rand_r(&seed) / ((double) RAND_MAX + 1);
+
+        if (u < readRatio)
+            op->opcode = TFS_LOOKUP;
+        else
+            op->opcode = rand_r(&seed) % 2 ? TFS_CREATE : TFS_DELETE;
+        key_name(op->name1, pick_key(&seed));
+        op->name2[0] = '\0';
+    }
+}
+
+static void load_script(worker* workers) {
+    char line[MAX_INPUT_SIZE];
+    long lineNumber = 0;
+    FILE* fp = fopen(script, "r");
+    int i;
+
+    if (!fp) {
+        fprintf(stderr, "loadgen: could not read %s\n", script);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < threads; i++) {
+        workers[i].numOps = 0;
+        workers[i].ops = NULL;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        operation op;
+        int numTokens = sscanf(line, "%c %s %s", &op.opcode, op.name1, op.name2);
+
+        if (numTokens < 2 || op.opcode == '#' || (op.opcode == TFS_RENAME && numTokens < 3))
+            continue;
+        if (op.opcode != TFS_RENAME)
+            op.name2[0] = '\0';
+
+        worker* w = &workers[lineNumber++ % threads];
+        for (i = 0; i < repeat; i++) {
+            w->ops = realloc(w->ops, (w->numOps + 1) * sizeof(operation));
+            if (!w->ops) {
+                perror("loadgen: realloc");
+                exit(EXIT_FAILURE);
+            }
+            w->ops[w->numOps++] = op;
+        }
+    }
+    fclose(fp);
+}
+
+static void* run_worker(void* arg) {
+    worker* w = arg;
+    long* sentAt = xmalloc(pipelineDepth * sizeof(long));
+    tfsClient client;
+    long sent = 0, received = 0;
+
+    if (tfsMount(&client, address) < 0)
+        exit(EXIT_FAILURE);
+
+    while (received < w->numOps) {
+        /* fill the pipeline, then write it all at once */
+        while (sent < w->numOps && sent - received < pipelineDepth) {
+            operation* op = &w->ops[sent];
+            tfsSend(&client, op->opcode, op->name1, op->name2[0] ? op->name2 : NULL);
+            sentAt[sent % pipelineDepth] = now_ns();
+            sent++;
+        }
+        if (tfsFlush(&client) < 0)
+            exit(EXIT_FAILURE);
+
+        tfsResponse response;
+        if (tfsReceive(&client, &response) < 0)
+            exit(EXIT_FAILURE);
+        /* responses come in request order, ids start at 1 */
+        long i = (long) response.id - 1;
+        w->latency[received++] = now_ns() - sentAt[i % pipelineDepth];
+        if (response.status == TFS_INVALID)
+            w->errors++;
+    }
+
+    tfsUnmount(&client);
+    free(sentAt);
+    return NULL;
+}
+
+static int cmp_long(const void* a, const void* b) {
+    long x = *(const long*) a, y = *(const long*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "a:t:p:f:R:n:k:r:z:l:")) != -1) {
+        switch (opt) {
+            case 'a': address = optarg; break;
+            case 't': threads = atoi(optarg); break;
+            case 'p': pipelineDepth = atoi(optarg); break;
+            case 'f': script = optarg; break;
+            case 'R': repeat = atoi(optarg); break;
+            case 'n': opsPerThread = atol(optarg); break;
+            case 'k': keys = atol(optarg); break;
+            case 'r': readRatio = atof(optarg); break;
+            case 'z': skew = atof(optarg); break;
+            case 'l': nameLength = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (threads < 1 || pipelineDepth < 1 || repeat < 1 || keys < 1 ||
+        opsPerThread < 1 || nameLength >= MAX_INPUT_SIZE)
+        usage(argv[0]);
+
+    worker* workers = xmalloc(threads * sizeof(worker));
+    if (script)
+        load_script(workers);
+    else
+        init_zipf();
+
+    long total = 0;
+    for (i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].errors = 0;
+        if (!script)
+            synthesize(&workers[i]);
+        total += workers[i].numOps;
+    }
+
+    long* latency = xmalloc((total ? total : 1) * sizeof(long));
+    long offset = 0;
+    for (i = 0; i < threads; i++) {
+        workers[i].latency = latency + offset;
+        offset += workers[i].numOps;
+    }
+
+    long start = now_ns();
+    for (i = 0; i < threads; i++)
+        pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+    long errors = 0;
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        errors += workers[i].errors;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    if (!total) {
+        fprintf(stderr, "loadgen: no operations\n");
+        exit(EXIT_FAILURE);
+    }
+    qsort(latency, total, sizeof(long), cmp_long);
+    printf("threads=%d pipeline=%d ops=%ld errors=%ld seconds=%.3f ops_per_s=%.0f "
+           "p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+           threads, pipelineDepth, total, errors, seconds, total / seconds,
+           latency[total / 2] / 1e3, latency[total * 9 / 10] / 1e3,
+           latency[total * 99 / 100] / 1e3, latency[total * 999 / 1000] / 1e3,
+           latency[total - 1] / 1e3);
+
+    for (i = 0; i < threads; i++)
+        free(workers[i].ops);
+    free(workers);
+    free(latency);
+    free(zipfCdf);
+    return 0;
+}
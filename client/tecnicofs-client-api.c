@@ -0,0 +1,381 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include "tecnicofs-client-api.h"
+
+int tfsMount(tfsClient* client, char* address) {
+    struct sockaddr_un end_serv;
+
+    memset(client, 0, sizeof(tfsClient));
+    if ((client->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("Erro ao criar Socket Cliente");
+        return -1;
+    }
+
+    memset(&end_serv, 0, sizeof(end_serv));
+    end_serv.sun_family = AF_UNIX;
+    strncpy(end_serv.sun_path, address, sizeof(end_serv.sun_path) - 1);
+    if (connect(client->fd, (struct sockaddr*) &end_serv, sizeof(end_serv)) < 0) {
+        perror("Erro ao realizar Connect");
+        close(client->fd);
+        return -1;
+    }
+    client->nextId = 1;
+    return 0;
+}
+
+int tfsUnmount(tfsClient* client) {
+    int ret = close(client->fd);
+
+    buffer_free(&client->in);
+    buffer_free(&client->out);
+    client->fd = -1;
+    return ret;
+}
+
+/* Queues a request, nothing is written until tfsFlush.
+   Returns the id its response will carry */
+uint32_t tfsSend(tfsClient* client, char opcode, char* name1, char* name2) {
+    uint32_t id = client->nextId++;
+
+    tfs_encode_request(&client->out, id, opcode, name1, name2);
+    return id;
+}
+
+int tfsFlush(tfsClient* client) {
+    tfsBuffer* out = &client->out;
+
+    while (out->start < out->end) {
+        ssize_t n = write(client->fd, out->data + out->start, out->end - out->start);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Erro no write Cliente");
+            return -1;
+        }
+        buffer_consume(out, n);
+    }
+    return 0;
+}
+
+/* Waits for the next response. Its payload is only valid
+   until the next call on this client */
+int tfsReceive(tfsClient* client, tfsResponse* response) {
+    int parsed;
+
+    while ((parsed = tfs_parse_response(&client->in, response)) == 0) {
+        ssize_t n = read(client->fd, buffer_reserve(&client->in, 4096), 4096);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("Erro no read Cliente");
+            return -1;
+        }
+        client->in.end += n;
+    }
+    return parsed < 0 ? -1 : 0;
+}
+
+static int call(tfsClient* client, char opcode, char* name1, char* name2) {
+    tfsResponse response;
+
+    tfsSend(client, opcode, name1, name2);
+    if (tfsFlush(client) < 0 || tfsReceive(client, &response) < 0)
+        return TFS_INVALID;
+    return response.status == TFS_OK ? response.inumber : response.status;
+}
+
+int tfsCreate(tfsClient* client, char* name) {
+    return call(client, TFS_CREATE, name, NULL);
+}
+
+int tfsLookup(tfsClient* client, char* name) {
+    return call(client, TFS_LOOKUP, name, NULL);
+}
+
+int tfsDelete(tfsClient* client, char* name) {
+    return call(client, TFS_DELETE, name, NULL);
+}
+
+int tfsRename(tfsClient* client, char* oldName, char* newName) {
+    return call(client, TFS_RENAME, oldName, newName);
+}
+
+int tfsMkdir(tfsClient* client, char* name) {
+    return call(client, TFS_MKDIR, name, NULL);
+}
+
+int tfsList(tfsClient* client, char* name, void (*visit)(char* name, void* arg), void* arg) {
+    tfsResponse response;
+    size_t i = 0;
+
+    tfsSend(client, TFS_LIST, name, NULL);
+    if (tfsFlush(client) < 0 || tfsReceive(client, &response) < 0)
+        return TFS_INVALID;
+    if (response.status != TFS_OK)
+        return response.status;
+
+    while (i < response.payloadSize) {
+        char* entry = response.payload + i;
+        size_t length = strnlen(entry, response.payloadSize - i);
+
+        if (i + length == response.payloadSize)
+            break; /* not terminated */
+        visit(entry, arg);
+        i += length + 1;
+    }
+    return response.inumber;
+}
+
+int tfsScan(tfsClient* client, char* pattern, void (*visit)(char* name, void* arg), void* arg) {
+    char after[MAX_INPUT_SIZE] = "";
+    tfsResponse response;
+    int total = 0;
+
+    do {
+        size_t i = 0;
+
+        tfs_encode_scan_request(&client->out, client->nextId++, pattern, after, TFS_SCAN_PAGE);
+        if (tfsFlush(client) < 0 || tfsReceive(client, &response) < 0)
+            return TFS_INVALID;
+        if (response.status != TFS_OK)
+            return response.status;
+
+        while (i < response.payloadSize) {
+            char* entry = response.payload + i;
+            size_t length = strnlen(entry, response.payloadSize - i);
+
+            if (i + length == response.payloadSize || length >= MAX_INPUT_SIZE)
+                return TFS_INVALID;
+            visit(entry, arg);
+            strcpy(after, entry);
+            i += length + 1;
+        }
+        total += response.inumber;
+    } while (response.inumber == TFS_SCAN_PAGE);
+    return total;
+}
+
+/* One request of the file calls, the response payload is only valid
+   until the next call */
+static int fileCall(tfsClient* client, char opcode, char* name, int arg, uint32_t count,
+                    const void* data, size_t size, tfsResponse* response) {
+    tfs_encode_file_request(&client->out, client->nextId++, opcode, name, arg, count, data, size);
+    if (tfsFlush(client) < 0 || tfsReceive(client, response) < 0)
+        return TFS_INVALID;
+    return response->status == TFS_OK ? response->inumber : response->status;
+}
+
+int tfsCreateFile(tfsClient* client, char* name, int ownerPermissions, int othersPermissions) {
+    tfsResponse response;
+
+    return fileCall(client, TFS_CREATE, name, TFS_PERMISSIONS(ownerPermissions, othersPermissions),
+                    0, NULL, 0, &response);
+}
+
+int tfsOpen(tfsClient* client, char* name, int mode) {
+    tfsResponse response;
+
+    return fileCall(client, TFS_OPEN, name, mode, 0, NULL, 0, &response);
+}
+
+int tfsClose(tfsClient* client, int fd) {
+    tfsResponse response;
+
+    return fileCall(client, TFS_CLOSE, NULL, fd, 0, NULL, 0, &response);
+}
+
+int tfsBatch(tfsClient* client, tfsBatchOp* ops, int count, int ownerPermissions,
+             int othersPermissions) {
+    tfsBuffer data;
+    tfsResponse response;
+    int first, last, i, result = TFS_OK;
+
+    for (i = 0; i < count; i++)
+        ops[i].result = TFS_INVALID;
+    buffer_init(&data);
+    for (first = 0; first < count; first = last) {
+        /* as many ops as the data of a request holds */
+        data.start = data.end = 0;
+        for (last = first; last < count; last++) {
+            size_t length = strlen(ops[last].name) + 1;
+
+            if (last > first && data.end + 1 + length > TFS_MAX_DATA)
+                break;
+            buffer_append(&data, &ops[last].opcode, 1);
+            buffer_append(&data, ops[last].name, length);
+        }
+
+        tfs_encode_file_request(&client->out, client->nextId++, TFS_BATCH, NULL,
+                                TFS_PERMISSIONS(ownerPermissions, othersPermissions),
+                                last - first, data.data, data.end);
+        if (tfsFlush(client) < 0 || tfsReceive(client, &response) < 0 ||
+            response.status != TFS_OK || response.inumber != last - first ||
+            response.payloadSize != (size_t) (last - first) * sizeof(int32_t)) {
+            result = TFS_INVALID;
+            break;
+        }
+        for (i = first; i < last; i++)
+            memcpy(&ops[i].result, response.payload + (i - first) * sizeof(int32_t),
+                   sizeof(int32_t));
+    }
+    buffer_free(&data);
+    return result;
+}
+
+/* Waits for the header of the next response, its payload is then left
+   to be read from the socket after the bytes already in client->in */
+static int receiveHeader(tfsClient* client, tfsResponse* response) {
+    tfsBuffer* in = &client->in;
+    int parsed;
+
+    while ((parsed = tfs_parse_response_header(in, response)) == 0) {
+        ssize_t n = read(client->fd, buffer_reserve(in, 4096), 4096);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("Erro no read Cliente");
+            return -1;
+        }
+        in->end += n;
+    }
+    return parsed < 0 ? -1 : 0;
+}
+
+/* Response to a read, its payload read from the socket straight into
+   dest instead of going through client->in.
+   Returns the bytes read or a TFS_* status */
+static int receiveData(tfsClient* client, char* dest, size_t size) {
+    tfsBuffer* in = &client->in;
+    tfsResponse response;
+    size_t done;
+
+    if (receiveHeader(client, &response) < 0 || response.payloadSize > size)
+        return TFS_INVALID;
+
+    /* what came along with the header */
+    done = in->end - in->start < response.payloadSize ? in->end - in->start
+                                                      : response.payloadSize;
+    memcpy(dest, in->data + in->start, done);
+    buffer_consume(in, done);
+
+    while (done < response.payloadSize) {
+        ssize_t n = read(client->fd, dest + done, response.payloadSize - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("Erro no read Cliente");
+            return TFS_INVALID;
+        }
+        done += n;
+    }
+    if (response.status != TFS_OK)
+        return response.status;
+    return (size_t) response.inumber == done ? response.inumber : TFS_INVALID;
+}
+
+/* Reads until size bytes or the end of the file */
+int tfsRead(tfsClient* client, int fd, char* buffer, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        size_t count = size - done < TFS_MAX_READ ? size - done : TFS_MAX_READ;
+        int n;
+
+        tfs_encode_file_request(&client->out, client->nextId++, TFS_READ, NULL, fd, count, NULL, 0);
+        if (tfsFlush(client) < 0)
+            return TFS_INVALID;
+        n = receiveData(client, buffer + done, count);
+        if (n < 0)
+            return n;
+        done += n;
+        if ((size_t) n < count)
+            break;
+    }
+    return (int) done;
+}
+
+int tfsWrite(tfsClient* client, int fd, const char* buffer, size_t size) {
+    tfsResponse response;
+    size_t done = 0;
+
+    do {
+        size_t count = size - done < TFS_MAX_DATA ? size - done : TFS_MAX_DATA;
+        int n = fileCall(client, TFS_WRITE, NULL, fd, 0, buffer + done, count, &response);
+
+        if (n < 0)
+            return n;
+        done += n;
+    } while (done < size);
+    return (int) done;
+}
+
+int tfsStatFile(tfsClient* client, char* name, tfsStat* st) {
+    tfsResponse response;
+    int result = fileCall(client, TFS_STAT, name, 0, 0, NULL, 0, &response);
+
+    if (result >= 0) {
+        if (response.payloadSize != sizeof(tfsStat))
+            return TFS_INVALID;
+        memcpy(st, response.payload, sizeof(tfsStat));
+    }
+    return result;
+}
+
+/* Sends a request without arguments and writes the payload of its
+   response to fd as it arrives */
+static int receiveToFd(tfsClient* client, char opcode, int fd) {
+    tfsBuffer* in = &client->in;
+    tfsResponse response;
+    char buffer[65536];
+    size_t done = 0;
+
+    tfsSend(client, opcode, NULL, NULL);
+    if (tfsFlush(client) < 0 || receiveHeader(client, &response) < 0)
+        return TFS_INVALID;
+    if (response.status != TFS_OK)
+        return response.status;
+
+    while (done < response.payloadSize) {
+        size_t want = response.payloadSize - done;
+        char* data = in->data + in->start;
+        ssize_t n = in->end - in->start;
+
+        if (n > 0) {
+            /* what came along with the header first */
+            if ((size_t) n > want)
+                n = want;
+            buffer_consume(in, n);
+        }
+        else {
+            data = buffer;
+            n = read(client->fd, buffer, want < sizeof(buffer) ? want : sizeof(buffer));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                perror("Erro no read Cliente");
+                return TFS_INVALID;
+            }
+        }
+        if (write(fd, data, n) != n) {
+            perror("Erro ao escrever resposta");
+            return TFS_INVALID;
+        }
+        done += n;
+    }
+    return TFS_OK;
+}
+
+int tfsDump(tfsClient* client, int fd) {
+    return receiveToFd(client, TFS_DUMP, fd);
+}
+
+int tfsStats(tfsClient* client, int fd) {
+    return receiveToFd(client, TFS_STATS, fd);
+}
@@ -0,0 +1,79 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef TECNICOFS_CLIENT_API_H
+#define TECNICOFS_CLIENT_API_H
+
+#include "../protocol.h"
+
+/* One connection to the server. The synchronous calls send a request and
+   wait for its response; tfsSend/tfsFlush/tfsReceive pipeline any number
+   of requests before reading their responses back in order. A tfsClient
+   is not meant to be shared between threads. */
+typedef struct tfsClient {
+    int fd;
+    uint32_t nextId;
+    tfsBuffer in, out;
+} tfsClient;
+
+int tfsMount(tfsClient* client, char* address);
+int tfsUnmount(tfsClient* client);
+
+/* Return the inumber (>0) of the file or a TFS_* status (<0) */
+int tfsCreate(tfsClient* client, char* name);
+int tfsLookup(tfsClient* client, char* name);
+int tfsDelete(tfsClient* client, char* name);
+int tfsRename(tfsClient* client, char* oldName, char* newName);
+int tfsMkdir(tfsClient* client, char* name);
+
+/* Calls visit on the names in the directory and returns how many
+   entries it has, or a TFS_* status. A listing too big for one
+   response visits fewer names than the count it returns. */
+int tfsList(tfsClient* client, char* name, void (*visit)(char* name, void* arg), void* arg);
+
+/* Calls visit on the names starting with prefix in directory, for a
+   pattern "directory/prefix" ("prefix" in the root), in name order.
+   They come in pages of TFS_SCAN_PAGE names, so a big directory is
+   never locked for the whole listing. Returns how many, or a TFS_*
+   status */
+#define TFS_SCAN_PAGE  256
+int tfsScan(tfsClient* client, char* pattern, void (*visit)(char* name, void* arg), void* arg);
+
+/* Files. Permissions and modes are TFS_PERM_*, reads and writes go on
+   from where the previous one on the fd stopped.
+   Return the fd, the bytes read or written, or a TFS_* status (<0) */
+int tfsCreateFile(tfsClient* client, char* name, int ownerPermissions, int othersPermissions);
+int tfsOpen(tfsClient* client, char* name, int mode);
+int tfsClose(tfsClient* client, int fd);
+int tfsRead(tfsClient* client, int fd, char* buffer, size_t size);
+int tfsWrite(tfsClient* client, int fd, const char* buffer, size_t size);
+int tfsStatFile(tfsClient* client, char* name, tfsStat* st);
+
+/* Writes every name in the fs to fd, as the server prints them in its
+   output file, all as they were at one point in time */
+int tfsDump(tfsClient* client, int fd);
+
+/* Writes the latencies and counters of the server to fd, as JSON */
+int tfsStats(tfsClient* client, int fd);
+
+/* An op of tfsBatch: TFS_CREATE, TFS_DELETE or TFS_LOOKUP of name.
+   result is what tfsCreate, tfsDelete or tfsLookup would return */
+typedef struct tfsBatchOp {
+    char opcode;
+    char* name;
+    int result;
+} tfsBatchOp;
+
+/* Applies count ops in as few requests as they fit in, the server
+   locks each bucket once for all the ops of a request on it. Only ops
+   on the same name keep their order. Files are created with the
+   permissions given. Returns TFS_OK, or TFS_INVALID if the server could
+   not be reached or took a request as invalid (the ops of the requests
+   not answered are left with TFS_INVALID) */
+int tfsBatch(tfsClient* client, tfsBatchOp* ops, int count, int ownerPermissions,
+             int othersPermissions);
+
+uint32_t tfsSend(tfsClient* client, char opcode, char* name1, char* name2);
+int tfsFlush(tfsClient* client);
+int tfsReceive(tfsClient* client, tfsResponse* response);
+
+#endif /* TECNICOFS_CLIENT_API_H */
@@ -3,15 +3,20 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 #define MAX_INPUT_SIZE 100
-#define DELAY 5000
+#ifndef DELAY
+    #define DELAY 5000
+#endif
 
-#if defined (RWLOCK) || defined (MUTEX)
-    #define MAX_COMMANDS 10  /* max commands in queue for sync versions */
+#if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+    #define MAX_COMMANDS 4096  /* max commands in queue for sync versions */
 #else
     #define MAX_COMMANDS 150000  /* max commands for no-sync */
 #endif
+#define COMMAND_BATCH 16   /* commands a worker takes from the queue at once */
 
 // if enabled => RWLOCK, else MUTEX
 // #define RWLOCK
 
+#define OPTIMISTIC_RETRIES 3   /* seqlock lookups before taking the lock */
+
 #endif /* CONSTANTS_H */
@@ -5,108 +5,1895 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "sync.h"
+#include "stats.h"
 
+/* "<parent inumber>/<name>" */
+#define ENTRY_KEY_SIZE (MAX_INPUT_SIZE + 12)
 
+/* In the builds of fs-check (bench/fs_check.c) the other threads run
+ * between the steps that publish a split, so that steps in the wrong
+ * order show up there as wrong lookups instead of as a rare race */
+#ifdef FS_CHECK
+#define check_pause() sched_yield()
+#else
+#define check_pause()
+#endif
+
+static directory* make_directory(tecnicofs* fs, int inumber, int parent);
+static void release_inode(inode* i);
+static void release_file(tecnicofs* fs, int inumber);
+
+/* Safe to call from any thread, no lock needed */
 int obtainNewInumber(tecnicofs* fs) {
-	int newInumber = ++(fs->nextINumber);
+	int newInumber = __atomic_add_fetch(&fs->nextINumber, 1, __ATOMIC_RELAXED);
 	return newInumber;
 }
 
-tecnicofs* new_tecnicofs() {
+static bst* get_bucket(tecnicofs* fs, int index) {
+	return &(fs->segments[index / SEGMENT_SIZE][index % SEGMENT_SIZE]);
+}
+
+/* Largest baseBuckets * 2^k that is not above size: buckets below
+ * size - level have already been split in the current round. */
+static int table_level(tecnicofs* fs, int size) {
+	int level = fs->baseBuckets;
+
+	while (level <= size / 2)
+		level *= 2;
+	return level;
+}
+
+/* The hash of an entry key that picks its bucket, shard and filter bits:
+ * the top bits of hash_key, only as many as a tree node keeps of it */
+static uint64_t key_hash(char* key) {
+	return hash_key(key) >> (64 - NODE_HASH_BITS);
+}
+
+static int bucket_index(tecnicofs* fs, uint64_t h, int size) {
+	int level = table_level(fs, size);
+	int index = (int) (h % (uint64_t) level);
+
+	if (index < size - level)
+		index = (int) (h % (uint64_t) (2 * level));
+	return index;
+}
+
+static int table_size(tecnicofs* fs) {
+	return __atomic_load_n(&fs->sizeBuckets, __ATOMIC_ACQUIRE);
+}
+
+/* Locks bucket index, accounting the wait if it was busy (see stats.h) */
+static void wait_bucket(tecnicofs* fs, int index, int write) {
+	bst* b = get_bucket(fs, index);
+	uint64_t waited = write ? sync_wrlock_wait(&(b->bstLock)) : sync_rdlock_wait(&(b->bstLock));
+
+	if (waited) {
+		/* readers may share the lock */
+		__atomic_add_fetch(&b->waitNs, waited, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&b->contended, 1, __ATOMIC_RELAXED);
+		stats_lock_wait(waited);
+	}
+}
+
+/* Locks the bucket holding the key of hash h and returns its index. A
+ * split may move the key to another bucket between hashing and locking,
+ * so the index is validated once the lock is held (a split of a bucket
+ * holds its lock). */
+static int lock_bucket(tecnicofs* fs, uint64_t h, int write) {
+	while (1) {
+		int index = bucket_index(fs, h, table_size(fs));
+
+		wait_bucket(fs, index, write);
+		if (bucket_index(fs, h, table_size(fs)) == index)
+			return index;
+		sync_unlock(&(get_bucket(fs, index)->bstLock));
+	}
+}
+
+static void unlock_bucket(tecnicofs* fs, int index) {
+	sync_unlock(&(get_bucket(fs, index)->bstLock));
+}
+
+/* Binary search in the sorted image records of a bucket.
+ * Returns the inumber of name, or 0 */
+static int image_search(tecnicofs* fs, imageRecord* records, int size, char* name) {
+	int low = 0, high = size - 1;
+
+	while (low <= high) {
+		int middle = low + (high - low) / 2;
+		int comp = strcmp(name, fs->imageStrings + records[middle].name);
+
+		if (!comp)
+			return records[middle].inumber;
+		if (comp < 0)
+			high = middle - 1;
+		else
+			low = middle + 1;
+	}
+	return 0;
+}
+
+/* Inumber of name in a locked bucket, or 0 */
+static int bucket_search(tecnicofs* fs, bst* b, char* name) {
+	if (b->image)
+		return image_search(fs, b->image, b->imageSize, name);
+
+	node* searchNode = search(b->bstRoot, name);
+	return searchNode ? searchNode->inumber : 0;
+}
+
+/* Word of the Bloom filter of a bucket that the key of hash h sets, and
+ * its bits in mask. The bucket comes from the low digits of h, so the
+ * bits are taken from the high ones of h mixed again. */
+static int filter_bits(uint64_t h, uint64_t* mask) {
+	uint64_t g = h * 0x9e3779b97f4a7c15ULL;
+
+	*mask = 1ULL << ((g >> 52) & 63) | 1ULL << ((g >> 46) & 63) | 1ULL << ((g >> 40) & 63);
+	return (int) ((g >> 58) % FILTER_WORDS);
+}
+
+/* False if the key of hash h is surely not in bucket b. It may be read
+ * without the lock: the bits of a key are set before it is inserted and
+ * only cleared once it is gone. A bucket still in the image has no filter. */
+static int filter_has(bst* b, uint64_t h) {
+	uint64_t mask;
+	int word = filter_bits(h, &mask);
+
+	if (__atomic_load_n(&b->image, __ATOMIC_ACQUIRE))
+		return 1;
+	return (__atomic_load_n(&b->filter[word], __ATOMIC_ACQUIRE) & mask) == mask;
+}
+
+/* Before the key of hash h is inserted in write locked bucket b */
+static void filter_add(bst* b, uint64_t h) {
+	uint64_t mask;
+	int word = filter_bits(h, &mask);
+
+	__atomic_or_fetch(&b->filter[word], mask, __ATOMIC_RELEASE);
+	b->filterKeys++;
+}
+
+struct filterArg {
+	uint64_t words[FILTER_WORDS];
+	int keys;
+};
+
+static void filter_node(node* p, void* arg) {
+	struct filterArg* rebuilt = (struct filterArg*) arg;
+	uint64_t mask;
+
+	rebuilt->words[filter_bits(p->hash, &mask)] |= mask;
+	rebuilt->keys++;
+}
+
+/* Sets the filter of write locked bucket b to the keys in its tree only.
+ * A reader may see old and new words mixed, which is fine: the bits of
+ * the keys still there are set in both. */
+static void filter_rebuild(bst* b) {
+	struct filterArg rebuilt = { { 0 }, 0 };
 	int i;
 
-	tecnicofs*fs = malloc(sizeof(tecnicofs));
-	if (!fs) {
-		perror("failed to allocate tecnicofs");
+	traverse_tree(b->bstRoot, filter_node, &rebuilt);
+	check_pause();
+	for (i = 0; i < FILTER_WORDS; i++)
+		__atomic_store_n(&b->filter[i], rebuilt.words[i], __ATOMIC_RELEASE);
+	b->filterKeys = rebuilt.keys;
+	b->filterStale = 0;
+	check_pause();
+}
+
+/* After a key is removed from write locked bucket b. Its bits stay set,
+ * letting lookups of it through, until the filter is rebuilt: each
+ * rebuild walks the tree once, so it waits for a share of the keys to be
+ * gone to cost no more than a few nodes per removal. */
+static void filter_removed(bst* b) {
+	if (++b->filterStale * FILTER_PURGE >= b->filterKeys)
+		filter_rebuild(b);
+}
+
+/* bucket_search in locked bucket b, unless its filter rules name out */
+static int filtered_search(tecnicofs* fs, bst* b, char* name, uint64_t h) {
+	int inumber;
+
+	if (!filter_has(b, h)) {
+		stats_filter(FILTER_SKIPPED);
+		return 0;
+	}
+	inumber = bucket_search(fs, b, name);
+	stats_filter(inumber ? FILTER_FOUND : FILTER_MISSED);
+	return inumber;
+}
+
+/* Copy on write of a bucket still in the image: its files are moved into
+ * the tree before the first change. Called with the bucket write locked. */
+static void promote_bucket(tecnicofs* fs, bst* b) {
+	int i, inserted;
+
+	if (!b->image)
+		return;
+
+	seq_write_begin(&b->bstSeq);
+	for (i = 0; i < b->imageSize; i++) {
+		char* name = fs->imageStrings + b->image[i].name;
+		uint64_t h = key_hash(name);
+
+		filter_add(b, h);
+		b->bstRoot = insert(&b->pool, b->bstRoot, name, h, b->image[i].inumber, &inserted);
+	}
+	/* the filter is used from here on */
+	__atomic_store_n(&b->image, NULL, __ATOMIC_RELEASE);
+	seq_write_end(&b->bstSeq);
+}
+
+/* What print_tecnicofs_tree prints for a bucket, read or write locked */
+static void print_bucket(tecnicofs* fs, bst* b, FILE* fp) {
+	int i;
+
+	if (b->image) {
+		fprintf(fp, "\n");
+		for (i = 0; i < b->imageSize; i++)
+			fprintf(fp, "  %s\n", fs->imageStrings + b->image[i].name);
+	}
+	else if (b->bstRoot)
+		print_tree(fp, b->bstRoot);
+}
+
+/* The dump running, if any. An operation reads it once, with all of the
+ * buckets it changes write locked, so it is either wholly in the dump or
+ * not at all. */
+static fsDump* running_dump(tecnicofs* fs) {
+	return __atomic_load_n(&fs->dump, __ATOMIC_SEQ_CST);
+}
+
+/* Copy on write for a dump: before the first change to bucket index
+ * since the dump began, what the dump prints for it is saved. Buckets
+ * appended after it began are not in it. */
+static void dump_save(tecnicofs* fs, fsDump* dump, int index) {
+	FILE* fp;
+
+	if (!dump || index >= dump->size || dump->saved[index])
+		return;
+	fp = open_memstream(&dump->text[index], &dump->length[index]);
+	if (!fp) {
+		perror("failed to save a bucket");
 		exit(EXIT_FAILURE);
 	}
+	print_bucket(fs, get_bucket(fs, index), fp);
+	fclose(fp);
+	dump->saved[index] = 1;
+}
 
-	fs->bsts = (bst *) calloc(numBuckets, sizeof(bst));
-	if (!fs->bsts) {
+static void alloc_segment(tecnicofs* fs, int segment) {
+	int i;
+
+	bst* buckets = (bst *) calloc(SEGMENT_SIZE, sizeof(bst));
+	if (!buckets) {
 		perror("failed to allocate tecnicofs");
 		exit(EXIT_FAILURE);
 	}
 
-	fs->nextINumber = 0;
-	for (i = 0; i < numBuckets; i++) {
+	for (i = 0; i < SEGMENT_SIZE; i++) {
 		/* bst initialization */
-		fs->bsts[i].bstRoot = NULL;
-		sync_init(&(fs->bsts[i].bstLock));
+		buckets[i].bstRoot = NULL;
+		pool_init(&(buckets[i].pool));
+		sync_init(&(buckets[i].bstLock));
+		sync_profile_name(&(buckets[i].bstLock), "bucket", segment * SEGMENT_SIZE + i);
+	}
+	fs->segments[segment] = buckets;
+}
+
+struct splitArg {
+	tecnicofs* fs;
+	int size;
+	int target;
+};
+
+static int moves_to_target(node* p, void* arg) {
+	struct splitArg* split = (struct splitArg*) arg;
+
+	return bucket_index(split->fs, p->hash, split->size) == split->target;
+}
+
+/* Splits the next bucket of the current round into itself and a new
+ * bucket appended at the end of the table. Only those two buckets are
+ * locked; lookups on every other bucket keep running. */
+static void split_bucket(tecnicofs* fs) {
+	mutex_lock(&fs->splitLock);
+
+	int size = fs->sizeBuckets;
+	if (__atomic_load_n(&fs->numFiles, __ATOMIC_RELAXED) <= MAX_LOAD * size || size == MAX_SEGMENTS * SEGMENT_SIZE) {
+		/* someone else already grew the table */
+		mutex_unlock(&fs->splitLock);
+		return;
+	}
+
+	if (!fs->segments[size / SEGMENT_SIZE])
+		alloc_segment(fs, size / SEGMENT_SIZE);
+
+	int old = size - table_level(fs, size);
+	bst* from = get_bucket(fs, old);
+	bst* to = get_bucket(fs, size);
+	struct splitArg split = { fs, size + 1, size };
+
+	// old < size, same lock order as renameFile
+	wait_bucket(fs, old, 1);
+	wait_bucket(fs, size, 1);
+	dump_save(fs, running_dump(fs), old);
+	promote_bucket(fs, from);
+
+	seq_write_begin(&from->bstSeq);
+	seq_write_begin(&to->bstSeq);
+	split_tree(&from->pool, &from->bstRoot, &to->pool, &to->bstRoot,
+		moves_to_target, &split);
+	filter_rebuild(to);
+	__atomic_store_n(&fs->sizeBuckets, size + 1, __ATOMIC_RELEASE);
+	check_pause();
+	/* only once a lookup that reads the filter would find the table grown */
+	filter_rebuild(from);
+	seq_write_end(&to->bstSeq);
+	seq_write_end(&from->bstSeq);
+
+	sync_unlock(&(to->bstLock));
+	sync_unlock(&(from->bstLock));
+
+	mutex_unlock(&fs->splitLock);
+}
+
+/* True if count items of itemSize at offset are inside size bytes */
+static int image_fits(uint64_t offset, uint64_t count, size_t itemSize, size_t size) {
+	return offset <= size && count <= (size - offset) / itemSize;
+}
+
+/* True if the names of count records are all in the strings, which end
+ * with a '\0', so every name read from there ends inside the mapping */
+static int image_names(imageRecord* records, uint64_t count, uint64_t stringsSize) {
+	uint64_t i;
+
+	for (i = 0; i < count; i++)
+		if (records[i].name >= stringsSize)
+			return 0;
+	return 1;
+}
+
+/* Maps the image at path, NULL if there is none */
+static imageHeader* map_image(tecnicofs* fs, char* path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return NULL;
+		fprintf(stderr, "Error: could not open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(imageHeader)) {
+		fprintf(stderr, "Error: %s is not an image\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("Erro ao mapear imagem");
+		exit(EXIT_FAILURE);
+	}
+	/* kept open: reads send file data straight from it (inode_ranges),
+	 * even once a snapshot has replaced the image */
+	fs->imageFd = fd;
+	/* the pages come in while the first requests are served */
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	imageHeader* header = (imageHeader*) map;
+	size_t size = st.st_size;
+	size_t buckets = (size_t) header->sizeBuckets + 1;
+
+	/* the layout, then the names of the records: the records are read
+	 * once here, the names they point at only when they are used */
+	if (memcmp(header->magic, IMAGE_MAGIC, 8) || header->version != IMAGE_VERSION ||
+		header->baseBuckets <= 0 || header->sizeBuckets < header->baseBuckets ||
+		header->sizeBuckets > MAX_SEGMENTS * SEGMENT_SIZE ||
+		!image_fits(header->recordsOffset, header->count, sizeof(imageRecord), size) ||
+		!image_fits(header->bucketsOffset, buckets, sizeof(uint64_t), size) ||
+		!image_fits(header->childrenOffset, header->childrenCount, sizeof(imageRecord), size) ||
+		!image_fits(header->directoriesOffset, header->directoriesCount, sizeof(imageDirectory), size) ||
+		!image_fits(header->stringsOffset, header->stringsSize, 1, size) ||
+		!image_fits(header->filesOffset, header->filesCount, sizeof(imageFile), size) ||
+		!image_fits(header->dataOffset, header->dataSize, 1, size) ||
+		(header->stringsSize && map[header->stringsOffset + header->stringsSize - 1]) ||
+		!image_names((imageRecord*) (map + header->recordsOffset), header->count,
+			header->stringsSize) ||
+		!image_names((imageRecord*) (map + header->childrenOffset), header->childrenCount,
+			header->stringsSize)) {
+		fprintf(stderr, "Error: %s is not an image\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	fs->imageMap = map;
+	fs->imageMapSize = size;
+	fs->imageStrings = map + header->stringsOffset;
+	fs->imageLsn = header->lsn;
+	return header;
+}
+
+/* Empty fs, or the one in the image at imagePath when there is one: its
+ * buckets are used from the mapping, nothing is inserted at startup. */
+tecnicofs* new_tecnicofs(char* imagePath) {
+	int i;
+
+	tecnicofs*fs = calloc(1, sizeof(tecnicofs));
+	if (!fs) {
+		perror("failed to allocate tecnicofs");
+		exit(EXIT_FAILURE);
+	}
+
+	fs->imageFd = -1;
+	imageHeader* header = imagePath ? map_image(fs, imagePath) : NULL;
+	int base = header ? header->baseBuckets : numBuckets;
+	int size = header ? header->sizeBuckets : numBuckets;
+
+	if (size > MAX_SEGMENTS * SEGMENT_SIZE) {
+		fprintf(stderr, "Error: at most %d buckets\n", MAX_SEGMENTS * SEGMENT_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	fs->nextINumber = header ? header->nextINumber : 0;
+	fs->numFiles = header ? header->count : 0;
+	fs->log = NULL;
+	fs->baseBuckets = base;
+	fs->sizeBuckets = size;
+	for (i = 0; i * SEGMENT_SIZE < size; i++)
+		alloc_segment(fs, i);
+	mutex_init(&fs->splitLock);
+	mutex_init(&fs->renameLock);
+	mutex_init(&fs->dumpLock);
+	sync_profile_name(&fs->splitLock, "split", -1);
+	sync_profile_name(&fs->renameLock, "rename", -1);
+	sync_profile_name(&fs->dumpLock, "dump", -1);
+	fs->dump = NULL;
+	inode_table_init(&fs->inodes);
+	fs->inodes.imageFd = fs->imageFd;
+	fs->inodes.imageMap = fs->imageMap;
+	fs->paths = pathcache_new();
+
+	if (!header)
+		make_directory(fs, ROOT_INUMBER, ROOT_INUMBER);
+	else {
+		char* map = (char*) fs->imageMap;
+		imageRecord* records = (imageRecord*) (map + header->recordsOffset);
+		uint64_t* buckets = (uint64_t*) (map + header->bucketsOffset);
+		imageRecord* children = (imageRecord*) (map + header->childrenOffset);
+		imageDirectory* directories = (imageDirectory*) (map + header->directoriesOffset);
+		imageFile* files = (imageFile*) (map + header->filesOffset);
+		uint64_t j;
+
+		for (i = 0; i < size; i++) {
+			if (buckets[i] > buckets[i + 1] || buckets[i + 1] > header->count) {
+				fprintf(stderr, "Error: %s is not an image\n", imagePath);
+				exit(EXIT_FAILURE);
+			}
+			if (buckets[i] < buckets[i + 1]) {
+				get_bucket(fs, i)->image = records + buckets[i];
+				get_bucket(fs, i)->imageSize = buckets[i + 1] - buckets[i];
+			}
+		}
+
+		for (j = 0; j < header->directoriesCount; j++) {
+			imageDirectory* entry = &directories[j];
+			if (entry->children > header->childrenCount ||
+				entry->count > header->childrenCount - entry->children) {
+				fprintf(stderr, "Error: %s is not an image\n", imagePath);
+				exit(EXIT_FAILURE);
+			}
+			directory* d = make_directory(fs, entry->inumber, entry->parent);
+			if (entry->count) {
+				d->image = children + entry->children;
+				d->imageSize = entry->count;
+			}
+		}
+		make_directory(fs, ROOT_INUMBER, ROOT_INUMBER);
+
+		/* the contents stay in the mapping until written */
+		for (j = 0; j < header->filesCount; j++) {
+			imageFile* entry = &files[j];
+			if (entry->data > header->dataSize || entry->size > header->dataSize - entry->data) {
+				fprintf(stderr, "Error: %s is not an image\n", imagePath);
+				exit(EXIT_FAILURE);
+			}
+			inode* file = inode_get(&fs->inodes, entry->inumber);
+			inode_init_file(file, entry->owner, entry->permissions, entry->ctime);
+			file->atime = entry->atime;
+			file->mtime = entry->mtime;
+			file->size = file->imageSize = entry->size;
+			file->image = map + header->dataOffset + entry->data;
+		}
 	}
 
 	return fs;
 }
 
 void free_tecnicofs(tecnicofs* fs) {
-	int i;
+	int i, j;
 
-	for (i = 0; i < numBuckets; i++) {
-		/* free memory used by bst */
-		free_tree(fs->bsts[i].bstRoot);
-		sync_destroy(&(fs->bsts[i].bstLock));
+	for (i = 0; i < MAX_SEGMENTS && fs->segments[i]; i++) {
+		for (j = 0; j < SEGMENT_SIZE; j++) {
+			/* free memory used by bst */
+			pool_destroy(&(fs->segments[i][j].pool));
+			sync_destroy(&(fs->segments[i][j].bstLock));
+		}
+		free(fs->segments[i]);
 	}
 
-	free(fs->bsts);
+	inode_table_destroy(&fs->inodes, release_inode);
+	pathcache_free(fs->paths);
+	if (fs->imageMap) {
+		munmap(fs->imageMap, fs->imageMapSize);
+		close(fs->imageFd);
+	}
+	mutex_destroy(&fs->renameLock);
+	mutex_destroy(&fs->splitLock);
+	mutex_destroy(&fs->dumpLock);
 	free(fs);
 }
 
-void create(tecnicofs* fs, char *name, int inumber) {
-	int key = hash(name, numBuckets);
+static void file_added(tecnicofs* fs) {
+	int files = __atomic_add_fetch(&fs->numFiles, 1, __ATOMIC_RELAXED);
+	if (files > MAX_LOAD * table_size(fs))
+		split_bucket(fs);
+}
 
-	sync_wrlock(&(fs->bsts[key].bstLock));
-	fs->bsts[key].bstRoot = insert(fs->bsts[key].bstRoot, name, inumber);
-	sync_unlock(&(fs->bsts[key].bstLock));
+/* Moves the children of a directory still in the image into its index.
+ * Called with indexLock held. */
+static void promote_index(tecnicofs* fs, directory* d) {
+	int i, inserted;
+
+	if (!d->image)
+		return;
+	for (i = 0; i < d->imageSize; i++)
+		d->children = insert(&d->pool, d->children, fs->imageStrings + d->image[i].name,
+			0, d->image[i].inumber, &inserted);
+	d->image = NULL;
 }
 
-void delete(tecnicofs* fs, char *name) {
-	int key = hash(name, numBuckets);
+/* The index of a directory is changed inside the critical section of
+ * the bucket of the entry, so both always agree */
+static void index_add(tecnicofs* fs, directory* d, char* name, int inumber) {
+	int inserted;
 
-	sync_wrlock(&(fs->bsts[key].bstLock));
-	fs->bsts[key].bstRoot = remove_item(fs->bsts[key].bstRoot, name);
-	sync_unlock(&(fs->bsts[key].bstLock));
+	mutex_lock(&d->indexLock);
+	promote_index(fs, d);
+	/* a directory index is not hashed, its nodes keep no hash */
+	d->children = insert(&d->pool, d->children, name, 0, inumber, &inserted);
+	mutex_unlock(&d->indexLock);
 }
 
-int lookup(tecnicofs* fs, char *name) {
-	int key = hash(name, numBuckets);
+static void index_remove(tecnicofs* fs, directory* d, char* name) {
+	int inumber;
+
+	mutex_lock(&d->indexLock);
+	promote_index(fs, d);
+	d->children = remove_item(&d->pool, d->children, name, &inumber);
+	mutex_unlock(&d->indexLock);
+}
 
-	sync_rdlock(&(fs->bsts[key].bstLock));
+/* Adds the entry key, called name in directory d, for inumber.
+ * Returns inumber, or FS_EXISTS */
+static int link_entry(tecnicofs* fs, directory* d, char* key, char* name, int inumber,
+		char logType, uint64_t logArg, uint64_t* lsn) {
+	uint64_t h = key_hash(key);
+	int index = lock_bucket(fs, h, 1);
+	bst* b = get_bucket(fs, index);
+	int inserted;
 
-	int inumber = 0;
-	node* searchNode = search(fs->bsts[key].bstRoot, name);
-	if (searchNode) {
-		inumber = searchNode->inumber;
+	if (b->image && image_search(fs, b->image, b->imageSize, key)) {
+		unlock_bucket(fs, index);
+		return FS_EXISTS;
 	}
+	dump_save(fs, running_dump(fs), index);
+	promote_bucket(fs, b);
 
-	sync_unlock(&(fs->bsts[key].bstLock));
+	seq_write_begin(&b->bstSeq);
+	filter_add(b, h);
+	b->bstRoot = insert(&b->pool, b->bstRoot, key, h, inumber, &inserted);
+	seq_write_end(&b->bstSeq);
+	if (inserted) {
+		index_add(fs, d, name, inumber);
+		if (fs->log)
+			*lsn = wal_append(fs->log, logType, key, NULL, inumber, logArg);
+	}
+	unlock_bucket(fs, index);
 
+	if (!inserted)
+		return FS_EXISTS;
+	file_added(fs);
 	return inumber;
 }
 
-void renameFile(tecnicofs* fs, char *name1, char* name2, int iNumber) {
-	int key1 = hash(name1, numBuckets);
-	int key2 = hash(name2, numBuckets);
+/* Removes the entry key, called name in directory d.
+ * Returns the inumber it had, or FS_NOT_FOUND */
+static int unlink_entry(tecnicofs* fs, directory* d, char* key, char* name, uint64_t* lsn) {
+	int index = lock_bucket(fs, key_hash(key), 1);
+	bst* b = get_bucket(fs, index);
+	int inumber;
 
-	// force to always lock the tree with lower key first
-	if (key1 > key2) { int temp = key1; key1 = key2; key2 = temp; }
-	
-	// lock the first
-	sync_wrlock(&(fs->bsts[key1].bstLock));
-	if(key1 != key2) sync_wrlock(&(fs->bsts[key2].bstLock)); /* check if bst is different */
+	if (b->image && !image_search(fs, b->image, b->imageSize, key)) {
+		unlock_bucket(fs, index);
+		return FS_NOT_FOUND;
+	}
+	dump_save(fs, running_dump(fs), index);
+	promote_bucket(fs, b);
 
-	fs->bsts[key1].bstRoot = remove_item(fs->bsts[key1].bstRoot, name1); /* delete */
-	fs->bsts[key2].bstRoot = insert(fs->bsts[key2].bstRoot, name2, iNumber); /* create */
+	seq_write_begin(&b->bstSeq);
+	b->bstRoot = remove_item(&b->pool, b->bstRoot, key, &inumber);
+	if (inumber)
+		filter_removed(b);
+	seq_write_end(&b->bstSeq);
+	if (inumber) {
+		index_remove(fs, d, name);
+		if (fs->log)
+			*lsn = wal_append(fs->log, WAL_DELETE, key, NULL, inumber, 0);
+	}
+	unlock_bucket(fs, index);
 
-	sync_unlock(&(fs->bsts[key1].bstLock));
-	if(key1 != key2) sync_unlock(&(fs->bsts[key2].bstLock));
+	if (!inumber)
+		return FS_NOT_FOUND;
+	__atomic_sub_fetch(&fs->numFiles, 1, __ATOMIC_RELAXED);
+	return inumber;
 }
 
-void print_tecnicofs_tree(FILE * fp, tecnicofs *fs) {
+/* Moves the entry key1 (name1 in d1) to key2 (name2 in d2), both buckets
+ * stay locked from the checks to the change so no other operation can
+ * see or cause a half move.
+ * Returns the inumber of the entry, FS_NOT_FOUND if key1 does not exist
+ * or FS_EXISTS if key2 does. */
+static int move_entry(tecnicofs* fs, directory* d1, char* key1, char* name1,
+		directory* d2, char* key2, char* name2, uint64_t* lsn) {
+	uint64_t h1 = key_hash(key1);
+	uint64_t h2 = key_hash(key2);
+	int index1, index2, low, high;
+
+	while (1) {
+		int size = table_size(fs);
+		index1 = bucket_index(fs, h1, size);
+		index2 = bucket_index(fs, h2, size);
+
+		// force to always lock the tree with lower key first
+		low = index1 < index2 ? index1 : index2;
+		high = index1 < index2 ? index2 : index1;
+
+		// lock the first
+		wait_bucket(fs, low, 1);
+		if (low != high) wait_bucket(fs, high, 1); /* check if bst is different */
+
+		/* a split may have moved one of the keys meanwhile */
+		size = table_size(fs);
+		if (bucket_index(fs, h1, size) == index1 && bucket_index(fs, h2, size) == index2)
+			break;
+
+		if (low != high) unlock_bucket(fs, high);
+		unlock_bucket(fs, low);
+	}
+
+	bst* b1 = get_bucket(fs, index1);
+	bst* b2 = get_bucket(fs, index2);
+	int result = filtered_search(fs, b1, key1, h1);
+
+	if (!result)
+		result = FS_NOT_FOUND;
+	else if (filtered_search(fs, b2, key2, h2))
+		result = FS_EXISTS;
+	else {
+		fsDump* dump = running_dump(fs);
+		int inserted;
+
+		dump_save(fs, dump, index1);
+		dump_save(fs, dump, index2);
+		promote_bucket(fs, b1);
+		promote_bucket(fs, b2);
+		seq_write_begin(&b1->bstSeq);
+		if (b1 != b2) seq_write_begin(&b2->bstSeq);
+		b1->bstRoot = remove_item(&b1->pool, b1->bstRoot, key1, &result); /* delete */
+		filter_removed(b1);
+		filter_add(b2, h2);
+		b2->bstRoot = insert(&b2->pool, b2->bstRoot, key2, h2, result, &inserted); /* create */
+		if (b1 != b2) seq_write_end(&b2->bstSeq);
+		seq_write_end(&b1->bstSeq);
+
+		index_remove(fs, d1, name1);
+		index_add(fs, d2, name2, result);
+		if (fs->log)
+			*lsn = wal_append(fs->log, WAL_RENAME, key1, key2, result, 0);
+	}
+
+	unlock_bucket(fs, low);
+	if (low != high) unlock_bucket(fs, high);
+
+	return result;
+}
+
+#ifdef SEQLOCK
+/* Lookup that writes no shared memory: the bucket is read between two
+ * reads of its sequence counter and the result is only used if no writer
+ * (including a split moving the key away) ran in between.
+ * Returns -1 when it keeps racing with writers. */
+static int lookup_optimistic(tecnicofs* fs, char *key, uint64_t h) {
+	int attempt;
+
+	for (attempt = 0; attempt < OPTIMISTIC_RETRIES; attempt++) {
+		int index = bucket_index(fs, h, table_size(fs));
+		bst* b = get_bucket(fs, index);
+		unsigned int seq = seq_read_begin(&b->bstSeq);
+
+		if (bucket_index(fs, h, table_size(fs)) != index)
+			continue;
+
+		int inumber = 0, found;
+		imageRecord* image = __atomic_load_n(&b->image, __ATOMIC_ACQUIRE);
+		if (image) {
+			/* the image is never written, only the pointer can change */
+			inumber = image_search(fs, image, b->imageSize, key);
+			found = inumber != 0;
+		}
+		else {
+			node* root = __atomic_load_n(&b->bstRoot, __ATOMIC_ACQUIRE);
+			found = search_optimistic(root, key, &inumber);
+		}
+
+		if (found >= 0 && !seq_read_retry(&b->bstSeq, seq))
+			return found ? inumber : 0;
+	}
+	return -1;
+}
+#endif
+
+/* True if the filter of the bucket of h rules the key out. It is read
+ * without the lock, so the bucket must still be the one of h after: a
+ * split clears the bits of the keys it moves away only once the table
+ * has grown. */
+static int filter_excludes(tecnicofs* fs, uint64_t h) {
+	int index = bucket_index(fs, h, table_size(fs));
+
+	return !filter_has(get_bucket(fs, index), h) &&
+		bucket_index(fs, h, table_size(fs)) == index;
+}
+
+/* Inumber of the entry key, or 0. Most lookups of missing keys end at
+ * the filter of their bucket, without its lock or a walk of its tree. */
+static int lookup_entry(tecnicofs* fs, char *key) {
+	uint64_t h = key_hash(key);
+	int inumber = -1;
+
+	if (filter_excludes(fs, h)) {
+		stats_filter(FILTER_SKIPPED);
+		return 0;
+	}
+#ifdef SEQLOCK
+	inumber = lookup_optimistic(fs, key, h);
+#endif
+	if (inumber < 0) {
+		int index = lock_bucket(fs, h, 0);
+
+		inumber = bucket_search(fs, get_bucket(fs, index), key);
+		unlock_bucket(fs, index);
+	}
+	stats_filter(inumber ? FILTER_FOUND : FILTER_MISSED);
+	return inumber;
+}
+
+/* Key of the entry name of directory parent in the buckets. The entries
+ * of the root are keyed by their name alone, names have no '/', so
+ * a flat namespace keeps the keys it always had. */
+static void entry_key(char* key, int parent, char* name) {
+	if (parent == ROOT_INUMBER)
+		strcpy(key, name);
+	else
+		sprintf(key, "%d/%s", parent, name);
+}
+
+/* Inverse of entry_key: the name in the key and its parent */
+static char* key_name(char* key, int* parent) {
+	char* slash = strchr(key, '/');
+
+	if (!slash) {
+		*parent = ROOT_INUMBER;
+		return key;
+	}
+	*parent = atoi(key);
+	return slash + 1;
+}
+
+/* Copies path to buffer without its leading '/'s, the root is "".
+ * Returns 0, or FS_INVALID for empty components and paths too long */
+static int normalize_path(char* path, char* buffer) {
+	size_t length;
+
+	while (*path == '/')
+		path++;
+	length = strlen(path);
+	if (length >= MAX_INPUT_SIZE)
+		return FS_INVALID;
+	memcpy(buffer, path, length + 1);
+	if (length && (buffer[length - 1] == '/' || strstr(buffer, "//")))
+		return FS_INVALID;
+	return 0;
+}
+
+/* Splits path, in buffer, into the path of its directory and its name */
+static int split_path(char* path, char* buffer, char** parent, char** name) {
+	int error = normalize_path(path, buffer);
+	char* slash;
+
+	if (error)
+		return error;
+	if (!*buffer)
+		return FS_INVALID;     /* the root has no name */
+
+	slash = strrchr(buffer, '/');
+	if (!slash) {
+		*parent = "";
+		*name = buffer;
+	}
+	else {
+		*slash = '\0';
+		*parent = buffer;
+		*name = slash + 1;
+	}
+	return 0;
+}
+
+static directory* get_directory(tecnicofs* fs, int inumber) {
+	inode* i = inode_find(&fs->inodes, inumber);
+
+	if (!i || __atomic_load_n(&i->type, __ATOMIC_ACQUIRE) != T_DIRECTORY)
+		return NULL;
+	return i->dir;
+}
+
+/* Makes inumber a directory in parent, unless it already is one. The
+ * directory is complete before its type says so, and before an entry
+ * points at it. */
+static directory* make_directory(tecnicofs* fs, int inumber, int parent) {
+	inode* i = inode_get(&fs->inodes, inumber);
+
+	if (i->type == T_DIRECTORY)
+		return i->dir;
+
+	directory* d = calloc(1, sizeof(directory));
+	if (!d) {
+		perror("failed to allocate directory");
+		exit(EXIT_FAILURE);
+	}
+	rwlock_init(&d->lock);
+	mutex_init(&d->indexLock);
+	sync_profile_name(&d->lock, "directory", inumber);
+	sync_profile_name(&d->indexLock, "directory index", inumber);
+	pool_init(&d->pool);
+	d->parent = parent;
+
+	i->dir = d;
+	__atomic_store_n(&i->type, T_DIRECTORY, __ATOMIC_RELEASE);
+	return d;
+}
+
+static void release_inode(inode* i) {
+	if (i->type == T_DIRECTORY) {
+		rwlock_destroy(&i->dir->lock);
+		mutex_destroy(&i->dir->indexLock);
+		pool_destroy(&i->dir->pool);
+		free(i->dir);
+		i->dir = NULL;
+	}
+	i->type = T_FREE;
+}
+
+/* Inumber of the directory at path (normalized), FS_NOT_FOUND or
+ * FS_NOT_DIR. Paths already resolved come from the cache, the others
+ * are walked one entry at a time from the root. */
+static int resolve_directory(tecnicofs* fs, char* path) {
+	char walk[MAX_INPUT_SIZE], key[ENTRY_KEY_SIZE];
+	unsigned int generation;
+	int dir = ROOT_INUMBER;
+	char* name;
+
+	if (!*path)
+		return ROOT_INUMBER;
+	if (pathcache_get(fs->paths, path, &dir))
+		return dir;
+
+	generation = pathcache_generation(fs->paths);
+	strcpy(walk, path);
+	for (name = walk; name; ) {
+		char* slash = strchr(name, '/');
+		if (slash)
+			*slash = '\0';
+
+		entry_key(key, dir, name);
+		int inumber = lookup_entry(fs, key);
+		if (!inumber)
+			return FS_NOT_FOUND;
+		if (!get_directory(fs, inumber))
+			return FS_NOT_DIR;
+		dir = inumber;
+
+		name = slash ? slash + 1 : NULL;
+	}
+
+	pathcache_put(fs->paths, path, generation, dir);
+	return dir;
+}
+
+/* Locks up to three directories (NULL or repeated ones are skipped) in
+ * inumber order, the order every operation on several directories uses */
+typedef struct dirLock {
+	directory* dir;
+	int inumber;
+	int exclusive;
+} dirLock;
+
+static void lock_directories(dirLock* locks, int count) {
+	int i, j;
+
+	for (i = 1; i < count; i++)
+		for (j = i; j > 0 && locks[j].inumber < locks[j - 1].inumber; j--) {
+			dirLock swap = locks[j];
+			locks[j] = locks[j - 1];
+			locks[j - 1] = swap;
+		}
+
+	for (i = 0; i < count; i++) {
+		if (!locks[i].dir || (i > 0 && locks[i].dir == locks[i - 1].dir))
+			continue;
+		if (locks[i].exclusive)
+			rwlock_wrlock(&locks[i].dir->lock);
+		else
+			rwlock_rdlock(&locks[i].dir->lock);
+	}
+}
+
+static void unlock_directories(dirLock* locks, int count) {
 	int i;
 
-	for (i = 0; i < numBuckets; i++) {
-		/* print all non-null bsts */
-		if (fs->bsts[i].bstRoot)
-			print_tree(fp, fs->bsts[i].bstRoot);
+	for (i = 0; i < count; i++)
+		if (locks[i].dir && !(i > 0 && locks[i].dir == locks[i - 1].dir))
+			rwlock_unlock(&locks[i].dir->lock);
+}
+
+/* Adds path as a file (of owner, with permissions) or a directory */
+static int add_entry(tecnicofs* fs, char* path, int inumber, int type, uid_t owner,
+		int permissions) {
+	char buffer[MAX_INPUT_SIZE], key[ENTRY_KEY_SIZE];
+	char *parentPath, *name;
+	uint64_t lsn = 0;
+	int result, parent;
+
+	if ((result = split_path(path, buffer, &parentPath, &name)) < 0)
+		return result;
+	if ((parent = resolve_directory(fs, parentPath)) < 0)
+		return parent;
+
+	directory* d = get_directory(fs, parent);
+	rwlock_rdlock(&d->lock);
+	if (d->removed)
+		result = FS_NOT_FOUND;
+	else {
+		entry_key(key, parent, name);
+		if (type == T_DIRECTORY)
+			make_directory(fs, inumber, parent);
+		else
+			inode_init_file(inode_get(&fs->inodes, inumber), owner, permissions, inode_now());
+
+		result = link_entry(fs, d, key, name, inumber,
+			type == T_DIRECTORY ? WAL_MKDIR : WAL_CREATE,
+			type == T_DIRECTORY ? 0 : (uint64_t) owner << 32 | (uint32_t) permissions, &lsn);
+		if (result < 0)     /* the inumber was never reachable */
+			release_inode(inode_get(&fs->inodes, inumber));
+	}
+	rwlock_unlock(&d->lock);
+
+	if (lsn)
+		wal_commit(fs->log, lsn);
+	return result;
+}
+
+/* Creates the file path unless it already exists.
+ * Returns inumber, FS_EXISTS, or FS_NOT_FOUND / FS_NOT_DIR / FS_INVALID
+ * when its directory cannot be used */
+int create(tecnicofs* fs, char *path, int inumber) {
+	return add_entry(fs, path, inumber, T_FILE, getuid(), DEFAULT_PERMISSIONS);
+}
+
+/* Same as create, owned by owner and with permissions (PERMISSIONS()) */
+int createFile(tecnicofs* fs, char* path, int inumber, uid_t owner, int permissions) {
+	return add_entry(fs, path, inumber, T_FILE, owner, permissions);
+}
+
+/* Same as create, for a directory */
+int makeDirectory(tecnicofs* fs, char* path, int inumber) {
+	return add_entry(fs, path, inumber, T_DIRECTORY, 0, 0);
+}
+
+/* Deletes the file or the empty directory path if it exists.
+ * Returns the inumber it had, FS_NOT_FOUND or FS_NOT_EMPTY */
+int delete(tecnicofs* fs, char *path) {
+	char buffer[MAX_INPUT_SIZE], key[ENTRY_KEY_SIZE];
+	char *parentPath, *name;
+	uint64_t lsn = 0;
+	int result, parent;
+
+	if ((result = split_path(path, buffer, &parentPath, &name)) < 0)
+		return result;
+
+	while (1) {
+		if ((parent = resolve_directory(fs, parentPath)) < 0)
+			return parent;
+		entry_key(key, parent, name);
+		int inumber = lookup_entry(fs, key);
+		if (!inumber)
+			return FS_NOT_FOUND;
+
+		/* a directory is locked exclusive, so nothing goes into it */
+		directory* d = get_directory(fs, parent);
+		directory* c = get_directory(fs, inumber);
+		dirLock locks[2] = { { d, parent, 0 }, { c, inumber, 1 } };
+		lock_directories(locks, 2);
+
+		if (d->removed)
+			result = FS_NOT_FOUND;
+		else if (lookup_entry(fs, key) != inumber) {
+			/* replaced meanwhile, look again */
+			unlock_directories(locks, 2);
+			continue;
+		}
+		else if (c && (c->children || c->image))
+			result = FS_NOT_EMPTY;
+		else {
+			if (c)
+				pathcache_invalidate(fs->paths);
+			result = unlink_entry(fs, d, key, name, &lsn);
+			if (c) {
+				c->removed = 1;
+				pathcache_invalidate(fs->paths);
+			}
+			else if (result > 0)
+				release_file(fs, inumber);
+		}
+
+		unlock_directories(locks, 2);
+		break;
+	}
+
+	if (lsn)
+		wal_commit(fs->log, lsn);
+	return result;
+}
+
+/* Returns the inumber of path, or 0 */
+int lookup(tecnicofs* fs, char *path) {
+	char buffer[MAX_INPUT_SIZE], key[ENTRY_KEY_SIZE];
+	char *parentPath, *name;
+	int parent;
+
+	if (split_path(path, buffer, &parentPath, &name) < 0 ||
+		(parent = resolve_directory(fs, parentPath)) < 0)
+		return 0;
+
+	entry_key(key, parent, name);
+	return lookup_entry(fs, key);
+}
+
+/* Most shards, up to wanted, that split the buckets evenly for good:
+ * a divisor of the initial bucket count (see shard.h) */
+int fitShards(tecnicofs* fs, int wanted) {
+	int shards = wanted < fs->baseBuckets ? wanted : fs->baseBuckets;
+
+	while (shards > 1 && fs->baseBuckets % shards)
+		shards--;
+	return shards > 0 ? shards : 1;
+}
+
+/* Shard of the entry path among shards, from fitShards: a bucket index
+ * is the key hash modulo the initial bucket count or a multiple of it,
+ * so shard s has the buckets whose index is s modulo shards. Returns -1
+ * if the directory of path cannot be resolved. */
+int entryShard(tecnicofs* fs, char* path, int shards) {
+	char buffer[MAX_INPUT_SIZE], key[ENTRY_KEY_SIZE];
+	char *parentPath, *name;
+	int parent;
+
+	if (split_path(path, buffer, &parentPath, &name) < 0 ||
+		(parent = resolve_directory(fs, parentPath)) < 0)
+		return -1;
+	entry_key(key, parent, name);
+	return (int) (key_hash(key) % (uint64_t) shards);
+}
+
+/* An operation of applyBatch while it runs */
+typedef struct batchEntry {
+	batchOp* op;
+	directory* dir;
+	uint64_t hash;
+	int index;          /* bucket it was grouped in, -1 once applied */
+	int position;       /* in the batch, ops on one name keep their order */
+	char key[ENTRY_KEY_SIZE];
+} batchEntry;
+
+static int compare_dir_locks(const void* a, const void* b) {
+	return ((dirLock*) a)->inumber - ((dirLock*) b)->inumber;
+}
+
+/* By bucket, then by key so each tree is walked in order */
+static int compare_batch_entries(const void* a, const void* b) {
+	batchEntry* e1 = *(batchEntry**) a, *e2 = *(batchEntry**) b;
+	int comp;
+
+	if (e1->index != e2->index)
+		return e1->index < e2->index ? -1 : 1;
+	if ((comp = strcmp(e1->key, e2->key)))
+		return comp;
+	return e1->position - e2->position;
+}
+
+/* Applies one op to its bucket, write locked when the op changes it.
+ * The first change made under the lock saves the bucket for a running
+ * dump and opens the write section of the readers, closed by the caller.
+ * Returns 1 if it changed the bucket */
+static int batch_apply(tecnicofs* fs, batchEntry* e, bst* b, fsDump* dump, int changed,
+		uint64_t logArg, uint64_t* lsn) {
+	batchOp* op = e->op;
+	int parent, inumber, inserted;
+	char* name = key_name(e->key, &parent);
+
+	if (op->opcode == 'l') {
+		op->result = filtered_search(fs, b, e->key, e->hash);
+		return 0;
+	}
+
+	inumber = filtered_search(fs, b, e->key, e->hash);
+	if (op->opcode == 'c' && inumber)
+		op->result = FS_EXISTS;
+	else if (op->opcode == 'd' && !inumber)
+		op->result = FS_NOT_FOUND;
+	else if (op->opcode == 'd' && get_directory(fs, inumber))
+		op->result = FS_INVALID;   /* they are locked to be removed, see delete */
+	if (op->result)
+		return 0;
+
+	if (!changed) {
+		dump_save(fs, dump, e->index);
+		promote_bucket(fs, b);
+		seq_write_begin(&b->bstSeq);
 	}
+	if (op->opcode == 'c') {
+		filter_add(b, e->hash);
+		b->bstRoot = insert(&b->pool, b->bstRoot, e->key, e->hash, op->inumber, &inserted);
+		index_add(fs, e->dir, name, op->inumber);
+		if (fs->log)
+			*lsn = wal_append(fs->log, WAL_CREATE, e->key, NULL, op->inumber, logArg);
+		op->result = op->inumber;
+	}
+	else {
+		b->bstRoot = remove_item(&b->pool, b->bstRoot, e->key, &inumber);
+		filter_removed(b);
+		index_remove(fs, e->dir, name);
+		if (fs->log)
+			*lsn = wal_append(fs->log, WAL_DELETE, e->key, NULL, inumber, 0);
+		op->result = inumber;
+	}
+	return 1;
+}
+
+/* Applies the entries that are still where they were grouped, each
+ * bucket locked once for all of its entries. Those a split moved
+ * meanwhile are left for another round. Returns how many are left. */
+static int batch_round(tecnicofs* fs, batchEntry** entries, int count, uint64_t logArg,
+		uint64_t* lsn) {
+	int first, last, i, left = 0;
+
+	for (i = 0; i < count; i++)
+		entries[i]->index = bucket_index(fs, entries[i]->hash, table_size(fs));
+	qsort(entries, count, sizeof(batchEntry*), compare_batch_entries);
+
+	for (first = 0; first < count; first = last) {
+		int index = entries[first]->index, write = 0, changed = 0;
+		bst* b = get_bucket(fs, index);
+
+		for (last = first; last < count && entries[last]->index == index; last++)
+			write |= entries[last]->op->opcode != 'l';
+
+		wait_bucket(fs, index, write);
+		fsDump* dump = write ? running_dump(fs) : NULL;
+		for (i = first; i < last; i++)
+			if (bucket_index(fs, entries[i]->hash, table_size(fs)) == index) {
+				changed |= batch_apply(fs, entries[i], b, dump, changed, logArg, lsn);
+				entries[i]->index = -1;
+			}
+		if (changed)
+			seq_write_end(&b->bstSeq);
+		unlock_bucket(fs, index);
+
+		/* as create and delete do, once the bucket is free */
+		for (i = first; i < last; i++) {
+			batchOp* op = entries[i]->op;
+
+			if (entries[i]->index != -1)
+				entries[left++] = entries[i];
+			else if (op->result <= 0 || op->opcode == 'l')
+				continue;
+			else if (op->opcode == 'c')
+				file_added(fs);
+			else {
+				__atomic_sub_fetch(&fs->numFiles, 1, __ATOMIC_RELAXED);
+				release_file(fs, op->result);
+			}
+		}
+	}
+	return left;
+}
+
+/* Applies count creates ('c', of files owned by owner with permissions),
+ * deletes ('d', of files) and lookups ('l'), each with the result the
+ * single call would have had. The ops are grouped by bucket and each
+ * bucket is locked once for its whole group, instead of once per op, and
+ * the log is committed once. Every op is atomic but the batch is not:
+ * ops on one name are applied in their order, ops on different names in
+ * any order. Paths are resolved before any op is applied, so the
+ * directories an op uses must exist before the batch. */
+void applyBatch(tecnicofs* fs, batchOp* ops, int count, uid_t owner, int permissions) {
+	batchEntry* entries;
+	batchEntry** pending;
+	dirLock* locks;
+	char buffer[MAX_INPUT_SIZE], *parentPath, *name;
+	uint64_t lsn = 0, logArg = (uint64_t) owner << 32 | (uint32_t) permissions;
+	int i, n = 0, parent = ROOT_INUMBER;
+
+	if (count <= 0)
+		return;
+	entries = malloc(count * sizeof(batchEntry));
+	pending = malloc(count * sizeof(batchEntry*));
+	locks = malloc(count * sizeof(dirLock));
+	if (!entries || !pending || !locks) {
+		perror("failed to allocate a batch");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < count; i++) {
+		batchOp* op = &ops[i];
+		batchEntry* e = &entries[n];
+
+		op->result = 0;
+		if (!op->opcode || !strchr("cdl", op->opcode))
+			op->result = FS_INVALID;
+		else if ((op->result = split_path(op->path, buffer, &parentPath, &name)) == 0 &&
+			(parent = resolve_directory(fs, parentPath)) < 0)
+			op->result = parent;
+		if (op->result) {
+			if (op->opcode == 'l')
+				op->result = 0;
+			continue;
+		}
+
+		entry_key(e->key, parent, name);
+		e->op = op;
+		e->dir = get_directory(fs, parent);
+		e->hash = key_hash(e->key);
+		e->position = i;
+		locks[n].dir = e->dir;
+		locks[n].inumber = parent;
+		locks[n].exclusive = 0;
+		n++;
+	}
+
+	/* every directory is locked shared, so none is removed meanwhile */
+	qsort(locks, n, sizeof(dirLock), compare_dir_locks);
+	lock_directories(locks, n);
+
+	count = 0;
+	for (i = 0; i < n; i++) {
+		batchOp* op = entries[i].op;
+
+		if (entries[i].dir->removed) {
+			op->result = op->opcode == 'l' ? 0 : FS_NOT_FOUND;
+			continue;
+		}
+		if (op->opcode == 'c')
+			inode_init_file(inode_get(&fs->inodes, op->inumber), owner, permissions, inode_now());
+		pending[count++] = &entries[i];
+	}
+
+	while (count)
+		count = batch_round(fs, pending, count, logArg, &lsn);
+
+	/* creates that failed leave their inumber unused */
+	for (i = 0; i < n; i++)
+		if (entries[i].op->opcode == 'c' && entries[i].op->result < 0 &&
+			!entries[i].dir->removed)
+			release_inode(inode_get(&fs->inodes, entries[i].op->inumber));
+
+	unlock_directories(locks, n);
+	if (lsn)
+		wal_commit(fs->log, lsn);
+	free(locks);
+	free(pending);
+	free(entries);
+}
+
+/* True if dir is ancestor or inside it. Parents only change while
+ * renameLock is held, which the caller does. */
+static int inside(tecnicofs* fs, int dir, int ancestor) {
+	while (dir != ancestor && dir != ROOT_INUMBER)
+		dir = get_directory(fs, dir)->parent;
+	return dir == ancestor;
+}
+
+/* Renames path1 to path2, which may be in another directory.
+ * Returns the inumber of the entry, FS_NOT_FOUND if path1 does not
+ * exist, FS_EXISTS if path2 does, or FS_INVALID when a directory would
+ * go inside itself. */
+int renameFile(tecnicofs* fs, char *path1, char* path2) {
+	char buffer1[MAX_INPUT_SIZE], buffer2[MAX_INPUT_SIZE];
+	char key1[ENTRY_KEY_SIZE], key2[ENTRY_KEY_SIZE];
+	char *parentPath1, *name1, *parentPath2, *name2;
+	uint64_t lsn = 0;
+	int result, parent1, parent2;
+
+	if ((result = split_path(path1, buffer1, &parentPath1, &name1)) < 0 ||
+		(result = split_path(path2, buffer2, &parentPath2, &name2)) < 0)
+		return result;
+
+	while (1) {
+		if ((parent1 = resolve_directory(fs, parentPath1)) < 0)
+			return parent1;
+		if ((parent2 = resolve_directory(fs, parentPath2)) < 0)
+			return parent2;
+		entry_key(key1, parent1, name1);
+		entry_key(key2, parent2, name2);
+		int inumber = lookup_entry(fs, key1);
+		if (!inumber)
+			return FS_NOT_FOUND;
+
+		/* a directory moved is locked too, so it is not removed meanwhile */
+		directory* d1 = get_directory(fs, parent1);
+		directory* d2 = get_directory(fs, parent2);
+		directory* c = get_directory(fs, inumber);
+		int moving = c && parent1 != parent2;
+		dirLock locks[3] = { { d1, parent1, 0 }, { d2, parent2, 0 }, { c, inumber, 0 } };
+
+		if (moving)
+			mutex_lock(&fs->renameLock);
+		lock_directories(locks, 3);
+
+		if (d1->removed || d2->removed)
+			result = FS_NOT_FOUND;
+		else if (lookup_entry(fs, key1) != inumber) {
+			unlock_directories(locks, 3);
+			if (moving)
+				mutex_unlock(&fs->renameLock);
+			continue;
+		}
+		else if (moving && inside(fs, parent2, inumber))
+			result = FS_INVALID;
+		else {
+			if (c)
+				pathcache_invalidate(fs->paths);
+			result = move_entry(fs, d1, key1, name1, d2, key2, name2, &lsn);
+			if (c) {
+				if (result > 0)
+					c->parent = parent2;
+				pathcache_invalidate(fs->paths);
+			}
+		}
+
+		unlock_directories(locks, 3);
+		if (moving)
+			mutex_unlock(&fs->renameLock);
+		break;
+	}
+
+	if (lsn)
+		wal_commit(fs->log, lsn);
+	return result;
+}
+
+/* Empties a deleted file, any later read or write of it fails. Open
+ * files hold no reference, so this waits for the operations running. */
+static void release_file(tecnicofs* fs, int inumber) {
+	inode* i = inode_get(&fs->inodes, inumber);
+
+	rwlock_wrlock(&i->dataLock);
+	inode_release_data(&fs->inodes, i);
+	i->type = T_FREE;
+	rwlock_unlock(&i->dataLock);
+}
+
+/* Opens the file path for mode (PERM_READ, PERM_WRITE or both) as uid.
+ * Returns its inumber, FS_NOT_FOUND, FS_INVALID if it is a directory or
+ * FS_DENIED. The permissions are only checked here. */
+int openFile(tecnicofs* fs, char* path, uid_t uid, int mode) {
+	int inumber = lookup(fs, path), result;
+
+	if (!inumber)
+		return FS_NOT_FOUND;
+
+	inode* i = inode_get(&fs->inodes, inumber);
+	rwlock_rdlock(&i->dataLock);
+	if (i->type == T_DIRECTORY)
+		result = FS_INVALID;
+	else if (i->type != T_FILE)
+		result = FS_NOT_FOUND;     /* deleted meanwhile */
+	else if (!inode_allows(i, uid, mode))
+		result = FS_DENIED;
+	else
+		result = inumber;
+	rwlock_unlock(&i->dataLock);
+
+	return result;
+}
+
+/* Copies up to size bytes of the file at offset into dest.
+ * Returns how many, or FS_NOT_FOUND if the file was deleted */
+int readFile(tecnicofs* fs, int inumber, uint64_t offset, char* dest, size_t size) {
+	inode* i = inode_find(&fs->inodes, inumber);
+	int result;
+
+	if (!i)
+		return FS_NOT_FOUND;
+
+	rwlock_rdlock(&i->dataLock);
+	if (i->type != T_FILE)
+		result = FS_NOT_FOUND;
+	else {
+		result = inode_read(i, offset, dest, size);
+		__atomic_store_n(&i->atime, inode_now(), __ATOMIC_RELAXED);
+	}
+	rwlock_unlock(&i->dataLock);
+
+	return result;
+}
+
+/* Like readFile, but the data is passed to visit as ranges of fds to be
+ * sent without copying it (see inode_ranges). */
+int readFileRanges(tecnicofs* fs, int inumber, uint64_t offset, size_t size,
+                   void (*visit)(dataRange* range, void* arg), void* arg) {
+	inode* i = inode_find(&fs->inodes, inumber);
+	int result;
+
+	if (!i)
+		return FS_NOT_FOUND;
+
+	rwlock_rdlock(&i->dataLock);
+	if (i->type != T_FILE)
+		result = FS_NOT_FOUND;
+	else {
+		result = inode_ranges(&fs->inodes, i, offset, size, visit, arg);
+		__atomic_store_n(&i->atime, inode_now(), __ATOMIC_RELAXED);
+	}
+	rwlock_unlock(&i->dataLock);
+
+	return result;
+}
+
+/* Writes size bytes of data at offset of the file.
+ * Returns size, FS_NOT_FOUND if the file was deleted or FS_INVALID if
+ * it would grow too big */
+int writeFile(tecnicofs* fs, int inumber, uint64_t offset, const char* data, size_t size) {
+	inode* i = inode_find(&fs->inodes, inumber);
+	uint64_t lsn = 0;
+	int result;
+
+	if (!i)
+		return FS_NOT_FOUND;
+
+	rwlock_wrlock(&i->dataLock);
+	if (i->type != T_FILE)
+		result = FS_NOT_FOUND;
+	else if (inode_write(&fs->inodes, i, offset, data, size) < 0)
+		result = FS_INVALID;
+	else {
+		result = size;
+		if (fs->log)
+			lsn = wal_append_data(fs->log, WAL_WRITE, inumber, offset, data, size);
+	}
+	rwlock_unlock(&i->dataLock);
+
+	if (lsn)
+		wal_commit(fs->log, lsn);
+	return result;
+}
+
+/* Fills st with what the inode of path holds.
+ * Returns its inumber, or FS_NOT_FOUND */
+int statFile(tecnicofs* fs, char* path, inodeStat* st) {
+	char buffer[MAX_INPUT_SIZE];
+	int inumber;
+
+	if (normalize_path(path, buffer) < 0)
+		return FS_NOT_FOUND;
+	inumber = *buffer ? lookup(fs, buffer) : ROOT_INUMBER;
+	if (*buffer && !inumber)
+		return FS_NOT_FOUND;
+	if (get_directory(fs, inumber)) {
+		/* directories have no owner nor contents */
+		memset(st, 0, sizeof(inodeStat));
+		st->type = T_DIRECTORY;
+		return inumber;
+	}
+
+	inode* i = inode_get(&fs->inodes, inumber);
+	rwlock_rdlock(&i->dataLock);
+	inode_stat(i, st);
+	rwlock_unlock(&i->dataLock);
+
+	return st->type == T_FILE ? inumber : FS_NOT_FOUND;
+}
+
+struct visitArg {
+	void (*visit)(char*, int, void*);
+	void* arg;
+};
+
+static void visit_node(node* p, void* arg) {
+	struct visitArg* visit = (struct visitArg*) arg;
+
+	visit->visit(p->key, p->inumber, visit->arg);
+}
+
+/* Visits the entries of a directory in name order, with its lock held */
+static void visit_index(tecnicofs* fs, directory* d, void (*visit)(char*, int, void*), void* arg) {
+	struct visitArg visitNode = { visit, arg };
+	int i;
+
+	mutex_lock(&d->indexLock);
+	if (d->image)
+		for (i = 0; i < d->imageSize; i++)
+			visit(fs->imageStrings + d->image[i].name, d->image[i].inumber, arg);
+	else
+		traverse_tree(d->children, visit_node, &visitNode);
+	mutex_unlock(&d->indexLock);
+}
+
+struct countArg {
+	void (*visit)(char*, int, void*);
+	void* arg;
+	int count;
+};
+
+static void count_entry(char* name, int inumber, void* arg) {
+	struct countArg* count = (struct countArg*) arg;
+
+	count->visit(name, inumber, count->arg);
+	count->count++;
+}
+
+/* Calls visit on each entry of the directory path, in name order.
+ * Returns the number of entries, or FS_NOT_FOUND / FS_NOT_DIR / FS_INVALID */
+int listDirectory(tecnicofs* fs, char* path, void (*visit)(char* name, int inumber, void* arg),
+		void* arg) {
+	char buffer[MAX_INPUT_SIZE];
+	struct countArg count = { visit, arg, 0 };
+	int result, inumber;
+
+	if ((result = normalize_path(path, buffer)) < 0)
+		return result;
+	if ((inumber = resolve_directory(fs, buffer)) < 0)
+		return inumber;
+
+	directory* d = get_directory(fs, inumber);
+	rwlock_rdlock(&d->lock);
+	if (d->removed)
+		result = FS_NOT_FOUND;
+	else {
+		visit_index(fs, d, count_entry, &count);
+		result = count.count;
+	}
+	rwlock_unlock(&d->lock);
+
+	return result;
+}
+
+struct scanArg {
+	void (*visit)(char*, int, void*);
+	void* arg;
+	char* prefix;
+	size_t prefixLength;
+	int limit;
+	int count;
+};
+
+/* 0 once past the names with the prefix or with the page full */
+static int scan_entry(char* name, int inumber, struct scanArg* scan) {
+	if (scan->count == scan->limit || strncmp(name, scan->prefix, scan->prefixLength))
+		return 0;
+	scan->visit(name, inumber, scan->arg);
+	scan->count++;
+	return 1;
+}
+
+static int scan_node(node* p, void* arg) {
+	return scan_entry(p->key, p->inumber, (struct scanArg*) arg);
+}
+
+/* Index of the first image record from name on (after it if strict) */
+static int image_from(tecnicofs* fs, imageRecord* records, int size, char* name, int strict) {
+	int low = 0, high = size;
+
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		int comp = strcmp(fs->imageStrings + records[middle].name, name);
+
+		if (comp < 0 || (comp == 0 && strict))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+/* Calls visit, in name order, on up to limit entries of the directory
+ * path whose names start with prefix and come after the name after
+ * (NULL or "" for the first page). The directory is only locked for the
+ * page, so a listing made of pages, each one after the last name of the
+ * one before, lets changes happen in between: entries there for the
+ * whole listing are visited once, others may be missed.
+ * Returns the number of entries visited, or FS_NOT_FOUND / FS_NOT_DIR /
+ * FS_INVALID */
+int scanDirectory(tecnicofs* fs, char* path, char* prefix, char* after, int limit,
+		void (*visit)(char* name, int inumber, void* arg), void* arg) {
+	char buffer[MAX_INPUT_SIZE];
+	struct scanArg scan = { visit, arg, prefix, strlen(prefix), limit, 0 };
+	int result, inumber, i;
+
+	if ((result = normalize_path(path, buffer)) < 0)
+		return result;
+	if ((inumber = resolve_directory(fs, buffer)) < 0)
+		return inumber;
+
+	/* names with the prefix are all from the prefix itself on */
+	int strict = after && strcmp(after, prefix) >= 0;
+	char* from = strict ? after : prefix;
+
+	directory* d = get_directory(fs, inumber);
+	rwlock_rdlock(&d->lock);
+	if (d->removed)
+		result = FS_NOT_FOUND;
+	else {
+		mutex_lock(&d->indexLock);
+		if (d->image) {
+			for (i = image_from(fs, d->image, d->imageSize, from, strict); i < d->imageSize; i++)
+				if (!scan_entry(fs->imageStrings + d->image[i].name, d->image[i].inumber, &scan))
+					break;
+		}
+		else
+			traverse_from(d->children, from, strict, scan_node, &scan);
+		mutex_unlock(&d->indexLock);
+		result = scan.count;
+	}
+	rwlock_unlock(&d->lock);
+
+	return result;
+}
+
+/* Calls visit on every entry, one bucket at a time under its read lock,
+ * in key order inside a bucket, and bucketEnd (if any) after each one.
+ * Changes in other buckets go on meanwhile, so the result is not a
+ * point in time view; the table does not grow while it runs, else a
+ * split could move entries into a bucket already visited. */
+void traverse_tecnicofs(tecnicofs* fs, void (*visit)(char* name, int inumber, void* arg),
+			void (*bucketEnd)(int index, void* arg), void* arg) {
+	struct visitArg visitNode = { visit, arg };
+	int i, j, size;
+
+	mutex_lock(&fs->splitLock);
+	size = table_size(fs);
+	for (i = 0; i < size; i++) {
+		bst* b = get_bucket(fs, i);
+
+		sync_rdlock(&(b->bstLock));
+		if (b->image)
+			for (j = 0; j < b->imageSize; j++)
+				visit(fs->imageStrings + b->image[j].name, b->image[j].inumber, arg);
+		else
+			traverse_tree(b->bstRoot, visit_node, &visitNode);
+		sync_unlock(&(b->bstLock));
+
+		if (bucketEnd)
+			bucketEnd(i, arg);
+	}
+	mutex_unlock(&fs->splitLock);
+}
+
+/* Calls visitDirectory on every directory in use, in inumber order,
+ * followed by visit on each of its entries */
+void traverse_directories(tecnicofs* fs, void (*visitDirectory)(int inumber, int parent, void* arg),
+			void (*visit)(char* name, int inumber, void* arg), void* arg) {
+	int i, j;
+
+	for (i = 0; i < MAX_INODE_SEGMENTS; i++) {
+		inode* inodes = __atomic_load_n(&fs->inodes.segments[i], __ATOMIC_ACQUIRE);
+		if (!inodes)
+			continue;
+
+		for (j = 0; j < INODE_SEGMENT; j++) {
+			int inumber = i * INODE_SEGMENT + j;
+			directory* d = get_directory(fs, inumber);
+			if (!d)
+				continue;
+
+			rwlock_rdlock(&d->lock);
+			if (!d->removed) {
+				visitDirectory(inumber, d->parent, arg);
+				visit_index(fs, d, visit, arg);
+			}
+			rwlock_unlock(&d->lock);
+		}
+	}
+}
+
+/* Calls visit on every file, in inumber order, with its data lock held
+ * shared so its contents stay as they are while visit reads them */
+void traverse_files(tecnicofs* fs, void (*visit)(int inumber, inode* file, void* arg), void* arg) {
+	int i, j;
+
+	for (i = 0; i < MAX_INODE_SEGMENTS; i++) {
+		inode* inodes = __atomic_load_n(&fs->inodes.segments[i], __ATOMIC_ACQUIRE);
+		if (!inodes)
+			continue;
+
+		for (j = 0; j < INODE_SEGMENT; j++) {
+			inode* file = &inodes[j];
+			if (__atomic_load_n(&file->type, __ATOMIC_ACQUIRE) != T_FILE)
+				continue;
+
+			rwlock_rdlock(&file->dataLock);
+			if (file->type == T_FILE)
+				visit(i * INODE_SEGMENT + j, file, arg);
+			rwlock_unlock(&file->dataLock);
+		}
+	}
+}
+
+/* The count buckets that waited longest for their lock, longest first.
+ * Returns how many there are, buckets that never waited are left out */
+int hottestBuckets(tecnicofs* fs, bucketWait* top, int count) {
+	int size = table_size(fs), found = 0, i, j;
+
+	for (i = 0; i < size; i++) {
+		bst* b = get_bucket(fs, i);
+		uint64_t waitNs = __atomic_load_n(&b->waitNs, __ATOMIC_RELAXED);
+
+		if (!waitNs || (found == count && waitNs <= top[count - 1].waitNs))
+			continue;
+		for (j = found < count ? found++ : count - 1; j > 0 && top[j - 1].waitNs < waitNs; j--)
+			top[j] = top[j - 1];
+		top[j].index = i;
+		top[j].waitNs = waitNs;
+		top[j].contended = __atomic_load_n(&b->contended, __ATOMIC_RELAXED);
+	}
+	return found;
+}
+
+/* Removes the entry key when replaying the log, if it is there */
+static void replay_unlink(tecnicofs* fs, char* key) {
+	int parent;
+	char* name = key_name(key, &parent);
+
+	/* the directory may be gone from the snapshot, it is then removed
+	 * again later in the log */
+	unlink_entry(fs, make_directory(fs, parent, ROOT_INUMBER), key, name, NULL);
+}
+
+static void replay_link(tecnicofs* fs, char* key, int inumber) {
+	int parent;
+	char* name = key_name(key, &parent);
+
+	link_entry(fs, make_directory(fs, parent, ROOT_INUMBER), key, name, inumber, 0, 0, NULL);
+}
+
+/* Redoes a logged change at startup, with fs->log still NULL. Records
+ * state what an entry ends up as, not what the operation checked, so they
+ * can be applied again over a state that already has some of them. */
+void replay_record(walRecord* record, void* arg) {
+	tecnicofs* fs = (tecnicofs*) arg;
+	directory* d;
+	inode* i;
+	int parent;
+
+	switch (record->type) {
+		case WAL_MKDIR:
+			key_name(record->name1, &parent);
+			make_directory(fs, record->inumber, parent);
+			replay_unlink(fs, record->name1);
+			replay_link(fs, record->name1, record->inumber);
+			break;
+		case WAL_CREATE:
+			/* the file starts over, its writes are all after this record */
+			i = inode_get(&fs->inodes, record->inumber);
+			inode_release_data(&fs->inodes, i);
+			inode_init_file(i, record->arg >> 32, (int) (uint32_t) record->arg, inode_now());
+			replay_unlink(fs, record->name1);
+			replay_link(fs, record->name1, record->inumber);
+			break;
+		case WAL_DELETE:
+			replay_unlink(fs, record->name1);
+			if ((d = get_directory(fs, record->inumber)))
+				d->removed = 1;
+			else if ((i = inode_find(&fs->inodes, record->inumber)) && i->type == T_FILE) {
+				inode_release_data(&fs->inodes, i);
+				i->type = T_FREE;
+			}
+			break;
+		case WAL_WRITE:
+			/* a write after the delete of its file does nothing */
+			i = inode_find(&fs->inodes, record->inumber);
+			if (i && i->type == T_FILE)
+				inode_write(&fs->inodes, i, record->arg, record->data, record->dataSize);
+			break;
+		case WAL_RENAME:
+			replay_unlink(fs, record->name1);
+			replay_unlink(fs, record->name2);
+			replay_link(fs, record->name2, record->inumber);
+			if ((d = get_directory(fs, record->inumber)))
+				key_name(record->name2, &d->parent);
+			break;
+	}
+	if (record->inumber > fs->nextINumber)
+		fs->nextINumber = record->inumber;
+}
+
+/* Prints every bucket as it was at one point in time, while changes go
+ * on: a bucket is printed under its read lock, or from the copy saved by
+ * the first change to it after that point (dump_save). The table does
+ * not split while the dump starts and ends, and once it is over every
+ * bucket is locked once, so no operation still holds the dump when it is
+ * freed. One dump runs at a time. */
+void print_tecnicofs_tree(FILE * fp, tecnicofs *fs) {
+	fsDump dump;
+	int i, size;
+
+	mutex_lock(&fs->dumpLock);
+	mutex_lock(&fs->splitLock);
+	dump.size = fs->sizeBuckets;
+	dump.text = calloc(dump.size, sizeof(char*));
+	dump.length = calloc(dump.size, sizeof(size_t));
+	dump.saved = calloc(dump.size, sizeof(char));
+	if (!dump.text || !dump.length || !dump.saved) {
+		perror("failed to allocate a dump");
+		exit(EXIT_FAILURE);
+	}
+	__atomic_store_n(&fs->dump, &dump, __ATOMIC_SEQ_CST);
+	mutex_unlock(&fs->splitLock);
+
+	for (i = 0; i < dump.size; i++) {
+		bst* b = get_bucket(fs, i);
+
+		sync_rdlock(&(b->bstLock));
+		if (!dump.saved[i]) {
+			print_bucket(fs, b, fp);
+			dump.saved[i] = 1;
+		}
+		sync_unlock(&(b->bstLock));
+
+		if (dump.text[i]) {
+			fwrite(dump.text[i], 1, dump.length[i], fp);
+			free(dump.text[i]);
+		}
+	}
+
+	mutex_lock(&fs->splitLock);
+	__atomic_store_n(&fs->dump, NULL, __ATOMIC_SEQ_CST);
+	size = fs->sizeBuckets;
+	for (i = 0; i < size; i++) {
+		sync_rdlock(&(get_bucket(fs, i)->bstLock));
+		sync_unlock(&(get_bucket(fs, i)->bstLock));
+	}
+	mutex_unlock(&fs->splitLock);
+	mutex_unlock(&fs->dumpLock);
+
+	free(dump.text);
+	free(dump.length);
+	free(dump.saved);
 }
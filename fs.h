@@ -6,26 +6,143 @@
 #include "lib/bst.h"
 #include "lib/hash.h"
 #include "sync.h"
+#include "wal.h"
+#include "image.h"
+#include "inode.h"
+#include "lib/pathcache.h"
+
+#define SEGMENT_SIZE 256    /* buckets per segment of the bucket directory */
+#define MAX_SEGMENTS 4096   /* the table never grows past this many segments */
+#define MAX_LOAD     4      /* average files per bucket that triggers a split */
+#define FILTER_WORDS 2      /* 64-bit words in the Bloom filter of a bucket */
+#define FILTER_PURGE 4      /* a filter is rebuilt once 1 in this many of its keys is gone */
 
 typedef struct bst {
     node* bstRoot;
+    nodePool pool;
     syncMech bstLock;
+    seqCount bstSeq;    /* bumped by writers, validates lock-free lookups */
+    imageRecord* image; /* files still read from the mapped image, moved */
+    int imageSize;      /* into bstRoot the first time the bucket changes */
+    uint64_t filter[FILTER_WORDS];  /* of the keys in bstRoot, see filter_has */
+    int filterKeys;     /* keys added to the filter, of which */
+    int filterStale;    /* these are no longer in bstRoot */
+    uint64_t waitNs;    /* time waited for bstLock and times it was busy, */
+    uint64_t contended; /* added under it: nothing is written if it was free */
 } bst;
 
+/* Lock wait of a bucket, see hottestBuckets */
+typedef struct bucketWait {
+    int index;
+    uint64_t waitNs;
+    uint64_t contended;
+} bucketWait;
+
+/* Directories are inodes with an index of their entries by name, for
+ * listing. The entries themselves live in the buckets, keyed by the
+ * inumber of the directory and the name (see entry_key in fs.c), so
+ * resolving a path is one bucket lookup per component. Changes to the
+ * entries of a directory hold its lock shared, removing it holds it
+ * exclusive; directories are always locked in inumber order. */
+typedef struct directory {
+    pthread_rwlock_t lock;
+    pthread_mutex_t indexLock;  /* children and image */
+    node* children;
+    nodePool pool;
+    imageRecord* image;         /* children still in the mapped image */
+    int imageSize;
+    int parent;
+    int removed;                /* set under the exclusive lock */
+} directory;
+
+#define ROOT_INUMBER  0
+
+/* A point in time dump of the buckets while it is written (see
+ * print_tecnicofs_tree). saved[i] is set, under the lock of bucket i, once
+ * the dump has it, in text[i] if it was copied before a change. */
+typedef struct fsDump {
+    int size;
+    char** text;
+    size_t* length;
+    char* saved;
+} fsDump;
+
+/* The buckets form a linear hash table: it starts with numBuckets buckets
+ * and grows one bucket at a time, splitting the buckets in order, so that
+ * only the two buckets involved in a split are locked while it happens.
+ * Buckets live in fixed-size segments that are never moved or freed
+ * while the fs is alive, so a bucket address is stable. */
 typedef struct tecnicofs {
-    bst *bsts;
+    bst *segments[MAX_SEGMENTS];
+    int baseBuckets;    /* number of buckets the table was created with */
+    int sizeBuckets;    /* current number of buckets, only grows */
+    int numFiles;
+    pthread_mutex_t splitLock;
     int nextINumber;
+    wal* log;           /* changes are logged here when durable, else NULL */
+    void* imageMap;     /* image the fs was loaded from (image.h), or NULL */
+    size_t imageMapSize;
+    int imageFd;        /* of imageMap, or -1 */
+    char* imageStrings;
+    uint64_t imageLsn;
+    inodeTable inodes;
+    pathCache* paths;           /* resolved directory paths */
+    pthread_mutex_t renameLock; /* moves of directories between directories */
+    struct fsDump* dump;        /* running print_tecnicofs_tree, or NULL */
+    pthread_mutex_t dumpLock;
 } tecnicofs;
 
+/* results of the fs operations, negative so that they
+ * can share the return value with an inumber */
+#define FS_NOT_FOUND  -1
+#define FS_EXISTS     -2
+#define FS_INVALID    -3   /* malformed path, or moving a directory into itself */
+#define FS_NOT_DIR    -4
+#define FS_NOT_EMPTY  -5
+#define FS_DENIED     -6   /* not allowed by the permissions of the file */
+
+/* An operation of applyBatch */
+typedef struct batchOp {
+    char opcode;    /* 'c' create, 'd' delete or 'l' lookup */
+    char* path;
+    int inumber;    /* the file a create makes */
+    int result;     /* what create, delete or lookup would have returned */
+} batchOp;
+
+/* of the files created without saying */
+#define DEFAULT_PERMISSIONS  PERMISSIONS(PERM_RW, PERM_READ)
+
 extern int numBuckets;
 
 int obtainNewInumber(tecnicofs* fs);
-tecnicofs* new_tecnicofs();
+tecnicofs* new_tecnicofs(char* imagePath);
 void free_tecnicofs(tecnicofs* fs);
-void create(tecnicofs* fs, char *name, int inumber);
-void delete(tecnicofs* fs, char *name);
-void renameFile(tecnicofs* fs, char *name1, char* name2, int iNumber);
+int create(tecnicofs* fs, char *name, int inumber);
+int createFile(tecnicofs* fs, char* path, int inumber, uid_t owner, int permissions);
+int delete(tecnicofs* fs, char *name);
+int renameFile(tecnicofs* fs, char *name1, char* name2);
 int lookup(tecnicofs* fs, char *name);
+int makeDirectory(tecnicofs* fs, char* path, int inumber);
+void applyBatch(tecnicofs* fs, batchOp* ops, int count, uid_t owner, int permissions);
+int fitShards(tecnicofs* fs, int wanted);
+int entryShard(tecnicofs* fs, char* path, int shards);
+int listDirectory(tecnicofs* fs, char* path, void (*visit)(char* name, int inumber, void* arg),
+                  void* arg);
+int scanDirectory(tecnicofs* fs, char* path, char* prefix, char* after, int limit,
+                  void (*visit)(char* name, int inumber, void* arg), void* arg);
+int openFile(tecnicofs* fs, char* path, uid_t uid, int mode);
+int readFile(tecnicofs* fs, int inumber, uint64_t offset, char* dest, size_t size);
+int readFileRanges(tecnicofs* fs, int inumber, uint64_t offset, size_t size,
+                   void (*visit)(dataRange* range, void* arg), void* arg);
+int writeFile(tecnicofs* fs, int inumber, uint64_t offset, const char* data, size_t size);
+int statFile(tecnicofs* fs, char* path, inodeStat* st);
+void traverse_tecnicofs(tecnicofs* fs, void (*visit)(char* name, int inumber, void* arg),
+                       void (*bucketEnd)(int index, void* arg), void* arg);
+void traverse_directories(tecnicofs* fs, void (*visitDirectory)(int inumber, int parent, void* arg),
+                          void (*visit)(char* name, int inumber, void* arg), void* arg);
+void traverse_files(tecnicofs* fs, void (*visit)(int inumber, inode* file, void* arg), void* arg);
+int hottestBuckets(tecnicofs* fs, bucketWait* top, int count);
+void replay_record(walRecord* record, void* fs);
 void print_tecnicofs_tree(FILE * fp, tecnicofs *fs);
 
 #endif /* FS_H */
@@ -0,0 +1,68 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+
+/* On-disk image of the bucket table, made to be used where it is mapped:
+ *   header | records | buckets | children | directories | strings | files | data
+ * records are the entries of every bucket, bucket after bucket and
+ * sorted by key inside each, buckets[i] is the first record of bucket i
+ * (with buckets[sizeBuckets] the record count) and strings holds the
+ * names, '\0' terminated, that records point at by offset. The table had
+ * baseBuckets and sizeBuckets when it was written, a tecnicofs loaded
+ * from it starts with the same, so every bucket maps to its records.
+ * The directories point at their sorted run of children records, which
+ * index their entries by name like the bucket records do by key.
+ * The files hold the inodes of the files, whose contents are runs of the
+ * data, read from the mapping until they are first written. */
+
+#define IMAGE_MAGIC    "TFSIMAGE"
+#define IMAGE_VERSION  5    /* 5: buckets picked by key_hash (fs.c) */
+
+typedef struct imageHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t nextINumber;
+    uint64_t lsn;               /* last logged change the image includes */
+    uint64_t count;
+    int32_t baseBuckets;
+    int32_t sizeBuckets;
+    uint64_t recordsOffset;
+    uint64_t bucketsOffset;
+    uint64_t childrenOffset;
+    uint64_t childrenCount;
+    uint64_t directoriesOffset;
+    uint64_t directoriesCount;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t filesOffset;
+    uint64_t filesCount;
+    uint64_t dataOffset;
+    uint64_t dataSize;
+} imageHeader;
+
+typedef struct imageRecord {
+    uint32_t name;              /* offset in the strings */
+    int32_t inumber;
+} imageRecord;
+
+typedef struct imageDirectory {
+    int32_t inumber;
+    int32_t parent;
+    uint64_t children;          /* first of its children records */
+    uint64_t count;
+} imageDirectory;
+
+typedef struct imageFile {
+    int32_t inumber;
+    uint32_t owner;
+    int32_t permissions;        /* PERMISSIONS(owner, others) */
+    int32_t unused;
+    uint64_t size;
+    uint64_t data;              /* offset of its contents in the data */
+    int64_t atime, mtime, ctime;
+} imageFile;
+
+#endif /* IMAGE_H */
@@ -0,0 +1,264 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "inode.h"
+#include "sync.h"
+
+void inode_table_init(inodeTable* table) {
+    int i;
+
+    for (i = 0; i < MAX_INODE_SEGMENTS; i++)
+        table->segments[i] = NULL;
+    mutex_init(&table->growLock);
+    sync_profile_name(&table->growLock, "inode table", -1);
+    blockpool_init(&table->blocks);
+    table->imageFd = -1;
+    table->imageMap = NULL;
+}
+
+/* Calls release on every inode in use, then frees the table */
+void inode_table_destroy(inodeTable* table, void (*release)(inode*)) {
+    int i, j;
+
+    for (i = 0; i < MAX_INODE_SEGMENTS; i++) {
+        if (!table->segments[i])
+            continue;
+        for (j = 0; j < INODE_SEGMENT; j++) {
+            inode* node = &table->segments[i][j];
+            if (node->type != T_FREE && release)
+                release(node);
+            /* the blocks go with the pool */
+            free(node->blocks);
+            rwlock_destroy(&node->dataLock);
+        }
+        free(table->segments[i]);
+    }
+    blockpool_destroy(&table->blocks);
+    mutex_destroy(&table->growLock);
+}
+
+/* Inode of inumber, allocating its segment if needed */
+inode* inode_get(inodeTable* table, int inumber) {
+    int segment = inumber / INODE_SEGMENT;
+
+    if (inumber < 0 || segment >= MAX_INODE_SEGMENTS) {
+        fprintf(stderr, "Error: inumber %d out of the inode table\n", inumber);
+        exit(EXIT_FAILURE);
+    }
+
+    inode* inodes = __atomic_load_n(&table->segments[segment], __ATOMIC_ACQUIRE);
+    if (!inodes) {
+        mutex_lock(&table->growLock);
+        inodes = table->segments[segment];
+        if (!inodes) {
+            int j;
+
+            inodes = calloc(INODE_SEGMENT, sizeof(inode));
+            if (!inodes) {
+                perror("failed to allocate inodes");
+                exit(EXIT_FAILURE);
+            }
+            for (j = 0; j < INODE_SEGMENT; j++) {
+                rwlock_init(&inodes[j].dataLock);
+                sync_profile_name(&inodes[j].dataLock, "inode", segment * INODE_SEGMENT + j);
+            }
+            __atomic_store_n(&table->segments[segment], inodes, __ATOMIC_RELEASE);
+        }
+        mutex_unlock(&table->growLock);
+    }
+    return &inodes[inumber % INODE_SEGMENT];
+}
+
+/* Inode of inumber if its segment exists, without allocating, else NULL */
+inode* inode_find(inodeTable* table, int inumber) {
+    int segment = inumber / INODE_SEGMENT;
+
+    if (inumber < 0 || segment >= MAX_INODE_SEGMENTS)
+        return NULL;
+
+    inode* inodes = __atomic_load_n(&table->segments[segment], __ATOMIC_ACQUIRE);
+    return inodes ? &inodes[inumber % INODE_SEGMENT] : NULL;
+}
+
+int64_t inode_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Makes i an empty file, before it is linked anywhere */
+void inode_init_file(inode* i, uid_t owner, int permissions, int64_t now) {
+    i->owner = owner;
+    i->ownerPermissions = (permissions >> 2) & PERM_RW;
+    i->othersPermissions = permissions & PERM_RW;
+    i->size = 0;
+    i->atime = i->mtime = i->ctime = now;
+    i->type = T_FILE;
+}
+
+/* Gives the blocks of i back to the pool and empties it, with dataLock
+ * held exclusive (or no other thread able to reach i) */
+void inode_release_data(inodeTable* table, inode* i) {
+    int b;
+
+    for (b = 0; b < i->mapSize; b++)
+        if (i->blocks[b])
+            block_unref(&table->blocks, i->blocks[b]);
+    free(i->blocks);
+    i->blocks = NULL;
+    i->mapSize = 0;
+    i->image = NULL;
+    i->imageSize = 0;
+    i->size = 0;
+}
+
+/* True if uid may open i in mode */
+int inode_allows(inode* i, uid_t uid, int mode) {
+    int permissions = uid == i->owner ? i->ownerPermissions : i->othersPermissions;
+
+    return mode && (mode & permissions) == mode;
+}
+
+/* Copies up to size bytes at offset into dest, with dataLock held shared.
+ * Returns how many, 0 at the end of the file. atime is left to the
+ * caller, a snapshot reads files without accessing them. */
+size_t inode_read(inode* i, uint64_t offset, char* dest, size_t size) {
+    size_t done = 0;
+
+    if (offset >= i->size)
+        return 0;
+    if (size > i->size - offset)
+        size = i->size - offset;
+
+    while (done < size) {
+        uint64_t b = (offset + done) / BLOCK_SIZE;
+        size_t in = (offset + done) % BLOCK_SIZE;
+        size_t n = BLOCK_SIZE - in < size - done ? BLOCK_SIZE - in : size - done;
+
+        if (b < (uint64_t) i->mapSize && i->blocks[b])
+            memcpy(dest + done, i->blocks[b] + in, n);
+        else if (offset + done < i->imageSize) {
+            size_t image = i->imageSize - (offset + done);
+            memcpy(dest + done, i->image + offset + done, n < image ? n : image);
+            if (n > image)
+                memset(dest + done + image, 0, n - image);
+        }
+        else
+            memset(dest + done, 0, n);
+        done += n;
+    }
+    return size;
+}
+
+/* Passes the contents of up to size bytes at offset to visit, in order,
+ * as ranges of the fd they live in, with dataLock held shared. Blocks
+ * get a reference the visitor must drop with block_unref once it is done
+ * with them; image ranges need none, the image never changes. Holes are
+ * ranges with no fd. Returns the bytes visited, like inode_read. */
+size_t inode_ranges(inodeTable* table, inode* i, uint64_t offset, size_t size,
+                    void (*visit)(dataRange* range, void* arg), void* arg) {
+    size_t done = 0;
+
+    if (offset >= i->size)
+        return 0;
+    if (size > i->size - offset)
+        size = i->size - offset;
+
+    while (done < size) {
+        uint64_t b = (offset + done) / BLOCK_SIZE;
+        size_t in = (offset + done) % BLOCK_SIZE;
+        size_t n = BLOCK_SIZE - in < size - done ? BLOCK_SIZE - in : size - done;
+        dataRange range = { -1, 0, n, NULL };
+
+        if (b < (uint64_t) i->mapSize && i->blocks[b]) {
+            range.block = i->blocks[b];
+            range.fd = table->blocks.fd;
+            range.offset = block_offset(&table->blocks, range.block) + in;
+            block_ref(&table->blocks, range.block);
+        }
+        else if (offset + done < i->imageSize) {
+            size_t image = i->imageSize - (offset + done);
+
+            if (n > image)
+                range.size = n = image;     /* the rest of the block is a hole */
+            range.fd = table->imageFd;
+            range.offset = i->image + offset + done - table->imageMap;
+        }
+        visit(&range, arg);
+        done += n;
+    }
+    return size;
+}
+
+/* Block b of i, allocated (and filled from the image) if it is not yet,
+ * or copied if a read is still sending it, with dataLock held exclusive */
+static char* writable_block(inodeTable* table, inode* i, int b) {
+    if (b >= i->mapSize) {
+        int size = i->mapSize ? i->mapSize : 1;
+
+        while (size <= b)
+            size *= 2;
+        i->blocks = realloc(i->blocks, size * sizeof(char*));
+        if (!i->blocks) {
+            perror("failed to allocate a block map");
+            exit(EXIT_FAILURE);
+        }
+        memset(i->blocks + i->mapSize, 0, (size - i->mapSize) * sizeof(char*));
+        i->mapSize = size;
+    }
+
+    if (i->blocks[b] && block_shared(&table->blocks, i->blocks[b])) {
+        char* copy = block_alloc(&table->blocks);
+
+        memcpy(copy, i->blocks[b], BLOCK_SIZE);
+        block_unref(&table->blocks, i->blocks[b]);
+        i->blocks[b] = copy;
+    }
+    else if (!i->blocks[b]) {
+        uint64_t start = (uint64_t) b * BLOCK_SIZE;
+
+        i->blocks[b] = block_alloc(&table->blocks);
+        if (start < i->imageSize)
+            memcpy(i->blocks[b], i->image + start,
+                   i->imageSize - start < BLOCK_SIZE ? i->imageSize - start : BLOCK_SIZE);
+    }
+    return i->blocks[b];
+}
+
+/* Writes size bytes of data at offset, the file grows as needed (a gap
+ * reads as zeros). With dataLock held exclusive.
+ * Returns 0, or -1 if the file would grow past MAX_FILE_BLOCKS */
+int inode_write(inodeTable* table, inode* i, uint64_t offset, const char* data, size_t size) {
+    size_t done = 0;
+
+    if (offset + size > (uint64_t) MAX_FILE_BLOCKS * BLOCK_SIZE)
+        return -1;
+
+    while (done < size) {
+        int b = (offset + done) / BLOCK_SIZE;
+        size_t in = (offset + done) % BLOCK_SIZE;
+        size_t n = BLOCK_SIZE - in < size - done ? BLOCK_SIZE - in : size - done;
+
+        memcpy(writable_block(table, i, b) + in, data + done, n);
+        done += n;
+    }
+    if (offset + size > i->size)
+        i->size = offset + size;
+    i->mtime = i->ctime = inode_now();
+    return 0;
+}
+
+void inode_stat(inode* i, inodeStat* st) {
+    st->type = i->type;
+    st->owner = i->owner;
+    st->ownerPermissions = i->ownerPermissions;
+    st->othersPermissions = i->othersPermissions;
+    st->size = i->size;
+    st->atime = __atomic_load_n(&i->atime, __ATOMIC_RELAXED);
+    st->mtime = i->mtime;
+    st->ctime = i->ctime;
+}
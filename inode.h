@@ -0,0 +1,93 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef INODE_H
+#define INODE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "lib/blockpool.h"
+
+/* Inodes are indexed by inumber. Inumbers are handed out in increasing
+ * order and never reused, so the table is an array grown in fixed-size
+ * segments that are allocated on first use and never moved. */
+#define INODE_SEGMENT       4096
+#define MAX_INODE_SEGMENTS  65536
+
+#define T_FREE       0  /* no inode, or a file that was deleted */
+#define T_FILE       1
+#define T_DIRECTORY  2
+
+/* Permissions of the owner and of the others, and modes of an open */
+#define PERM_NONE   0
+#define PERM_WRITE  1
+#define PERM_READ   2
+#define PERM_RW     3
+#define PERMISSIONS(owner, others)  ((owner) << 2 | (others))
+
+#define MAX_FILE_BLOCKS  (1 << 18)     /* files up to 1 GiB */
+
+struct directory;
+
+/* The contents of a file are a map of blocks from the block pool, block
+ * i holding bytes [i * BLOCK_SIZE, (i + 1) * BLOCK_SIZE). A block that
+ * was never written is NULL and reads as zeros, or as the data the file
+ * had in the mapped image, copied into a block the first time it is
+ * written. Everything but type and dir is changed under dataLock
+ * exclusive; reads hold it shared and only touch atime, atomically. */
+typedef struct inode {
+    int type;
+    struct directory* dir;  /* directories only */
+    pthread_rwlock_t dataLock;
+    uid_t owner;
+    int ownerPermissions;
+    int othersPermissions;
+    uint64_t size;
+    int64_t atime, mtime, ctime;    /* ns since the epoch */
+    char** blocks;
+    int mapSize;                    /* capacity of blocks */
+    const char* image;              /* data still in the mapped image */
+    uint64_t imageSize;
+} inode;
+
+typedef struct inodeStat {
+    int type;
+    uid_t owner;
+    int ownerPermissions;
+    int othersPermissions;
+    uint64_t size;
+    int64_t atime, mtime, ctime;
+} inodeStat;
+
+/* Part of the contents of a file as a range of an fd (see inode_ranges) */
+typedef struct dataRange {
+    int fd;             /* -1 for a hole, which reads as zeros */
+    off_t offset;
+    size_t size;
+    char* block;        /* referenced block the range is in, or NULL */
+} dataRange;
+
+typedef struct inodeTable {
+    inode* segments[MAX_INODE_SEGMENTS];
+    pthread_mutex_t growLock;
+    blockPool blocks;
+    int imageFd;                /* of the image the image pointers are in, or -1 */
+    const char* imageMap;
+} inodeTable;
+
+void inode_table_init(inodeTable* table);
+void inode_table_destroy(inodeTable* table, void (*release)(inode*));
+inode* inode_get(inodeTable* table, int inumber);
+inode* inode_find(inodeTable* table, int inumber);
+
+int64_t inode_now();
+void inode_init_file(inode* i, uid_t owner, int permissions, int64_t now);  /* PERMISSIONS() */
+void inode_release_data(inodeTable* table, inode* i);
+int inode_allows(inode* i, uid_t uid, int mode);
+size_t inode_read(inode* i, uint64_t offset, char* dest, size_t size);
+size_t inode_ranges(inodeTable* table, inode* i, uint64_t offset, size_t size,
+                    void (*visit)(dataRange* range, void* arg), void* arg);
+int inode_write(inodeTable* table, inode* i, uint64_t offset, const char* data, size_t size);
+void inode_stat(inode* i, inodeStat* st);
+
+#endif /* INODE_H */
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE     /* memfd_create */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "blockpool.h"
+#include "../sync.h"
+
+void blockpool_init(blockPool* pool) {
+    mutex_init(&pool->lock);
+    sync_profile_name(&pool->lock, "block pool", -1);
+    pool->freeList = NULL;
+    pool->slabs = 0;
+    pool->unused = 0;
+    pool->inUse = 0;
+
+    /* only reserved: pages of the range and of refs cost nothing until
+       they are used */
+    pool->fd = memfd_create("tecnicofs-blocks", MFD_CLOEXEC);
+    pool->base = mmap(NULL, POOL_RESERVE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    pool->refs = mmap(NULL, POOL_BLOCKS * sizeof(int), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool->fd < 0 || pool->base == MAP_FAILED || pool->refs == MAP_FAILED) {
+        perror("failed to create block pool");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Releases every block at once */
+void blockpool_destroy(blockPool* pool) {
+    munmap(pool->base, POOL_RESERVE);
+    munmap(pool->refs, POOL_BLOCKS * sizeof(int));
+    close(pool->fd);
+    mutex_destroy(&pool->lock);
+}
+
+/* Maps one more slab of the memfd after the others */
+static void add_slab(blockPool* pool) {
+    off_t offset = (off_t) (pool->slabs * SLAB_SIZE);
+
+    if ((pool->slabs + 1) * SLAB_SIZE > POOL_RESERVE ||
+        ftruncate(pool->fd, offset + SLAB_SIZE) < 0 ||
+        mmap(pool->base + offset, SLAB_SIZE, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, pool->fd, offset) == MAP_FAILED) {
+        perror("failed to allocate blocks");
+        exit(EXIT_FAILURE);
+    }
+    pool->slabs++;
+    pool->unused = SLAB_BLOCKS;
+}
+
+static int* refs_of(blockPool* pool, const char* block) {
+    return &pool->refs[(block - pool->base) / BLOCK_SIZE];
+}
+
+/* A block, zeroed, with one reference */
+char* block_alloc(blockPool* pool) {
+    char* block;
+
+    mutex_lock(&pool->lock);
+    if (pool->freeList) {
+        block = pool->freeList;
+        pool->freeList = *(void**) block;
+    }
+    else {
+        if (!pool->unused)
+            add_slab(pool);
+        block = pool->base + pool->slabs * SLAB_SIZE - (size_t) pool->unused * BLOCK_SIZE;
+        pool->unused--;
+    }
+    pool->inUse++;
+    mutex_unlock(&pool->lock);
+
+    /* zeroed outside the lock */
+    memset(block, 0, BLOCK_SIZE);
+    __atomic_store_n(refs_of(pool, block), 1, __ATOMIC_RELAXED);
+    return block;
+}
+
+void block_ref(blockPool* pool, char* block) {
+    __atomic_add_fetch(refs_of(pool, block), 1, __ATOMIC_RELAXED);
+}
+
+/* The block goes back to the pool with its last reference */
+void block_unref(blockPool* pool, char* block) {
+    if (__atomic_sub_fetch(refs_of(pool, block), 1, __ATOMIC_ACQ_REL))
+        return;
+
+    mutex_lock(&pool->lock);
+    *(void**) block = pool->freeList;
+    pool->freeList = block;
+    pool->inUse--;
+    mutex_unlock(&pool->lock);
+}
+
+/* True if someone besides the file holds the block */
+int block_shared(blockPool* pool, char* block) {
+    return __atomic_load_n(refs_of(pool, block), __ATOMIC_ACQUIRE) > 1;
+}
+
+/* Where the block is in pool->fd */
+off_t block_offset(blockPool* pool, const char* block) {
+    return (off_t) (block - pool->base);
+}
@@ -0,0 +1,44 @@
+#ifndef BLOCKPOOL_H
+#define BLOCKPOOL_H 1
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Fixed-size blocks for the contents of files, carved out of slabs of
+ * SLAB_BLOCKS blocks. Freed blocks go to a free list and are reused;
+ * slabs only go back to the system when the pool is destroyed, like the
+ * node pools of the trees.
+ *
+ * The slabs are pages of one memfd, mapped in order into an address
+ * range reserved up front, so a block is also a range of that fd (see
+ * block_offset) and can be handed to sendfile without copying it.
+ * A block is reference counted: the file it belongs to holds one
+ * reference and a read sending it holds another until the kernel is
+ * done with the pages, so a write to a block with more than one
+ * reference must go to a copy (block_shared). */
+#define BLOCK_SIZE   4096
+#define SLAB_BLOCKS  256
+#define SLAB_SIZE    ((size_t) SLAB_BLOCKS * BLOCK_SIZE)
+#define POOL_RESERVE ((size_t) 1 << 36)     /* 64 GiB of address space */
+#define POOL_BLOCKS  (POOL_RESERVE / BLOCK_SIZE)
+
+typedef struct blockPool {
+    pthread_mutex_t lock;
+    void* freeList;             /* linked through the first word of a block */
+    char* base;                 /* of the reserved range */
+    int fd;                     /* memfd backing it */
+    size_t slabs;               /* mapped at base */
+    int unused;                 /* blocks never handed out in the last slab */
+    int* refs;                  /* per block, atomic */
+    long inUse;
+} blockPool;
+
+void blockpool_init(blockPool* pool);
+void blockpool_destroy(blockPool* pool);
+char* block_alloc(blockPool* pool);
+void block_ref(blockPool* pool, char* block);
+void block_unref(blockPool* pool, char* block);
+int block_shared(blockPool* pool, char* block);
+off_t block_offset(blockPool* pool, const char* block);
+
+#endif
@@ -3,26 +3,137 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
+#include <endian.h>
 #include "bst.h"
 #include "../constants.h"
 
+#define SLOT_SIZE(class) (32 << (class))
+
+int bstDelay = DELAY;
+
 void insertDelay(int cycles){
     for(int i=0; i < cycles; i++){}
 }
 
-node* new_node(char* key, int inumber)
+void pool_init(nodePool* pool)
+{
+    memset(pool, 0, sizeof(nodePool));
+}
+
+/* Releases every node of the pool at once */
+void pool_destroy(nodePool* pool)
+{
+    poolChunk* chunk = pool->chunks;
+
+    while (chunk) {
+        poolChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pool_init(pool);
+}
+
+static int size_class(size_t keySize)
 {
-    node* p = malloc(sizeof(node));
-    if (!p){
-        perror("new_node: no memory for a new node");
+    size_t size = offsetof(node, key) + keySize;
+    int class = 0;
+
+    while (class < POOL_CLASSES && (size_t) SLOT_SIZE(class) < size)
+        class++;
+    if (class == POOL_CLASSES) {
+        fprintf(stderr, "new_node: name too long\n");
         exit(EXIT_FAILURE);
     }
+    return class;
+}
+
+static node* pool_alloc(nodePool* pool, int class)
+{
+    node* p = pool->freeList[class];
+
+    if (p) {
+        pool->freeList[class] = p->left;
+        return p;
+    }
+
+    if (pool->next[class] == pool->end[class]) {
+        int slots = pool->chunkSlots[class] ? pool->chunkSlots[class] : POOL_MIN_SLOTS;
+        /* zeroed and padded so that optimistic readers (see search_optimistic)
+         * only ever find valid pointers and never compare keys past the end */
+        poolChunk* chunk = calloc(1, sizeof(poolChunk) +
+                                  (size_t) slots * SLOT_SIZE(class) + MAX_INPUT_SIZE);
+        if (!chunk){
+            perror("new_node: no memory for a new node");
+            exit(EXIT_FAILURE);
+        }
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+        pool->next[class] = chunk->slots;
+        pool->end[class] = chunk->slots + (size_t) slots * SLOT_SIZE(class);
+        if (slots < POOL_MAX_SLOTS)
+            pool->chunkSlots[class] = slots * 2;
+        else
+            pool->chunkSlots[class] = slots;
+    }
+
+    p = (node*) pool->next[class];
+    pool->next[class] += SLOT_SIZE(class);
+    return p;
+}
+
+static void pool_release(nodePool* pool, node* p)
+{
+    int class = size_class(strlen(p->key) + 1);
+
+    p->left = pool->freeList[class];
+    pool->freeList[class] = p;
+}
+
+static uint64_t key_prefix(char* key)
+{
+    uint64_t prefix = 0;
+    int i;
+
+    for (i = 0; i < KEY_PREFIX && key[i]; i++)
+        prefix |= (uint64_t) (unsigned char) key[i] << (8 * (KEY_PREFIX - 1 - i));
+    return prefix;
+}
+
+/* key_prefix of the key of p, read in one load from its padded key */
+static inline uint64_t node_prefix(node* p)
+{
+    uint64_t prefix;
+
+    memcpy(&prefix, p->key, sizeof(prefix));
+    return be64toh(prefix);
+}
+
+/* Same sign as strcmp(key, p->key), prefix being key_prefix(key). Equal
+ * prefixes with a zero byte are equal keys, both end inside them. */
+static inline int compare_key(uint64_t prefix, char* key, node* p)
+{
+    uint64_t other = node_prefix(p);
+
+    if (prefix != other)
+        return prefix < other ? -1 : 1;
+    if (!(prefix & 0xff))
+        return 0;
+    return strcmp(key + KEY_PREFIX, p->key + KEY_PREFIX);
+}
+
+static node* new_node(nodePool* pool, char* key, uint32_t hash, int inumber)
+{
     size_t size = strlen(key) + 1;
-    p->key = malloc(sizeof(char) * size);
+    node* p = pool_alloc(pool, size_class(size));
 
-    strncpy(p->key, key, size);
+    memcpy(p->key, key, size);
+    if (size < KEY_PREFIX)
+        memset(p->key + size, 0, KEY_PREFIX - size);
     p->inumber = inumber;
+    p->height = 1;
+    p->hash = hash;
     p->left  = NULL;
     p->right = NULL;
     return p;
@@ -33,112 +144,437 @@ int max(int a, int b)
     return a > b ? a : b;
 }
 
+#ifdef AVL
+#define MAX_HEIGHT 64   /* an AVL tree this tall would hold over 2^44 nodes */
+#define MAX_OPTIMISTIC_DEPTH MAX_HEIGHT
+
+static int height(node* p)
+{
+    return p ? p->height : 0;
+}
+
+static void update_height(node* p)
+{
+    p->height = 1 + max(height(p->left), height(p->right));
+}
+
+static node* rotate_right(node* p)
+{
+    node* l = p->left;
+
+    p->left = l->right;
+    l->right = p;
+    update_height(p);
+    update_height(l);
+    return l;
+}
+
+static node* rotate_left(node* p)
+{
+    node* r = p->right;
+
+    p->right = r->left;
+    r->left = p;
+    update_height(p);
+    update_height(r);
+    return r;
+}
+
+/* Restores the AVL invariant on p after one of its subtrees
+ * changed height by at most one. Returns the new subtree root. */
+static node* rebalance(node* p)
+{
+    update_height(p);
+    int balance = height(p->left) - height(p->right);
+
+    if (balance > 1) {
+        if (height(p->left->left) < height(p->left->right))
+            p->left = rotate_left(p->left);
+        return rotate_right(p);
+    }
+    if (balance < -1) {
+        if (height(p->right->right) < height(p->right->left))
+            p->right = rotate_right(p->right);
+        return rotate_left(p);
+    }
+    return p;
+}
+
+/* Links from the root down to the changed position, so the
+ * tree can be rebalanced bottom-up without recursion. */
+typedef struct treePath {
+    node** link[MAX_HEIGHT];
+    int depth;
+} treePath;
+
+static void path_push(treePath* path, node** link)
+{
+    assert(path->depth < MAX_HEIGHT);
+    path->link[path->depth++] = link;
+}
+
+static void path_replace(treePath* path, int i, node** link)
+{
+    if (i < path->depth)
+        path->link[i] = link;
+}
+
+static void path_rebalance(treePath* path)
+{
+    while (path->depth > 0) {
+        node** link = path->link[--path->depth];
+        node* p = *link;
+        int oldHeight = p->height;
+
+        *link = rebalance(p);
+        /* ancestors only depend on the height of this subtree */
+        if (*link == p && p->height == oldHeight)
+            break;
+    }
+}
+#else
+/* deeper unbalanced trees are searched under the lock */
+#define MAX_OPTIMISTIC_DEPTH 4096
+
+/* plain BST, nodes stay where they were inserted */
+typedef struct treePath {
+    int depth;
+} treePath;
+
+static void path_push(treePath* path, node** link)
+{
+    (void) path;
+    (void) link;
+}
+
+static void path_replace(treePath* path, int i, node** link)
+{
+    (void) path;
+    (void) i;
+    (void) link;
+}
+
+static void path_rebalance(treePath* path)
+{
+    (void) path;
+}
+#endif
+
 node* search(node* p, char* key)
 {
-    insertDelay(DELAY);
-    if (!p)
-        return NULL;
-
-    int comp = strcmp(key, p->key);
-    if (comp < 0)
-        return search(p->left, key);
-    else if (comp > 0)
-        return search(p->right, key);
-    else
-        return p;
+    uint64_t prefix = key_prefix(key);
+
+    insertDelay(bstDelay);
+    while (p) {
+        int comp = compare_key(prefix, key, p);
+        if (comp < 0)
+            p = p->left;
+        else if (comp > 0)
+            p = p->right;
+        else
+            return p;
+    }
+    return NULL;
 }
 
-node* insert(node* p, char* key, int inumber)
+/* Search without holding the bucket lock, for callers that validate the
+ * result with the bucket's sequence counter. Nodes are never returned to
+ * the system while the pool lives, so a racing writer can only make this
+ * walk into recycled nodes: the result is garbage but the walk is safe.
+ * Rotations may briefly create cycles, so the walk gives up (returns -1)
+ * after too many steps. Returns 1 and sets inumber if key was found. */
+int search_optimistic(node* p, char* key, int* inumber)
 {
-    insertDelay(DELAY);
-    if (!p){
-        return new_node(key, inumber);
+    uint64_t prefix = key_prefix(key);
+    int steps = 0;
+
+    insertDelay(bstDelay);
+    while (p) {
+        if (++steps > MAX_OPTIMISTIC_DEPTH)
+            return -1;
+
+        int comp = compare_key(prefix, key, p);
+        if (comp < 0)
+            p = __atomic_load_n(&p->left, __ATOMIC_ACQUIRE);
+        else if (comp > 0)
+            p = __atomic_load_n(&p->right, __ATOMIC_ACQUIRE);
+        else {
+            *inumber = __atomic_load_n(&p->inumber, __ATOMIC_RELAXED);
+            return 1;
+        }
     }
+    return 0;
+}
+
+/* Links a node that is already allocated, the
+ * caller makes sure its key is not in the tree */
+static node* attach_node(node* root, node* n)
+{
+    treePath path = { .depth = 0 };
+    node** link = &root;
+    uint64_t prefix = node_prefix(n);
 
-    int comp = strcmp(key, p->key);
-    if (comp < 0){
-        p->left = insert(p->left, key, inumber);
+    while (*link) {
+        path_push(&path, link);
+        if (compare_key(prefix, n->key, *link) < 0)
+            link = &(*link)->left;
+        else
+            link = &(*link)->right;
     }
-    else if (comp > 0){
-        p->right = insert(p->right, key, inumber);
+    *link = n;
+    path_rebalance(&path);
+    return root;
+}
+
+/* Adds key unless it is already in the tree, inserted tells which */
+node* insert(nodePool* pool, node* root, char* key, uint32_t hash, int inumber, int* inserted)
+{
+    treePath path = { .depth = 0 };
+    node** link = &root;
+    uint64_t prefix = key_prefix(key);
+
+    insertDelay(bstDelay);
+    *inserted = 0;
+    while (*link) {
+        int comp = compare_key(prefix, key, *link);
+        if (comp == 0)
+            return root;
+        path_push(&path, link);
+        link = comp < 0 ? &(*link)->left : &(*link)->right;
     }
-    else 
-        p->inumber = inumber;
-    return p;
+
+    *link = new_node(pool, key, hash, inumber);
+    *inserted = 1;
+    path_rebalance(&path);
+    return root;
 }
 
 node* find_min(node* p)
 {
-    if ( p->left != NULL )
-        return find_min(p->left);
-    else
-        return p;
+    while (p->left != NULL)
+        p = p->left;
+    return p;
 }
 
-node* remove_min(node* p)
+/* Unlinks the minimum of p (the node itself is not released) */
+node* remove_min(node* root)
 {
-    if ( p->left == NULL )
-        return p->right;
+    treePath path = { .depth = 0 };
+    node** link = &root;
 
-    p->left = remove_min(p->left);
-    return p;
+    while ((*link)->left != NULL) {
+        path_push(&path, link);
+        link = &(*link)->left;
+    }
+    *link = (*link)->right;
+    path_rebalance(&path);
+    return root;
 }
 
-node* remove_item(node* p, char* key)
+/* Removes key if it is in the tree, inumber gets the
+ * inumber of the removed node (0 if there was none) */
+node* remove_item(nodePool* pool, node* root, char* key, int* inumber)
 {
-    insertDelay(DELAY);
-    if (!p)
-        return NULL;
-    
-    int comp = strcmp(key, p->key);
-    if (comp < 0)
-        p->left = remove_item(p->left, key);
-    else if (comp > 0)
-        p->right = remove_item(p->right, key);
-    else
-    {
-        node* l = p->left;
-        node* r = p->right;
-        node* m;
-        free(p->key);
-        free(p);
-
-        if (r == NULL)
-            return l;
-
-        m = find_min(r);
-        m->right = remove_min(r);        
-        m->left = l;
-
-        return m;
+    treePath path = { .depth = 0 };
+    node** link = &root;
+    uint64_t prefix = key_prefix(key);
+
+    insertDelay(bstDelay);
+    *inumber = 0;
+    while (*link) {
+        int comp = compare_key(prefix, key, *link);
+        if (comp == 0)
+            break;
+        path_push(&path, link);
+        link = comp < 0 ? &(*link)->left : &(*link)->right;
     }
+    if (!*link)
+        return root;
 
-    return p;
+    node* p = *link;
+    *inumber = p->inumber;
+
+    if (p->right == NULL) {
+        *link = p->left;
+    }
+    else {
+        /* replace p by the minimum of its right subtree */
+        path_push(&path, link);
+        int below = path.depth;
+        node** mlink = &p->right;
+
+        while ((*mlink)->left != NULL) {
+            path_push(&path, mlink);
+            mlink = &(*mlink)->left;
+        }
+        node* m = *mlink;
+        *mlink = m->right;
+        m->left = p->left;
+        m->right = p->right;
+        m->height = p->height;
+        *link = m;
+        /* the path went through p->right, which now hangs from m */
+        path_replace(&path, below, &m->right);
+    }
+
+    pool_release(pool, p);
+    path_rebalance(&path);
+    return root;
 }
 
-void free_tree(node* p)
+/* Growable stack of nodes for the traversals that visit the whole tree
+ * (an unbalanced tree can be as deep as it has nodes). */
+#define STACK_INLINE 64     /* nodes a traversal holds before it allocates */
+
+/* Starts in the inline arrays, which hold the path of any balanced tree,
+ * so walking a bucket (a split, a filter rebuild) allocates nothing */
+typedef struct nodeStack {
+    node** items;
+    int *levels;
+    int size, capacity;
+    node* inlineItems[STACK_INLINE];
+    int inlineLevels[STACK_INLINE];
+} nodeStack;
+
+static void stack_init(nodeStack* stack)
+{
+    stack->items = stack->inlineItems;
+    stack->levels = stack->inlineLevels;
+    stack->size = 0;
+    stack->capacity = STACK_INLINE;
+}
+
+static void stack_push(nodeStack* stack, node* p, int level)
 {
     if (!p)
         return;
 
-    free_tree(p->left);
-    free_tree(p->right);
-    free(p->key);
-    free(p);
+    if (stack->size == stack->capacity) {
+        int inlined = stack->items == stack->inlineItems;
+
+        stack->capacity *= 2;
+        stack->items = realloc(inlined ? NULL : stack->items, stack->capacity * sizeof(node*));
+        stack->levels = realloc(inlined ? NULL : stack->levels, stack->capacity * sizeof(int));
+        if (!stack->items || !stack->levels) {
+            perror("bst: no memory for traversal");
+            exit(EXIT_FAILURE);
+        }
+        if (inlined) {
+            memcpy(stack->items, stack->inlineItems, sizeof(stack->inlineItems));
+            memcpy(stack->levels, stack->inlineLevels, sizeof(stack->inlineLevels));
+        }
+    }
+    stack->items[stack->size] = p;
+    stack->levels[stack->size++] = level;
 }
 
-void print_tree_2(FILE * fp, node* p, int l)
+static void stack_free(nodeStack* stack)
 {
-    if (p) {
-        print_tree_2(fp, p->left, l+1);
-        fprintf(fp, "%*s%s\n", 2*(l+1), "" , p->key);
-        print_tree_2(fp, p->right, l+1);
+    if (stack->items != stack->inlineItems) {
+        free(stack->items);
+        free(stack->levels);
     }
 }
 
-void print_tree(FILE* fp, node* p)
+/* Moves the nodes for which moves() is true from the tree in *from to the
+ * tree in *to, copying them into toPool. The remaining nodes are relinked
+ * in pre-order, which keeps the shape of the subtrees that stay together. */
+void split_tree(nodePool* fromPool, node** from, nodePool* toPool, node** to,
+                int (*moves)(node*, void*), void* arg)
 {
-  fprintf(fp, "\n");
-  print_tree_2(fp, p, 0);
+    nodeStack stack;
+
+    stack_init(&stack);
+    stack_push(&stack, *from, 0);
+    *from = NULL;
+
+    while (stack.size > 0) {
+        node* p = stack.items[--stack.size];
+
+        stack_push(&stack, p->right, 0);
+        stack_push(&stack, p->left, 0);
+        p->left  = NULL;
+        p->right = NULL;
+        p->height = 1;
+
+        if (moves(p, arg)) {
+            *to = attach_node(*to, new_node(toPool, p->key, p->hash, p->inumber));
+            pool_release(fromPool, p);
+        }
+        else
+            *from = attach_node(*from, p);
+    }
+
+    stack_free(&stack);
 }
 
+/* Calls visit on the nodes from key on (or only after it, if strict) in
+ * key order, until visit returns 0. Only the path down to the first one
+ * is walked to get there, not the nodes before it. */
+void traverse_from(node* p, char* key, int strict, int (*visit)(node*, void*), void* arg)
+{
+    nodeStack stack;
+    uint64_t prefix = key_prefix(key);
+
+    stack_init(&stack);
+    /* the nodes where the search for key goes left are the next ones */
+    while (p) {
+        int comp = compare_key(prefix, key, p);
+        if (comp < 0 || (comp == 0 && !strict))
+            stack_push(&stack, p, 0);
+        p = comp < 0 ? p->left : comp > 0 || strict ? p->right : NULL;
+    }
+
+    while (stack.size > 0) {
+        p = stack.items[--stack.size];
+        if (!visit(p, arg))
+            break;
+        for (p = p->right; p; p = p->left)
+            stack_push(&stack, p, 0);
+    }
+
+    stack_free(&stack);
+}
+
+/* Calls visit on every node, in key order */
+void traverse_tree(node* p, void (*visit)(node*, void*), void* arg)
+{
+    nodeStack stack;
+
+    stack_init(&stack);
+    while (p || stack.size > 0) {
+        while (p) {
+            stack_push(&stack, p, 0);
+            p = p->left;
+        }
+        p = stack.items[--stack.size];
+        visit(p, arg);
+        p = p->right;
+    }
+
+    stack_free(&stack);
+}
+
+void print_tree(FILE* fp, node* p)
+{
+    nodeStack stack;
+    int l = 0;
+
+    stack_init(&stack);
+    fprintf(fp, "\n");
+    /* in-order, indenting each key by its depth */
+    while (p || stack.size > 0) {
+        while (p) {
+            stack_push(&stack, p, l++);
+            p = p->left;
+        }
+        stack.size--;
+        p = stack.items[stack.size];
+        l = stack.levels[stack.size];
+        fprintf(fp, "%*s%s\n", 2*(l+1), "" , p->key);
+        p = p->right;
+        l++;
+    }
+
+    stack_free(&stack);
+}
@@ -4,22 +4,67 @@
 #ifndef BST_H
 #define BST_H
 #include <stdio.h>
+#include <stdint.h>
 
-typedef struct node {
-    char* key;
-    int inumber;
+/* Leading bytes of a key that are compared as one big-endian integer,
+ * which orders them as strcmp would: most comparisons are decided by it
+ * (see compare_key in bst.c). A node key is padded with zeros to this
+ * size in its slot, so the header leaves room for it in the smallest. */
+#define KEY_PREFIX  8
+
+/* Bits of its key hash a node keeps beside its height, in the header
+ * the height had to itself: the fs picks buckets and filter bits from
+ * these bits alone (key_hash in fs.c), so a split or a filter rebuild
+ * does not hash the keys again. */
+#define NODE_HASH_BITS  24
 
+typedef struct node {
     struct node* left;
     struct node* right;
+    int inumber;
+    unsigned int height : 8;                /* only maintained by the AVL build */
+    unsigned int hash : NODE_HASH_BITS;     /* as given to insert */
+    char key[];     /* stored inline, in the same pool slot */
 } node;
 
+/* Nodes are carved out of chunks owned by a pool (one per bucket) in a
+ * few size classes, so that the key fits in the node slot. Removed
+ * nodes go to a per-class free list and are reused by later inserts;
+ * memory only goes back to the system when the whole pool is destroyed. */
+#define POOL_CLASSES    4       /* slots of 32, 64, 128 and 256 bytes */
+#define POOL_MIN_SLOTS  8       /* slots in the first chunk of a class */
+#define POOL_MAX_SLOTS  1024    /* chunks double up to this many slots */
+
+typedef struct poolChunk {
+    struct poolChunk* next;
+    char slots[];
+} poolChunk;
+
+typedef struct nodePool {
+    node* freeList[POOL_CLASSES];
+    char* next[POOL_CLASSES];   /* first unused slot of the current chunk */
+    char* end[POOL_CLASSES];
+    int chunkSlots[POOL_CLASSES];
+    poolChunk* chunks;
+} nodePool;
+
+/* Cycles of insertDelay spent by every search, insert and removal,
+ * DELAY unless changed at runtime */
+extern int bstDelay;
+
 void insertDelay(int cycles);
+void pool_init(nodePool *pool);
+void pool_destroy(nodePool *pool);
 node *search(node *p, char* key);
-node *insert(node *p, char* key, int inumber);
+int search_optimistic(node *p, char* key, int* inumber);
+node *insert(nodePool *pool, node *p, char* key, uint32_t hash, int inumber, int* inserted);
 node *find_min(node *p);
 node *remove_min(node *p);
-node *remove_item(node *p, char* key);
-void free_tree(node *p);
+node *remove_item(nodePool *pool, node *p, char* key, int* inumber);
+void split_tree(nodePool *fromPool, node **from, nodePool *toPool, node **to,
+                int (*moves)(node *, void *), void *arg);
+void traverse_tree(node *p, void (*visit)(node *, void *), void *arg);
+void traverse_from(node *p, char *key, int strict, int (*visit)(node *, void *), void *arg);
 void print_tree(FILE* fp, node *p);
 
 #endif /* BST_H */
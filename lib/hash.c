@@ -1,13 +1,34 @@
 #include "hash.h"
 
-/* Simple hash function for strings.
- * Receives a string and resturns its hash value
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+/* 64-bit FNV-1a over the whole string, followed by a final avalanche
+ * so that the low bits (the ones used to pick a bucket) depend on
+ * every character of the name and not only on its last ones. */
+uint64_t hash_key(char* name) {
+	uint64_t h = FNV_OFFSET_BASIS;
+	unsigned char* c;
+
+	for (c = (unsigned char*) name; *c; c++) {
+		h ^= *c;
+		h *= FNV_PRIME;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Hash function for strings.
+ * Receives a string and returns its hash value
  * which is a number between 0 and n-1
  * In case the string is null, returns -1 */
 int hash(char* name, int n) {
 	if (!name) 
 		return -1;
-	return (int) name[0] % n;
+	return (int) (hash_key(name) % (uint64_t) n);
 }
-
-
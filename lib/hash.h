@@ -1,6 +1,9 @@
 #ifndef HASH_H
 #define HASH_H 1
 
+#include <stdint.h>
+
+uint64_t hash_key(char* name);
 int hash(char* name, int n);
 
 #endif
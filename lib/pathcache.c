@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pathcache.h"
+#include "hash.h"
+
+pathCache* pathcache_new() {
+    pathCache* cache = calloc(1, sizeof(pathCache));
+
+    if (!cache) {
+        perror("failed to allocate path cache");
+        exit(EXIT_FAILURE);
+    }
+    return cache;
+}
+
+void pathcache_free(pathCache* cache) {
+    free(cache);
+}
+
+/* Read before walking a path, the result is cached with it */
+unsigned int pathcache_generation(pathCache* cache) {
+    return __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+}
+
+void pathcache_invalidate(pathCache* cache) {
+    __atomic_add_fetch(&cache->generation, 1, __ATOMIC_ACQ_REL);
+}
+
+static pathCacheSlot* slot_of(pathCache* cache, char* key) {
+    return &cache->slots[hash_key(key) % PATH_CACHE_SLOTS];
+}
+
+/* Returns 1 and the cached value of key, or 0 */
+int pathcache_get(pathCache* cache, char* key, int* value) {
+    int length = strlen(key);
+    pathCacheSlot* slot = slot_of(cache, key);
+    unsigned int seq, generation;
+    int hit, cached;
+
+    if (length >= PATH_CACHE_KEY)
+        return 0;
+
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return 0;   /* being written */
+    generation = slot->generation;
+    cached = slot->value;
+    hit = slot->length == length && !memcmp(slot->key, key, length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+        return 0;
+
+    if (!hit || generation != pathcache_generation(cache))
+        return 0;
+    *value = cached;
+    return 1;
+}
+
+void pathcache_put(pathCache* cache, char* key, unsigned int generation, int value) {
+    int length = strlen(key);
+    pathCacheSlot* slot = slot_of(cache, key);
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    if (length >= PATH_CACHE_KEY || (seq & 1) ||
+        !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->generation = generation;
+    slot->value = value;
+    slot->length = length;
+    memcpy(slot->key, key, length);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,36 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H 1
+
+/* Cache of resolved directory paths ("a/b/c" -> inumber of c), so a deep
+ * path is not walked component by component on every operation.
+ * It is direct mapped: a path has a single slot, where it replaces
+ * whatever was there. Each slot is a small seqlock, lookups never block
+ * and a writer that finds the slot busy just does not cache.
+ * Entries carry the generation of the cache when the walk started;
+ * renaming or removing a directory bumps the generation before and after
+ * the change, which invalidates every entry at once. */
+
+#define PATH_CACHE_SLOTS  4096
+#define PATH_CACHE_KEY    116   /* longer paths are not cached */
+
+typedef struct pathCacheSlot {
+    unsigned int seq;
+    unsigned int generation;
+    int value;
+    int length;
+    char key[PATH_CACHE_KEY];
+} pathCacheSlot;
+
+typedef struct pathCache {
+    unsigned int generation;
+    pathCacheSlot slots[PATH_CACHE_SLOTS];
+} pathCache;
+
+pathCache* pathcache_new();
+void pathcache_free(pathCache* cache);
+unsigned int pathcache_generation(pathCache* cache);
+void pathcache_invalidate(pathCache* cache);
+int pathcache_get(pathCache* cache, char* key, int* value);
+void pathcache_put(pathCache* cache, char* key, unsigned int generation, int value);
+
+#endif
@@ -0,0 +1,126 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "ring.h"
+
+/* size is rounded up to a power of two */
+void ring_init(commandRing* ring, unsigned long size)
+{
+    unsigned long capacity = 2, i;
+
+    while (capacity < size)
+        capacity *= 2;
+
+    memset(ring, 0, sizeof(commandRing));
+    ring->cells = malloc(capacity * sizeof(ringCell));
+    if (!ring->cells) {
+        perror("ring_init: no memory for the commands");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < capacity; i++)
+        ring->cells[i].seq = i;
+    ring->mask = capacity - 1;
+}
+
+void ring_destroy(commandRing* ring)
+{
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+/* Returns 0 if the ring is full */
+int ring_try_push(commandRing* ring, command* cmd)
+{
+    unsigned long pos = __atomic_load_n(&ring->enqueuePos, __ATOMIC_RELAXED);
+
+    while (1) {
+        ringCell* cell = &ring->cells[pos & ring->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->enqueuePos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->cmd = *cmd;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+            /* pos was reloaded by the failed CAS */
+        }
+        else if (diff < 0)
+            return 0;
+        else
+            pos = __atomic_load_n(&ring->enqueuePos, __ATOMIC_RELAXED);
+    }
+}
+
+void ring_push(commandRing* ring, command* cmd)
+{
+    while (!ring_try_push(ring, cmd))
+        sched_yield();
+}
+
+/* Takes up to max consecutive commands with a single CAS.
+   Returns how many were taken, 0 if the ring is empty */
+int ring_try_pop(commandRing* ring, command* cmds, int max)
+{
+    unsigned long pos = __atomic_load_n(&ring->dequeuePos, __ATOMIC_RELAXED);
+
+    while (1) {
+        int n = 0;
+
+        /* count the ready cells from pos on */
+        while (n < max) {
+            ringCell* cell = &ring->cells[(pos + n) & ring->mask];
+            unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            if (seq != pos + n + 1)
+                break;
+            n++;
+        }
+
+        if (n == 0) {
+            ringCell* cell = &ring->cells[pos & ring->mask];
+            long diff = (long) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long) (pos + 1);
+            if (diff < 0)
+                return 0;
+            /* another consumer got there first */
+            pos = __atomic_load_n(&ring->dequeuePos, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&ring->dequeuePos, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            int i;
+            for (i = 0; i < n; i++) {
+                ringCell* cell = &ring->cells[(pos + i) & ring->mask];
+                cmds[i] = cell->cmd;
+                __atomic_store_n(&cell->seq, pos + i + ring->mask + 1, __ATOMIC_RELEASE);
+            }
+            return n;
+        }
+    }
+}
+
+/* Waits for commands. Returns 0 once the ring is closed and empty */
+int ring_pop(commandRing* ring, command* cmds, int max)
+{
+    while (1) {
+        int n = ring_try_pop(ring, cmds, max);
+        if (n > 0)
+            return n;
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            /* a push may have landed right before the close */
+            return ring_try_pop(ring, cmds, max);
+        }
+        sched_yield();
+    }
+}
+
+/* No more pushes will follow */
+void ring_close(commandRing* ring)
+{
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
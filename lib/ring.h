@@ -0,0 +1,44 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* ring.h */
+#ifndef RING_H
+#define RING_H
+
+#include "../constants.h"
+
+#define CACHE_LINE 64
+
+/* A parsed command: names holds "name1\0name2\0", name2 is the offset
+   of the second name (0 for commands with a single name) */
+typedef struct command {
+    char opcode;
+    unsigned char name2;
+    char names[MAX_INPUT_SIZE];
+} command;
+
+typedef struct ringCell {
+    unsigned long seq;
+    command cmd;
+} ringCell;
+
+/* Bounded lock-free multi-producer/multi-consumer queue of commands.
+   Every cell has a sequence number telling whether it is ready to be
+   written (seq == position) or read (seq == position + 1) by the thread
+   that claims that position with a CAS on enqueuePos/dequeuePos. */
+typedef struct commandRing {
+    ringCell* cells;
+    unsigned long mask;
+    unsigned long enqueuePos __attribute__((aligned(CACHE_LINE)));
+    unsigned long dequeuePos __attribute__((aligned(CACHE_LINE)));
+    int closed __attribute__((aligned(CACHE_LINE)));
+} commandRing;
+
+void ring_init(commandRing* ring, unsigned long size);
+void ring_destroy(commandRing* ring);
+int ring_try_push(commandRing* ring, command* cmd);
+void ring_push(commandRing* ring, command* cmd);
+int ring_try_pop(commandRing* ring, command* cmds, int max);
+int ring_pop(commandRing* ring, command* cmds, int max);
+void ring_close(commandRing* ring);
+
+#endif /* RING_H */
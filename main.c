@@ -1,71 +1,77 @@
 /* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
-/* In order to simplify the access from the threads to the commands array,
-   the commands will be inserted to the tail and removed from the head,
-   when a command is removed, all the positions are shifted to the left,
-   when the array is empty, the head has the command 'f'.
-   The head and the tail are designed by the variables head and numberCommands.*/
+/* Two modes: replaying an input file, or serving clients on a socket.
+   In the replay mode the input file is parsed by a single producer into a
+   lock-free ring of commands (lib/ring.h), the worker threads take them
+   out in batches. The ring is closed when the input ends, which lets the
+   workers finish. */
+#define _GNU_SOURCE     /* memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <semaphore.h>
-#include <sys/un.h>
-#include <sys/types.h>
-#include <sys/socket.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "fs.h"
 #include "constants.h"
+#include "lib/ring.h"
 #include "lib/timer.h"
+#include "protocol.h"
+#include "server.h"
+#include "shard.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "sync.h"
-
-#define UNIXSTR_PATH "/tmp/socket.unix.stream"
-#define MAX_THREADS 100
-
-
-struct threadArg{
-    int uID,newSockfd;
-};
-
-struct threadArg *connections[MAX_THREADS];
-struct sockaddr_un end_serv;
-
-pthread_t tid[MAX_THREADS];
-
-int sockfd,num_connects=0;
+#include "wal.h"
 
 char* global_inputFile = NULL;
 char* global_outputFile = NULL;
+char* global_socketPath = NULL;     /* set in server mode */
+char* global_dataDir = NULL;        /* set in durable mode */
 int numberThreads = 0;
 int numBuckets = 0;
 
-pthread_mutex_t commandsLock, semMut;
-sem_t semprod, semcons;
-
 tecnicofs* fs;
+int zeroCopy = 1;     /* large reads are sent with sendfile */
+int numShards = 0;    /* owner threads when sharded (shard.h) */
+
+commandRing inputCommands;
 
-char inputCommands[MAX_COMMANDS][MAX_INPUT_SIZE];
-int numberCommands = 0; // Tail of the commands array (first empty slot)
-int head = 0;   // Head of the commands array
-int kill = 0;   // 0 if still processing input, 1 otherwise
+/* commands applied by the replay workers, per opcode */
+long appliedCommands[256];
 
 static void displayUsage(const char* appName) {
-    printf("Usage: %s input_filepath output_filepath threads_number buckets_number\n",
-            appName);
+    printf("Usage: %s input_filepath output_filepath threads_number buckets_number [data_dir]\n"
+           "       %s -s socket_path output_filepath buckets_number [data_dir]\n",
+            appName, appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs(long argc, char* const argv[]) {
-    if (argc != 5) {
+    if (argc != 5 && argc != 6) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
-    global_inputFile = argv[1];
-    global_outputFile = argv[2];
-
-    numberThreads = atoi(argv[3]);
-    if (!numberThreads) {
-        fprintf(stderr, "Invalid number of threads.\n");
-        displayUsage(argv[0]);
+    if (!strcmp(argv[1], "-s")) {
+        global_socketPath = argv[2];
+        global_outputFile = argv[3];
+    }
+    else {
+        global_inputFile = argv[1];
+        global_outputFile = argv[2];
+
+        numberThreads = atoi(argv[3]);
+        if (numberThreads <= 0) {
+            fprintf(stderr, "Invalid number of threads.\n");
+            displayUsage(argv[0]);
+        }
+#if !defined (RWLOCK) && !defined (MUTEX) && !defined (SEQLOCK)
+        if (numberThreads != 1) {
+            fprintf(stderr, "The nosync version only runs with one thread.\n");
+            displayUsage(argv[0]);
+        }
+#endif
     }
 
     numBuckets = atoi(argv[4]);
@@ -73,42 +79,15 @@ static void parseArgs(long argc, char* const argv[]) {
         fprintf(stderr,"Invalid number of buckets.\n");
         displayUsage(argv[0]);
     }
-}
-
-void insertCommand(char* data) {
-    wait_sem(&semprod);
-    mutex_lock(&semMut);
-
-    /* keep numberCommands in boundaries */
-    if (numberCommands == MAX_COMMANDS) numberCommands = 0;
-
-    strcpy(inputCommands[numberCommands++], data);
 
-    // keep numberCommands in boundarys
-    if(numberCommands==MAX_COMMANDS)numberCommands=0;
+    if (argc == 6)
+        global_dataDir = argv[5];
 
-    mutex_unlock(&semMut);
-    post_sem(&semcons);
-}
-
-char* removeCommand() {
-    wait_sem(&semcons);
-    mutex_lock(&semMut);
-
-    char *data = (char*) malloc(sizeof(char) * (strlen(inputCommands[0]) + 1));
-    strcpy(data, inputCommands[head]);
-
-    // keep head in boundarys
-    if(++head==MAX_COMMANDS)head=0;
-    // if there are no more commands to read, set the null command
-    if(numberCommands==head)
-        strcpy(inputCommands[head],"f");
-    
-
-    mutex_unlock(&semMut);
-    post_sem(&semprod);
-
-    return data;
+    /* TECNICOFS_DELAY=cycles replaces the DELAY of every tree operation,
+       0 to measure the fs alone */
+    char* delay = getenv("TECNICOFS_DELAY");
+    if (delay)
+        bstDelay = atoi(delay);
 }
 
 void errorParse(int lineNumber) {
@@ -131,12 +110,11 @@ void * processInput() {
     while(fgets(line, sizeof(line)/sizeof(char), inputFile)) {
         char token;
         char name[MAX_INPUT_SIZE];
-        char name1[MAX_INPUT_SIZE];
         char name2[MAX_INPUT_SIZE];
+        command cmd;
 
         lineNumber++;
-        int rTokens = 0;
-        int numTokens = sscanf(line, "%c %s", &token, name);
+        int numTokens = sscanf(line, "%c %s %s", &token, name, name2);
 
         /* perform minimal validation */
         if (numTokens < 1) {
@@ -147,18 +125,26 @@ void * processInput() {
             case 'c':
             case 'l':
             case 'd':
+            case 'm':
+            case 'L':
                 if (numTokens != 2)
                     errorParse(lineNumber);
 
-                insertCommand(line);
+                cmd.opcode = token;
+                cmd.name2 = 0;
+                strcpy(cmd.names, name);
+                ring_push(&inputCommands, &cmd);
 
                 break;
             case 'r':   /* special case for 'r' (3 tokens allowed) */
-                rTokens = sscanf(name,"%s %s",name1,name2);
-                if (numTokens + rTokens != 3)
+                if (numTokens != 3)
                     errorParse(lineNumber);
 
-                insertCommand(line);
+                cmd.opcode = token;
+                cmd.name2 = strlen(name) + 1;
+                strcpy(cmd.names, name);
+                strcpy(cmd.names + cmd.name2, name2);
+                ring_push(&inputCommands, &cmd);
 
                 break;
             case '#':
@@ -169,10 +155,8 @@ void * processInput() {
         }
     }
 
-    /* process input ended, signal kill flag */
-    mutex_lock(&commandsLock);
-    kill = 1;
-    mutex_unlock(&commandsLock);
+    /* process input ended, the workers stop once the ring is empty */
+    ring_close(&inputCommands);
 
     fclose(inputFile);
 
@@ -191,155 +175,668 @@ FILE * openOutputFile() {
     return fp;
 }
 
-void applyCommands(char* inputCommands) {
-    mutex_lock(&commandsLock);
-    char command[MAX_INPUT_SIZE];
-    strcpy(command,inputCommands);
-    char token = command[0];
-    char name[MAX_INPUT_SIZE],name2[MAX_INPUT_SIZE];
+/* Message for a command that failed with result */
+static void printError(char* name, int result) {
+    switch (result) {
+        case FS_NOT_FOUND:
+            printf("%s not found\n", name);
+            break;
+        case FS_EXISTS:
+            printf("%s already exists\n", name);
+            break;
+        case FS_NOT_DIR:
+            printf("%s: not a directory\n", name);
+            break;
+        case FS_NOT_EMPTY:
+            printf("%s is not empty\n", name);
+            break;
+        default:
+            printf("%s: invalid\n", name);
+    }
+}
+
+/* Gathers a listing, so it is printed in one piece or not at all */
+static void printEntry(char* name, int inumber, void* arg) {
+    tfsBuffer* line = (tfsBuffer*) arg;
+
+    (void) inumber;
+    buffer_append(line, " ", 1);
+    buffer_append(line, name, strlen(name));
+}
+
+/* Everything before the calls into fs is thread-local, so client
+   threads only meet each other on the bucket locks */
+void applyCommands(command* cmd) {
+    char* name = cmd->names;
+    char* name2 = cmd->names + cmd->name2;
+    tfsBuffer line;
     int iNumber;
-    switch (token) {
+    switch (cmd->opcode) {
         case 'c':
-            sscanf(command, "%c %s", &token, name);
-            
-            iNumber = obtainNewInumber(fs);
-            
-            mutex_unlock(&commandsLock);
+            iNumber = create(fs, name, obtainNewInumber(fs));
+            if (iNumber < 0)
+                printError(name, iNumber);
 
-            create(fs, name, iNumber);
+            break;
+        case 'm':
+            iNumber = makeDirectory(fs, name, obtainNewInumber(fs));
+            if (iNumber < 0)
+                printError(name, iNumber);
 
             break;
         case 'l':
-            sscanf(command, "%c %s", &token, name);
-
-            mutex_unlock(&commandsLock);
-
-            int searchResult = lookup(fs, name);
-            if (!searchResult)
+            iNumber = lookup(fs, name);
+            if (!iNumber)
                 printf("%s not found\n", name);
             else
-                printf("%s found with inumber %d\n", name, searchResult);
+                printf("%s found with inumber %d\n", name, iNumber);
             
             break;
-        case 'd':
-            sscanf(command, "%c %s", &token, name);
-
-            mutex_unlock(&commandsLock);
-
-            iNumber = lookup(fs,name);
-            if (!iNumber)
-                printf("%s not found\n", name);
+        case 'L':
+            buffer_init(&line);
+            iNumber = listDirectory(fs, name, printEntry, &line);
+            if (iNumber < 0)
+                printError(name, iNumber);
             else
-                delete(fs, name);
+                printf("%s:%.*s\n", name, (int) (line.end - line.start), line.data + line.start);
+            buffer_free(&line);
 
             break;
-        case 'r':
-            sscanf(command,"%c %s %s", &token, name, name2);
-            
-            mutex_unlock(&commandsLock);
-
-            // Verificate if booth file names are in use                   
-            iNumber = lookup(fs, name);
-            int exists = lookup(fs, name2);
-            if (!iNumber)
-                printf("%s not found\n", name);
-            else if (exists)
-                printf("%s already exists\n", name2);
-            //Rename it
-            else
-                renameFile(fs, name, name2, iNumber);
+        case 'd':
+            iNumber = delete(fs, name);
+            if (iNumber < 0)
+                printError(name, iNumber);
 
             break;
-        case 'f':
-            //do nothing
-            mutex_unlock(&commandsLock);
+        case 'r':
+            // checked and renamed in one go, under the locks of both names
+            iNumber = renameFile(fs, name, name2);
+            if (iNumber == FS_EXISTS)
+                printError(name2, iNumber);
+            else if (iNumber < 0)
+                printError(name, iNumber);
 
             break;
         default: { /* error */
-            mutex_unlock(&commandsLock);
-
             fprintf(stderr, "Error: commands to apply\n");
             exit(EXIT_FAILURE);
         }
     }
 }
 
+/* Worker of the file mode, applies commands until the input is over */
+void * applyCommandsWorker() {
+    command batch[COMMAND_BATCH];
+    long applied[256] = { 0 };
+    int i, n;
 
+    while ((n = ring_pop(&inputCommands, batch, COMMAND_BATCH)) > 0) {
+        for (i = 0; i < n; i++) {
+            applyCommands(&batch[i]);
+            applied[(unsigned char) batch[i].opcode]++;
+        }
+    }
 
-int mount(char* address){
-    int dim_serv;
-    if((sockfd = socket(AF_UNIX,SOCK_STREAM,0))<0)
-        perror("Erro ao criar socket servidor");
-    
-    unlink(address);
+    /* counted locally, only added up once per worker */
+    for (i = 0; i < 256; i++)
+        if (applied[i])
+            __atomic_add_fetch(&appliedCommands[i], applied[i], __ATOMIC_RELAXED);
 
-    bzero((char*)&end_serv,sizeof(end_serv));
+    return NULL;
+}
 
-    end_serv.sun_family = AF_UNIX;
-    strcpy(end_serv.sun_path,address);
-    dim_serv = sizeof(end_serv.sun_family)+ strlen(end_serv.sun_path);
+/* Appends the names of a listing, as long as the response can hold them */
+static void appendEntry(char* name, int inumber, void* arg) {
+    tfsBuffer* names = (tfsBuffer*) arg;
+    size_t length = strlen(name) + 1;
 
-    if((bind(sockfd, (struct sockaddr *)&end_serv, dim_serv))<0)
-        perror("Erro no Bind Servidor");
-    
-    listen(sockfd,5);
-
-}
-
-void* trata_cliente(void* sock){
-    struct threadArg* tsockfd = (struct threadArg*)sock;
-    int sockfd= tsockfd->newSockfd;
-    int len;
-    char buffer[100];
-    while(read(sockfd,buffer,100) > 0){
-        
-        printf("Mensagem recebida:%s\n",buffer);
-        applyCommands(buffer);
-        printf("terminou\n");
-        print_tecnicofs_tree(stdout, fs);
-        if((write(sockfd,"Boa Noite",10))<0)
-            perror("Erro no Write Server"); 
+    (void) inumber;
+    if (names->end - names->start + length <= TFS_MAX_RESPONSE - TFS_RESPONSE_HEADER)
+        buffer_append(names, name, length);
+}
+
+/* A page of the names in a directory that start with a prefix */
+static void scanRequest(tfsRequest* request, tfsBuffer* out) {
+    char pattern[MAX_INPUT_SIZE], *path = pattern, *prefix;
+    int limit = request->count && request->count < TFS_MAX_SCAN ? request->count : TFS_MAX_SCAN;
+    tfsBuffer names;
+    int result;
+
+    /* "a/b/pre" is the prefix "pre" in a/b, "pre" in the root */
+    strcpy(pattern, request->name1);
+    prefix = strrchr(pattern, '/');
+    if (prefix)
+        *prefix++ = '\0';
+    else {
+        prefix = pattern;
+        path = "";
     }
+
+    buffer_init(&names);
+    result = scanDirectory(fs, path, prefix, request->name2, limit, appendEntry, &names);
+    if (result >= 0)
+        tfs_encode_response(out, request->id, TFS_OK, result,
+                            names.data + names.start, names.end - names.start);
+    else
+        tfs_encode_response(out, request->id, result, 0, NULL, 0);
+    buffer_free(&names);
 }
 
-int main(int argc, char* argv[]) {
-    int novosockfd, dim_cli, dim_serv,i=0;
-    struct sockaddr_un end_cli;
+static void closeDump(void* arg) {
+    close((int) (long) arg);
+}
 
-    parseArgs(argc, argv);
-    
-    mutex_init(&semMut);
-    init_sem(&semprod, MAX_COMMANDS);
-    init_sem(&semcons, 0);
-    mutex_init(&commandsLock);
+/* A point in time dump of the fs, written to a memfd by this worker while
+   the others go on serving changes, then sent from it with sendfile */
+static void dumpRequest(tfsRequest* request, tfsBuffer* out, session* client) {
+    int fd = memfd_create("tecnicofs-dump", MFD_CLOEXEC);
+    FILE* fp = fd >= 0 ? fdopen(dup(fd), "w") : NULL;
+    long size;
+
+    if (!fp) {
+        perror("Erro ao criar dump");
+        if (fd >= 0)
+            close(fd);
+        tfs_encode_response(out, request->id, TFS_INVALID, 0, NULL, 0);
+        return;
+    }
+    print_tecnicofs_tree(fp, fs);
+    size = fflush(fp) == 0 ? ftell(fp) : -1;
+    fclose(fp);
+    if (size < 0 || size > UINT32_MAX - TFS_RESPONSE_HEADER) {
+        close(fd);
+        tfs_encode_response(out, request->id, TFS_INVALID, 0, NULL, 0);
+        return;
+    }
 
-    FILE * outputFp = openOutputFile();
-    fs = new_tecnicofs();
+    tfs_encode_response_header(out, request->id, TFS_OK, 0, size);
+    server_send_file(client, fd, 0, size, closeDump, (void*) (long) fd);
+}
 
+/* Latencies and counters of the server so far (stats.h) */
+static void statsRequest(tfsRequest* request, tfsBuffer* out) {
+    char* json = NULL;
+    size_t size = 0;
+    FILE* fp = open_memstream(&json, &size);
 
-    mount(UNIXSTR_PATH);
+    if (!fp) {
+        perror("Erro ao criar stats");
+        tfs_encode_response(out, request->id, TFS_INVALID, 0, NULL, 0);
+        return;
+    }
+    stats_json(fp, fs);
+    fclose(fp);
+    tfs_encode_response(out, request->id, TFS_OK, 0, json, size);
+    free(json);
+}
 
-    while(1){
-        dim_cli = sizeof(end_cli);
-        connections[num_connects]= (struct threadArg*)malloc(sizeof(int)*2);
-        connections[num_connects]->newSockfd=accept(sockfd,(struct sockaddr *)&end_cli,&dim_cli);
-        connections[num_connects]->uID=0;
-        if (novosockfd<0)
-            perror("Erro ao aceitar socket cliente");
-        pthread_create(&tid[i++],NULL,trata_cliente,(void*)connections[num_connects++]);
+/* Bulk creates, deletes and lookups, applied with one lock of each
+   bucket they touch (see applyBatch) */
+static void batchRequest(tfsRequest* request, tfsBuffer* out, session* client) {
+    uint32_t count = request->count, i;
+    const char* entry = request->data;
+    const char* end = request->data + request->dataSize;
+    batchOp* ops;
+    int32_t* results;
+
+    /* an op takes two bytes at least */
+    if (!count || count > request->dataSize / 2) {
+        tfs_encode_response(out, request->id, TFS_INVALID, 0, NULL, 0);
+        return;
+    }
+    ops = malloc(count * sizeof(batchOp));
+    results = malloc(count * sizeof(int32_t));
+    if (!ops || !results) {
+        perror("failed to allocate a batch");
+        exit(EXIT_FAILURE);
     }
 
-    
-    close(novosockfd);
+    for (i = 0; i < count; i++) {
+        const char* name = entry + 1;
+        const char* nul = name < end ? memchr(name, '\0', end - name) : NULL;
+
+        if (!nul) {
+            tfs_encode_response(out, request->id, TFS_INVALID, 0, NULL, 0);
+            free(results);
+            free(ops);
+            return;
+        }
+        ops[i].opcode = *entry;
+        ops[i].path = (char*) name;
+        ops[i].inumber = *entry == TFS_CREATE ? obtainNewInumber(fs) : 0;
+        entry = nul + 1;
+    }
+
+    applyBatch(fs, ops, count, client->uid, request->arg ? request->arg : DEFAULT_PERMISSIONS);
+    for (i = 0; i < count; i++)
+        results[i] = ops[i].opcode == TFS_LOOKUP && !ops[i].result ? TFS_NOT_FOUND : ops[i].result;
+    tfs_encode_response(out, request->id, TFS_OK, count, results, count * sizeof(int32_t));
+    free(results);
+    free(ops);
+}
+
+/* The open file at fd of the client, or NULL */
+static fileDescriptor* clientFile(session* client, int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !client->files[fd].mode)
+        return NULL;
+    return &client->files[fd];
+}
+
+/* Opens name1 at the first free fd of the client */
+static int openRequest(tfsRequest* request, session* client) {
+    int fd, inumber;
+
+    if (request->arg < TFS_PERM_WRITE || request->arg > TFS_PERM_RW)
+        return TFS_INVALID;
+    for (fd = 0; fd < MAX_OPEN_FILES && client->files[fd].mode; fd++)
+        ;
+    if (fd == MAX_OPEN_FILES)
+        return TFS_TOO_MANY;
+
+    inumber = openFile(fs, request->name1, client->uid, request->arg);
+    if (inumber < 0)
+        return inumber;
+    client->files[fd].inumber = inumber;
+    client->files[fd].mode = request->arg;
+    client->files[fd].offset = 0;
+    return fd;
+}
+
+/* Blocks a zero-copy read holds until the client has read them */
+typedef struct pinnedBlocks {
+    int count;
+    char* blocks[];
+} pinnedBlocks;
+
+/* Ranges of a zero-copy read, adjacent ones merged */
+typedef struct readRanges {
+    dataRange* ranges;
+    int count;
+    pinnedBlocks* pinned;
+} readRanges;
+
+static void addRange(dataRange* range, void* arg) {
+    readRanges* read = (readRanges*) arg;
+    dataRange* last = read->count ? &read->ranges[read->count - 1] : NULL;
+
+    if (range->block)
+        read->pinned->blocks[read->pinned->count++] = range->block;
+    if (last && last->fd == range->fd &&
+        (range->fd < 0 || last->offset + (off_t) last->size == range->offset))
+        last->size += range->size;
+    else
+        read->ranges[read->count++] = *range;
+}
+
+static void unpinBlocks(void* arg) {
+    pinnedBlocks* pinned = (pinnedBlocks*) arg;
+    int i;
+
+    for (i = 0; i < pinned->count; i++)
+        block_unref(&fs->inodes.blocks, pinned->blocks[i]);
+    free(pinned);
+}
+
+/* The data of the response is sent from the block pool and the image
+   with sendfile, only holes are copied into out (as zeros) */
+static int sendFileRanges(tfsRequest* request, tfsBuffer* out, session* client,
+                          fileDescriptor* file, size_t count) {
+    int most = count / BLOCK_SIZE + 2;     /* blocks and ranges of a read */
+    readRanges read;
+    int result, i, last;
+
+    read.count = 0;
+    read.ranges = malloc(most * sizeof(dataRange));
+    read.pinned = malloc(sizeof(pinnedBlocks) + most * sizeof(char*));
+    if (!read.ranges || !read.pinned) {
+        perror("failed to allocate a read");
+        exit(EXIT_FAILURE);
+    }
+    read.pinned->count = 0;
+
+    result = readFileRanges(fs, file->inumber, file->offset, count, addRange, &read);
+    if (result >= 0) {
+        file->offset += result;
+        tfs_encode_response_header(out, request->id, TFS_OK, result, result);
+
+        /* the last range sent from a file releases the blocks of all */
+        for (last = read.count - 1; last >= 0 && read.ranges[last].fd < 0; last--)
+            ;
+        for (i = 0; i < read.count; i++) {
+            dataRange* range = &read.ranges[i];
+
+            if (range->fd < 0) {
+                memset(buffer_reserve(out, range->size), 0, range->size);
+                out->end += range->size;
+            }
+            else
+                server_send_file(client, range->fd, range->offset, range->size,
+                                 i == last ? unpinBlocks : NULL, read.pinned);
+        }
+        if (last < 0)
+            unpinBlocks(read.pinned);
+    }
+    else
+        free(read.pinned);
+    free(read.ranges);
+    return result;
+}
+
+/* The file is read straight into the response, or sent from where it is
+   kept without copying it when the read is large */
+static void readRequest(tfsRequest* request, tfsBuffer* out, session* client) {
+    fileDescriptor* file = clientFile(client, request->arg);
+    size_t count = request->count < TFS_MAX_READ ? request->count : TFS_MAX_READ;
+    int result;
+
+    if (!file)
+        result = TFS_NOT_OPEN;
+    else if (!(file->mode & TFS_PERM_READ))
+        result = TFS_DENIED;
+    else if (zeroCopy && count >= ZERO_COPY_MIN) {
+        result = sendFileRanges(request, out, client, file, count);
+        if (result >= 0)
+            return;
+    }
+    else {
+        char* dest = tfs_reserve_response(out, count);
+
+        result = readFile(fs, file->inumber, file->offset, dest, count);
+        if (result >= 0) {
+            file->offset += result;
+            tfs_commit_response(out, request->id, TFS_OK, result, result);
+            return;
+        }
+    }
+    tfs_encode_response(out, request->id, result, 0, NULL, 0);
+}
+
+static int writeRequest(tfsRequest* request, session* client) {
+    fileDescriptor* file = clientFile(client, request->arg);
+    int result;
+
+    if (!file)
+        return TFS_NOT_OPEN;
+    if (!(file->mode & TFS_PERM_WRITE))
+        return TFS_DENIED;
+    result = writeFile(fs, file->inumber, file->offset, request->data, request->dataSize);
+    if (result >= 0)
+        file->offset += result;
+    return result;
+}
+
+static void statRequest(tfsRequest* request, tfsBuffer* out) {
+    inodeStat st;
+    tfsStat payload;
+    int result = statFile(fs, request->name1, &st);
+
+    if (result < 0) {
+        tfs_encode_response(out, request->id, result, 0, NULL, 0);
+        return;
+    }
+    payload.type = st.type;
+    payload.owner = st.owner;
+    payload.ownerPermissions = st.ownerPermissions;
+    payload.othersPermissions = st.othersPermissions;
+    payload.size = st.size;
+    payload.atime = st.atime;
+    payload.mtime = st.mtime;
+    payload.ctime = st.ctime;
+    tfs_encode_response(out, request->id, TFS_OK, result, &payload, sizeof(payload));
+}
+
+/* Server side of applyCommands: the result goes back to the client */
+static void executeRequest(tfsRequest* request, tfsBuffer* out, session* client) {
+    tfsBuffer names;
+    fileDescriptor* file;
+    int result;
+
+    /* the fs results (FS_*) are the protocol statuses (TFS_*) */
+    switch (request->opcode) {
+        case TFS_CREATE:
+            result = createFile(fs, request->name1, obtainNewInumber(fs), client->uid,
+                                request->arg ? request->arg : DEFAULT_PERMISSIONS);
+            break;
+        case TFS_MKDIR:
+            result = makeDirectory(fs, request->name1, obtainNewInumber(fs));
+            break;
+        case TFS_LOOKUP:
+            result = lookup(fs, request->name1);
+            if (!result)
+                result = TFS_NOT_FOUND;
+            break;
+        case TFS_LIST:
+            /* names are sent '\0' terminated, the count is in inumber */
+            buffer_init(&names);
+            result = listDirectory(fs, request->name1, appendEntry, &names);
+            if (result >= 0)
+                tfs_encode_response(out, request->id, TFS_OK, result,
+                                    names.data + names.start, names.end - names.start);
+            else
+                tfs_encode_response(out, request->id, result, 0, NULL, 0);
+            buffer_free(&names);
+            return;
+        case TFS_SCAN:
+            scanRequest(request, out);
+            return;
+        case TFS_DELETE:
+            result = delete(fs, request->name1);
+            break;
+        case TFS_RENAME:
+            result = renameFile(fs, request->name1, request->name2);
+            break;
+        case TFS_OPEN:
+            result = openRequest(request, client);
+            break;
+        case TFS_CLOSE:
+            file = clientFile(client, request->arg);
+            result = file ? TFS_OK : TFS_NOT_OPEN;
+            if (file)
+                file->mode = 0;
+            break;
+        case TFS_READ:
+            readRequest(request, out, client);
+            return;
+        case TFS_WRITE:
+            result = writeRequest(request, client);
+            break;
+        case TFS_STAT:
+            statRequest(request, out);
+            return;
+        case TFS_DUMP:
+            dumpRequest(request, out, client);
+            return;
+        case TFS_STATS:
+            statsRequest(request, out);
+            return;
+        case TFS_BATCH:
+            batchRequest(request, out, client);
+            return;
+        default:
+            result = TFS_INVALID;
+    }
+
+    if (result < 0)
+        tfs_encode_response(out, request->id, result, 0, NULL, 0);
+    else
+        tfs_encode_response(out, request->id, TFS_OK, result, NULL, 0);
+}
+
+/* Times every request, by opcode */
+void applyRequest(tfsRequest* request, tfsBuffer* out, session* client) {
+    uint64_t start = stats_now();
+
+    executeRequest(request, out, client);
+    stats_op(request->opcode, stats_now() - start);
+}
+
+#if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+/* Requests on one entry go to the owner of its shard (shard.h), those
+   on the state of the connection or on the whole fs stay on the worker */
+static int routeRequest(tfsRequest* request) {
+    switch (request->opcode) {
+        case TFS_CREATE:
+        case TFS_MKDIR:
+        case TFS_LOOKUP:
+        case TFS_DELETE:
+        case TFS_RENAME:
+        case TFS_STAT:
+            return entryShard(fs, request->name1, numShards);
+        default:
+            return -1;
+    }
+}
+#endif
+
+static void stopServer(int sig) {
+    (void) sig;
+    server_stop();
+}
+
+static void runReplay(FILE* outputFp) {
+    pthread_t producer, *workers;
+    TIMER_T startTime, stopTime;
+    int i;
+
+    workers = malloc(numberThreads * sizeof(pthread_t));
+    if (!workers) {
+        perror("failed to allocate workers");
+        exit(EXIT_FAILURE);
+    }
+
+    TIMER_READ(startTime);
+
+    if (pthread_create(&producer, NULL, processInput, NULL) != 0) {
+        perror("failed to create producer");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < numberThreads; i++) {
+        if (pthread_create(&workers[i], NULL, applyCommandsWorker, NULL) != 0) {
+            perror("failed to create worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_join(producer, NULL);
+    for (i = 0; i < numberThreads; i++)
+        pthread_join(workers[i], NULL);
+
+    TIMER_READ(stopTime);
+
+    double seconds = TIMER_DIFF_SECONDS(startTime, stopTime);
+    long total = 0;
+    printf("TecnicoFS completed in %.4f seconds.\n", seconds);
+    for (i = 0; i < 256; i++) {
+        if (appliedCommands[i]) {
+            printf("  %c: %ld commands, %.0f commands/s\n", i, appliedCommands[i],
+                   appliedCommands[i] / seconds);
+            total += appliedCommands[i];
+        }
+    }
+    printf("  total: %ld commands, %.0f commands/s\n", total, total / seconds);
 
     print_tecnicofs_tree(outputFp, fs);
+    free(workers);
+}
+
+/* Durable mode: the fs is the snapshot in the data directory, mapped by
+   new_tecnicofs, plus the log written after it, and every change from
+   here on is logged. TECNICOFS_WAL_SYNC=each syncs the log on every
+   change instead of once per group of concurrent changes. */
+static void openDurable() {
+    uint64_t lsn = wal_replay(global_dataDir, fs->imageLsn, replay_record, fs);
+
+    char* sync = getenv("TECNICOFS_WAL_SYNC");
+    fs->log = wal_open(global_dataDir, lsn, sync && !strcmp(sync, "each"));
+
+#if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+    snapshot_start(fs, global_dataDir);
+#endif
+}
+
+/* A final snapshot leaves an empty log to replay on the next start */
+static void closeDurable() {
+    snapshot_stop();
+    snapshot_write(fs, global_dataDir);
+    wal_close(fs->log);
+    fs->log = NULL;
+}
+
+static void runServer() {
+    signal(SIGPIPE, SIG_IGN);
+
+    /* TECNICOFS_ZERO_COPY=off copies every read through the response
+       buffer, to compare both (see bench/read_bench.sh) */
+    char* zero = getenv("TECNICOFS_ZERO_COPY");
+    zeroCopy = !zero || strcmp(zero, "off");
+
+    /* TECNICOFS_SERVER=threads selects the old thread per client model,
+       which only ends when the process is killed */
+    char* model = getenv("TECNICOFS_SERVER");
+    if (model && !strcmp(model, "threads"))
+        server_run_threads(global_socketPath, applyRequest);
+
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int) cores : 1;
+
+#if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+    /* TECNICOFS_SERVER=shards hands the requests on entries to an owner
+       thread per shard, TECNICOFS_SHARDS of them (one per core by
+       default), as many as divide the buckets evenly */
+    if (model && !strcmp(model, "shards")) {
+        char* shards = getenv("TECNICOFS_SHARDS");
+
+        numShards = fitShards(fs, shards && atoi(shards) > 0 ? atoi(shards) : workers);
+        shard_start(numShards, workers, applyRequest, routeRequest);
+        server_run(global_socketPath, workers, shard_apply, shard_flush);
+        shard_stop();
+        return;
+    }
+#endif
+    server_run(global_socketPath, workers, applyRequest, NULL);
+}
+
+int main(int argc, char* argv[]) {
+    parseArgs(argc, argv);
+    stats_init();
+#ifdef PROFILE
+    /* lock profile on SIGUSR1 and at the end (tecnicofs-profile) */
+    sync_profile_start();
+#endif
+    
+    ring_init(&inputCommands, MAX_COMMANDS);
+
+    FILE * outputFp = openOutputFile();
+    if (global_dataDir) {
+        char* image = snapshot_path(global_dataDir);
+        fs = new_tecnicofs(image);
+        free(image);
+        openDurable();
+    }
+    else
+        fs = new_tecnicofs(NULL);
+
+    if (global_socketPath) {
+        runServer();
+        print_tecnicofs_tree(outputFp, fs);
+    }
+    else
+        runReplay(outputFp);
+
+    if (global_dataDir)
+        closeDurable();
+
     fflush(outputFp);
     fclose(outputFp);
 
-    mutex_destroy(&commandsLock);
-    destroy_sem(&semcons);
-    destroy_sem(&semprod);
-    mutex_destroy(&semMut);
+    ring_destroy(&inputCommands);
+
+#ifdef PROFILE
+    sync_profile_report(stderr);
+#endif
 
     free_tecnicofs(fs);
 
@@ -0,0 +1,254 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+
+void buffer_init(tfsBuffer* buffer) {
+    memset(buffer, 0, sizeof(tfsBuffer));
+}
+
+void buffer_free(tfsBuffer* buffer) {
+    free(buffer->data);
+    buffer_init(buffer);
+}
+
+/* Makes room for size more bytes at the end and returns where they go,
+   the caller then adds them to buffer->end */
+char* buffer_reserve(tfsBuffer* buffer, size_t size) {
+    if (buffer->start == buffer->end)
+        buffer->start = buffer->end = 0;
+
+    if (buffer->end + size > buffer->capacity && buffer->start > 0) {
+        /* slide the unconsumed bytes back to the beginning */
+        memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+        buffer->end -= buffer->start;
+        buffer->start = 0;
+    }
+
+    if (buffer->end + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->end + size)
+            capacity *= 2;
+        char* data = realloc(buffer->data, capacity);
+        if (!data) {
+            perror("failed to grow buffer");
+            exit(EXIT_FAILURE);
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    return buffer->data + buffer->end;
+}
+
+void buffer_append(tfsBuffer* buffer, const void* data, size_t size) {
+    memcpy(buffer_reserve(buffer, size), data, size);
+    buffer->end += size;
+}
+
+void buffer_consume(tfsBuffer* buffer, size_t size) {
+    buffer->start += size;
+    if (buffer->start == buffer->end)
+        buffer->start = buffer->end = 0;
+}
+
+static uint32_t get_u32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint16_t get_u16(const char* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void put_u32(char* p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_u16(char* p, uint16_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static int copy_name(char* dest, const char* src, uint16_t size) {
+    if (size >= MAX_INPUT_SIZE || memchr(src, '\0', size))
+        return -1;
+    memcpy(dest, src, size);
+    dest[size] = '\0';
+    return 0;
+}
+
+/* Takes the first request out of in.
+   Returns 1 if a request was parsed, 0 if the frame is not complete yet,
+   and -1 if the stream is not a valid request stream (the connection
+   must be dropped, there is no way to find the next frame). A frame that
+   is well delimited but has bad names is returned with opcode 0. */
+int tfs_parse_request(tfsBuffer* in, tfsRequest* request) {
+    size_t available = in->end - in->start;
+    const char* frame = in->data + in->start;
+
+    if (available < TFS_REQUEST_HEADER)
+        return 0;
+
+    uint32_t length = get_u32(frame);
+    uint16_t len1 = get_u16(frame + 10);
+    uint16_t len2 = get_u16(frame + 12);
+    if (length < TFS_REQUEST_HEADER || length > TFS_MAX_REQUEST ||
+        length < (uint32_t) TFS_REQUEST_HEADER + len1 + len2)
+        return -1;
+    if (available < length)
+        return 0;
+
+    request->id = get_u32(frame + 4);
+    request->opcode = frame[8];
+    request->arg = (int) get_u32(frame + 16);
+    request->count = get_u32(frame + 20);
+    /* the data is not copied, it stays valid until in is filled again */
+    request->data = frame + TFS_REQUEST_HEADER + len1 + len2;
+    request->dataSize = length - (TFS_REQUEST_HEADER + len1 + len2);
+    if (request->dataSize > TFS_MAX_DATA || copy_name(request->name1, frame + TFS_REQUEST_HEADER, len1) < 0 ||
+        copy_name(request->name2, frame + TFS_REQUEST_HEADER + len1, len2) < 0)
+        request->opcode = 0;
+
+    buffer_consume(in, length);
+    return 1;
+}
+
+/* Same as tfs_parse_request, for the client side. The payload is only
+   valid until the buffer is changed again. */
+int tfs_parse_response(tfsBuffer* in, tfsResponse* response) {
+    size_t available = in->end - in->start;
+    char* frame = in->data + in->start;
+
+    if (available < TFS_RESPONSE_HEADER)
+        return 0;
+
+    uint32_t length = get_u32(frame);
+    if (length < TFS_RESPONSE_HEADER || length > TFS_MAX_RESPONSE)
+        return -1;
+    if (available < length)
+        return 0;
+
+    response->id = get_u32(frame + 4);
+    response->status = (int) get_u32(frame + 8);
+    response->inumber = (int) get_u32(frame + 12);
+    response->payload = frame + TFS_RESPONSE_HEADER;
+    response->payloadSize = length - TFS_RESPONSE_HEADER;
+
+    buffer_consume(in, length);
+    return 1;
+}
+
+/* Only the header of the next response, which is consumed: the caller
+   takes the payloadSize bytes that follow it from the stream itself
+   (payload is NULL), so they are not bounded by TFS_MAX_RESPONSE.
+   Returns like tfs_parse_response. */
+int tfs_parse_response_header(tfsBuffer* in, tfsResponse* response) {
+    char* frame = in->data + in->start;
+
+    if (in->end - in->start < TFS_RESPONSE_HEADER)
+        return 0;
+
+    uint32_t length = get_u32(frame);
+    if (length < TFS_RESPONSE_HEADER)
+        return -1;
+
+    response->id = get_u32(frame + 4);
+    response->status = (int) get_u32(frame + 8);
+    response->inumber = (int) get_u32(frame + 12);
+    response->payload = NULL;
+    response->payloadSize = length - TFS_RESPONSE_HEADER;
+
+    buffer_consume(in, TFS_RESPONSE_HEADER);
+    return 1;
+}
+
+static void encode_request(tfsBuffer* out, uint32_t id, char opcode, const char* name1,
+                           const char* name2, int arg, uint32_t count,
+                           const void* data, size_t dataSize) {
+    size_t len1 = name1 ? strlen(name1) : 0;
+    size_t len2 = name2 ? strlen(name2) : 0;
+    uint32_t length = TFS_REQUEST_HEADER + len1 + len2 + dataSize;
+    char* frame = buffer_reserve(out, length);
+
+    put_u32(frame, length);
+    put_u32(frame + 4, id);
+    frame[8] = opcode;
+    frame[9] = 0;
+    put_u16(frame + 10, (uint16_t) len1);
+    put_u16(frame + 12, (uint16_t) len2);
+    put_u16(frame + 14, 0);
+    put_u32(frame + 16, (uint32_t) arg);
+    put_u32(frame + 20, count);
+    if (len1)
+        memcpy(frame + TFS_REQUEST_HEADER, name1, len1);
+    if (len2)
+        memcpy(frame + TFS_REQUEST_HEADER + len1, name2, len2);
+    if (dataSize)
+        memcpy(frame + TFS_REQUEST_HEADER + len1 + len2, data, dataSize);
+    out->end += length;
+}
+
+void tfs_encode_request(tfsBuffer* out, uint32_t id, char opcode,
+                        const char* name1, const char* name2) {
+    encode_request(out, id, opcode, name1, name2, 0, 0, NULL, 0);
+}
+
+/* Requests of the file calls, with an arg, a count or data */
+void tfs_encode_file_request(tfsBuffer* out, uint32_t id, char opcode, const char* name,
+                             int arg, uint32_t count, const void* data, size_t dataSize) {
+    encode_request(out, id, opcode, name, NULL, arg, count, data, dataSize);
+}
+
+void tfs_encode_scan_request(tfsBuffer* out, uint32_t id, const char* pattern,
+                             const char* after, uint32_t count) {
+    encode_request(out, id, TFS_SCAN, pattern, after, 0, count, NULL, 0);
+}
+
+void tfs_encode_response(tfsBuffer* out, uint32_t id, int status, int inumber,
+                         const void* payload, size_t payloadSize) {
+    uint32_t length = TFS_RESPONSE_HEADER + payloadSize;
+    char* frame = buffer_reserve(out, length);
+
+    put_u32(frame, length);
+    put_u32(frame + 4, id);
+    put_u32(frame + 8, (uint32_t) status);
+    put_u32(frame + 12, (uint32_t) inumber);
+    if (payloadSize)
+        memcpy(frame + TFS_RESPONSE_HEADER, payload, payloadSize);
+    out->end += length;
+}
+
+/* Header of a response whose payloadSize bytes the caller queues next,
+   part of them sent from files (see server_send_file) */
+void tfs_encode_response_header(tfsBuffer* out, uint32_t id, int status, int inumber,
+                                size_t payloadSize) {
+    char* frame = buffer_reserve(out, TFS_RESPONSE_HEADER);
+
+    put_u32(frame, TFS_RESPONSE_HEADER + payloadSize);
+    put_u32(frame + 4, id);
+    put_u32(frame + 8, (uint32_t) status);
+    put_u32(frame + 12, (uint32_t) inumber);
+    out->end += TFS_RESPONSE_HEADER;
+}
+
+/* Room for a response with up to payloadSize bytes of payload, which the
+   caller fills in place (a read copies the file straight into it) and
+   then sends with tfs_commit_response */
+char* tfs_reserve_response(tfsBuffer* out, size_t payloadSize) {
+    return buffer_reserve(out, TFS_RESPONSE_HEADER + payloadSize) + TFS_RESPONSE_HEADER;
+}
+
+void tfs_commit_response(tfsBuffer* out, uint32_t id, int status, int inumber,
+                         size_t payloadSize) {
+    char* frame = out->data + out->end;
+
+    put_u32(frame, TFS_RESPONSE_HEADER + payloadSize);
+    put_u32(frame + 4, id);
+    put_u32(frame + 8, (uint32_t) status);
+    put_u32(frame + 12, (uint32_t) inumber);
+    out->end += TFS_RESPONSE_HEADER + payloadSize;
+}
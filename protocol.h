@@ -0,0 +1,133 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+/* Client/server wire protocol. Every message is a frame that starts with
+   its total length, so any number of requests can be written at once and
+   split or coalesced freely by the stream socket. Responses carry the id
+   of the request they answer. Integers travel in host byte order, both
+   ends are on the same machine.
+
+   request:  u32 length | u32 id | u8 opcode | u8 0 | u16 len1 | u16 len2
+             | u16 0 | i32 arg | u32 count | name1 (len1 bytes)
+             | name2 (len2 bytes) | data (the rest of the frame)
+   response: u32 length | u32 id | i32 status | i32 inumber | payload
+
+   Names are paths, "a/b/c", with or without a leading '/'. arg is the
+   permissions of a create, the mode of an open or the fd of the other
+   file calls, count the bytes a read asks for, data what a write writes.
+   An fd is an index in the open files of the connection.
+   A scan lists the names starting with a prefix: name1 is
+   "directory/prefix", name2 the name the page starts after (none for the
+   first) and count the most names it may have.
+   A batch is count creates, deletes and lookups in one request, each
+   its opcode followed by its '\0' terminated name, in data; arg is the
+   permissions of the creates. Its payload is an i32 per op, its inumber
+   or status. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "constants.h"
+
+#define TFS_REQUEST_HEADER   24
+#define TFS_RESPONSE_HEADER  16
+#define TFS_MAX_DATA         (1 << 16)  /* bytes written per request */
+#define TFS_MAX_READ         (1 << 24)  /* bytes read per request */
+#define TFS_MAX_REQUEST      (TFS_REQUEST_HEADER + 2 * MAX_INPUT_SIZE + TFS_MAX_DATA)
+#define TFS_MAX_RESPONSE     (TFS_RESPONSE_HEADER + TFS_MAX_READ)
+#define TFS_MAX_SCAN         4096       /* names per page of a scan */
+
+/* opcodes */
+#define TFS_CREATE  'c'
+#define TFS_LOOKUP  'l'
+#define TFS_DELETE  'd'
+#define TFS_RENAME  'r'
+#define TFS_MKDIR   'm'
+#define TFS_LIST    'L'   /* inumber is the entry count, payload the names */
+#define TFS_SCAN    'p'   /* a page of names, like TFS_LIST */
+#define TFS_OPEN    'o'   /* inumber is the fd */
+#define TFS_CLOSE   'x'
+#define TFS_READ    'R'   /* inumber is the bytes read, payload the bytes */
+#define TFS_WRITE   'W'   /* inumber is the bytes written */
+#define TFS_STAT    's'   /* payload is a tfsStat */
+#define TFS_DUMP    'D'   /* payload is the whole fs as the output file prints it */
+#define TFS_STATS   'S'   /* payload is the counters of the server, as JSON */
+#define TFS_BATCH   'B'   /* inumber is the op count, payload their results */
+
+/* permissions, and modes of an open */
+#define TFS_PERM_NONE   0
+#define TFS_PERM_WRITE  1
+#define TFS_PERM_READ   2
+#define TFS_PERM_RW     3
+#define TFS_PERMISSIONS(owner, others)  ((owner) << 2 | (others))  /* 0 is the default */
+
+/* status of a response */
+#define TFS_OK          0
+#define TFS_NOT_FOUND  -1
+#define TFS_EXISTS     -2
+#define TFS_INVALID    -3   /* malformed request or unknown opcode */
+#define TFS_NOT_DIR    -4
+#define TFS_NOT_EMPTY  -5
+#define TFS_DENIED     -6
+#define TFS_NOT_OPEN   -7   /* bad fd */
+#define TFS_TOO_MANY   -8   /* every fd of the connection is open */
+
+typedef struct tfsRequest {
+    uint32_t id;
+    char opcode;
+    int arg;
+    uint32_t count;
+    char name1[MAX_INPUT_SIZE];     /* NUL terminated copies */
+    char name2[MAX_INPUT_SIZE];
+    const char* data;               /* points into the buffer that was parsed */
+    size_t dataSize;
+} tfsRequest;
+
+typedef struct tfsStat {
+    int32_t type;                   /* 1 file, 2 directory */
+    uint32_t owner;
+    int32_t ownerPermissions;
+    int32_t othersPermissions;
+    uint64_t size;
+    int64_t atime, mtime, ctime;    /* ns since the epoch */
+} tfsStat;
+
+typedef struct tfsResponse {
+    uint32_t id;
+    int status;
+    int inumber;
+    char* payload;      /* points into the buffer that was parsed */
+    size_t payloadSize;
+} tfsResponse;
+
+/* Growable byte buffer, used for the input and output of a connection */
+typedef struct tfsBuffer {
+    char* data;
+    size_t start, end, capacity;    /* unconsumed bytes are [start, end) */
+} tfsBuffer;
+
+void buffer_init(tfsBuffer* buffer);
+void buffer_free(tfsBuffer* buffer);
+char* buffer_reserve(tfsBuffer* buffer, size_t size);
+void buffer_append(tfsBuffer* buffer, const void* data, size_t size);
+void buffer_consume(tfsBuffer* buffer, size_t size);
+
+int tfs_parse_request(tfsBuffer* in, tfsRequest* request);
+int tfs_parse_response(tfsBuffer* in, tfsResponse* response);
+int tfs_parse_response_header(tfsBuffer* in, tfsResponse* response);
+void tfs_encode_request(tfsBuffer* out, uint32_t id, char opcode,
+                        const char* name1, const char* name2);
+void tfs_encode_file_request(tfsBuffer* out, uint32_t id, char opcode, const char* name,
+                             int arg, uint32_t count, const void* data, size_t dataSize);
+void tfs_encode_scan_request(tfsBuffer* out, uint32_t id, const char* pattern,
+                             const char* after, uint32_t count);
+void tfs_encode_response(tfsBuffer* out, uint32_t id, int status, int inumber,
+                         const void* payload, size_t payloadSize);
+void tfs_encode_response_header(tfsBuffer* out, uint32_t id, int status, int inumber,
+                                size_t payloadSize);
+char* tfs_reserve_response(tfsBuffer* out, size_t payloadSize);
+void tfs_commit_response(tfsBuffer* out, uint32_t id, int status, int inumber,
+                         size_t payloadSize);
+
+#endif /* PROTOCOL_H */
@@ -0,0 +1,417 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+/* Unix socket server. server_run() serves every client from a fixed pool
+   of workers sharing one epoll instance: sockets are non-blocking and
+   registered with EPOLLONESHOT, so a connection is handled by one worker
+   at a time and rearmed when that worker is done with it.
+   server_run_threads() is the previous thread-per-connection model, kept
+   to compare both (see bench/server_bench.sh).
+
+   A response can also carry ranges of files (server_send_file), written
+   with sendfile after the bytes queued before them so that large reads
+   never copy file data to user space. The kernel keeps referencing the
+   pages it sent until the client reads them, so a range is only released
+   once nothing sent is left unread (SIOCOUTQ), or the connection closes. */
+#define _GNU_SOURCE     /* accept4, pipe2, struct ucred */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <linux/sockios.h>
+#include "server.h"
+#include "protocol.h"
+#include "constants.h"
+#include "stats.h"
+
+/* A range of a file queued after the first position bytes of out */
+typedef struct outFile {
+    struct outFile* next;
+    uint64_t position;
+    int fd;
+    off_t offset;
+    size_t size;
+    void (*release)(void* arg);
+    void* arg;
+} outFile;
+
+typedef struct connection {
+    int fd;
+    tfsBuffer in;       /* bytes of requests not yet complete */
+    tfsBuffer out;      /* responses not yet written */
+    uint64_t outSent;   /* bytes of out written so far */
+    outFile* files;     /* not yet written, in order */
+    outFile** lastFile;
+    size_t fileBytes;   /* left to write of files */
+    outFile* sentFiles; /* written, maybe not yet read by the client */
+    session client;
+} connection;
+
+static int epfd = -1;
+static int stopPipe[2] = { -1, -1 };
+static connection listener, stopper;    /* only used to tag epoll events */
+static requestHandler apply;
+static requestsFinisher finish;
+
+static int mount(char* address, int flags) {
+    struct sockaddr_un end_serv;
+    int sockfd, dim_serv;
+
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM | flags, 0)) < 0) {
+        perror("Erro ao criar socket servidor");
+        exit(EXIT_FAILURE);
+    }
+
+    unlink(address);
+
+    memset(&end_serv, 0, sizeof(end_serv));
+    end_serv.sun_family = AF_UNIX;
+    strncpy(end_serv.sun_path, address, sizeof(end_serv.sun_path) - 1);
+    dim_serv = sizeof(end_serv.sun_family) + strlen(end_serv.sun_path);
+
+    if (bind(sockfd, (struct sockaddr *) &end_serv, dim_serv) < 0) {
+        perror("Erro no Bind Servidor");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(sockfd, SOMAXCONN) < 0) {
+        perror("Erro no Listen Servidor");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+static void watch(int op, int fd, connection* conn, unsigned int events) {
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* The session of a client starts with no open files */
+static void open_session(connection* conn) {
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+
+    memset(&conn->client, 0, sizeof(session));
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) < 0) {
+        perror("Erro no getsockopt");
+        conn->client.uid = (uid_t) -1;     /* nobody: only the others permissions */
+    }
+    else
+        conn->client.uid = cred.uid;
+}
+
+static void init_connection(connection* conn, int fd) {
+    memset(conn, 0, sizeof(connection));
+    conn->fd = fd;
+    conn->lastFile = &conn->files;
+    open_session(conn);
+    stats_connection(1);
+}
+
+static void release_files(outFile* file) {
+    while (file) {
+        outFile* next = file->next;
+        if (file->release)
+            file->release(file->arg);
+        free(file);
+        file = next;
+    }
+}
+
+/* Everything sent has been read once the socket has nothing queued */
+static void release_sent(connection* conn) {
+    int queued;
+
+    if (conn->sentFiles && ioctl(conn->fd, SIOCOUTQ, &queued) == 0 && !queued) {
+        release_files(conn->sentFiles);
+        conn->sentFiles = NULL;
+    }
+}
+
+static void free_connection(connection* conn) {
+    close(conn->fd);
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    release_files(conn->files);
+    release_files(conn->sentFiles);
+    stats_connection(0);
+}
+
+static void close_connection(connection* conn) {
+    /* closing the fd also removes it from the epoll set */
+    free_connection(conn);
+    free(conn);
+}
+
+/* Queues size bytes of fd at offset after what the current request has
+   appended to out so far. release(arg) is called once the client has
+   read them, or the connection is gone. For requests being served only */
+void server_send_file(session* client, int fd, off_t offset, size_t size,
+                      void (*release)(void* arg), void* arg) {
+    connection* conn = (connection*) ((char*) client - offsetof(connection, client));
+    outFile* file = malloc(sizeof(outFile));
+
+    if (!file) {
+        perror("failed to allocate connection");
+        exit(EXIT_FAILURE);
+    }
+    file->next = NULL;
+    file->position = conn->outSent + (conn->out.end - conn->out.start);
+    file->fd = fd;
+    file->offset = offset;
+    file->size = size;
+    file->release = release;
+    file->arg = arg;
+    *conn->lastFile = file;
+    conn->lastFile = &file->next;
+    conn->fileBytes += size;
+}
+
+static size_t pending(connection* conn) {
+    return conn->out.end - conn->out.start + conn->fileBytes;
+}
+
+static void accept_clients() {
+    int fd;
+
+    while ((fd = accept4(listener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        connection* conn = calloc(1, sizeof(connection));
+        if (!conn) {
+            perror("failed to allocate connection");
+            close(fd);
+            continue;
+        }
+        init_connection(conn, fd);
+        watch(EPOLL_CTL_ADD, fd, conn, EPOLLIN | EPOLLRDHUP | EPOLLONESHOT);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+        perror("Erro ao aceitar socket cliente");
+
+    watch(EPOLL_CTL_MOD, listener.fd, &listener, EPOLLIN | EPOLLONESHOT);
+}
+
+/* Writes as much of the pending responses as the socket takes.
+   Returns -1 if the connection broke, 0 otherwise */
+static int flush_connection(connection* conn) {
+    tfsBuffer* out = &conn->out;
+
+    while (pending(conn)) {
+        outFile* file = conn->files;
+        size_t bytes = out->end - out->start;
+        ssize_t n;
+
+        if (file && file->position - conn->outSent < bytes)
+            bytes = file->position - conn->outSent;
+
+        if (bytes)
+            n = write(conn->fd, out->data + out->start, bytes);
+        else
+            n = sendfile(conn->fd, file->fd, &file->offset, file->size);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;  /* or the file was shorter than queued */
+        }
+
+        if (bytes) {
+            buffer_consume(out, n);
+            conn->outSent += n;
+        }
+        else {
+            file->size -= n;
+            conn->fileBytes -= n;
+            if (!file->size) {
+                conn->files = file->next;
+                if (!conn->files)
+                    conn->lastFile = &conn->files;
+                file->next = conn->sentFiles;
+                conn->sentFiles = file;
+            }
+        }
+    }
+    release_sent(conn);
+    return 0;
+}
+
+/* Runs every complete request in the input buffer, all of their
+   responses are then sent together. How many there were is the queue
+   depth of the connection. Returns -1 on a protocol error */
+static int process_requests(connection* conn) {
+    tfsRequest request;
+    int parsed, requests = 0;
+
+    while ((parsed = tfs_parse_request(&conn->in, &request)) > 0) {
+        apply(&request, &conn->out, &conn->client);
+        requests++;
+    }
+    if (finish)
+        finish();
+    if (requests)
+        stats_queue(requests);
+    return parsed;
+}
+
+/* Reads once from the client. Returns 0 at end of stream, -1 on error */
+static ssize_t fill_connection(connection* conn) {
+    ssize_t n = read(conn->fd, buffer_reserve(&conn->in, READ_CHUNK), READ_CHUNK);
+
+    if (n > 0)
+        conn->in.end += n;
+    return n;
+}
+
+static void serve_connection(connection* conn) {
+    /* clients that do not read their responses are not read either */
+    if (pending(conn) < MAX_PENDING) {
+        ssize_t n = fill_connection(conn);
+
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close_connection(conn);
+            return;
+        }
+        if (n > 0 && process_requests(conn) < 0) {
+            close_connection(conn);
+            return;
+        }
+    }
+
+    if (flush_connection(conn) < 0) {
+        close_connection(conn);
+        return;
+    }
+
+    unsigned int next = EPOLLONESHOT | EPOLLRDHUP;
+    if (pending(conn))
+        next |= EPOLLOUT;
+    if (pending(conn) < MAX_PENDING)
+        next |= EPOLLIN;
+    watch(EPOLL_CTL_MOD, conn->fd, conn, next);
+}
+
+static void* worker(void* arg) {
+    struct epoll_event events[MAX_EVENTS];
+    (void) arg;
+
+    while (1) {
+        int i, n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < n; i++) {
+            connection* conn = events[i].data.ptr;
+
+            if (conn == &stopper)
+                return NULL;    /* level triggered, wakes every worker */
+            else if (conn == &listener)
+                accept_clients();
+            else
+                serve_connection(conn);
+        }
+    }
+}
+
+/* Serves clients until server_stop() is called */
+void server_run(char* address, int workers, requestHandler handler, requestsFinisher finisher) {
+    int i;
+
+    apply = handler;
+    finish = finisher;
+    if (pipe2(stopPipe, O_CLOEXEC) < 0 || (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("failed to create server");
+        exit(EXIT_FAILURE);
+    }
+
+    listener.fd = mount(address, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    stopper.fd = stopPipe[0];
+    watch(EPOLL_CTL_ADD, stopper.fd, &stopper, EPOLLIN);
+    watch(EPOLL_CTL_ADD, listener.fd, &listener, EPOLLIN | EPOLLONESHOT);
+
+    pthread_t* tid = malloc(workers * sizeof(pthread_t));
+    if (!tid) {
+        perror("failed to allocate workers");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&tid[i], NULL, worker, NULL) != 0) {
+            perror("failed to create worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < workers; i++)
+        pthread_join(tid[i], NULL);
+
+    /* connections still open are left to the process exit */
+    free(tid);
+    close(listener.fd);
+    close(epfd);
+    unlink(address);
+}
+
+/* Async-signal-safe */
+void server_stop() {
+    if (stopPipe[1] >= 0 && write(stopPipe[1], "", 1) < 0)
+        perror("server_stop failed");
+}
+
+static void* trata_cliente(void* arg) {
+    connection conn;
+    ssize_t n;
+
+    init_connection(&conn, (int) (long) arg);
+    while ((n = fill_connection(&conn)) > 0 || (n < 0 && errno == EINTR)) {
+        if (process_requests(&conn) < 0)
+            break;
+        if (flush_connection(&conn) < 0) {
+            perror("Erro no Write Server");
+            break;
+        }
+    }
+    free_connection(&conn);
+    return NULL;
+}
+
+/* One detached thread per accepted client, never returns */
+void server_run_threads(char* address, requestHandler handler) {
+    int sockfd = mount(address, SOCK_CLOEXEC);
+    pthread_attr_t attr;
+
+    apply = handler;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1) {
+        pthread_t tid;
+        int fd = accept(sockfd, NULL, NULL);
+
+        if (fd < 0) {
+            perror("Erro ao aceitar socket cliente");
+            continue;
+        }
+        if (pthread_create(&tid, &attr, trata_cliente, (void*) (long) fd) != 0) {
+            perror("failed to create client thread");
+            close(fd);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <sys/types.h>
+#include "protocol.h"
+
+#define UNIXSTR_PATH "/tmp/socket.unix.stream"
+#define MAX_EVENTS   64         /* events taken by a worker per epoll_wait */
+#define READ_CHUNK   65536      /* bytes read from a client at a time */
+#define MAX_PENDING  (1 << 20)  /* unsent reply bytes before a client is throttled */
+#define ZERO_COPY_MIN  (1 << 16)    /* reads from this size on are sent with sendfile */
+
+#define MAX_OPEN_FILES  16     /* fds of a connection */
+
+/* A file opened by a client, free while mode is 0 */
+typedef struct fileDescriptor {
+    int inumber;
+    int mode;
+    uint64_t offset;
+} fileDescriptor;
+
+/* What the server keeps of a client while it is connected. Requests of
+   a connection are never run at the same time, so it needs no lock. */
+typedef struct session {
+    uid_t uid;              /* of the client process (SO_PEERCRED) */
+    fileDescriptor files[MAX_OPEN_FILES];
+} session;
+
+/* Executes a request and appends its response frame(s) to out */
+typedef void (*requestHandler)(tfsRequest* request, tfsBuffer* out, session* client);
+
+/* Called after the requests read from a connection have been given to
+   the handler, before their responses are sent: a handler that leaves
+   requests to other threads waits for them here (see shard.h) */
+typedef void (*requestsFinisher)();
+
+void server_run(char* address, int workers, requestHandler handler, requestsFinisher finisher);
+void server_run_threads(char* address, requestHandler handler);
+void server_stop();
+void server_send_file(session* client, int fd, off_t offset, size_t size,
+                      void (*release)(void* arg), void* arg);
+
+#endif /* SERVER_H */
@@ -0,0 +1,302 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#define _GNU_SOURCE     /* pthread_setaffinity_np */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "shard.h"
+#include "sync.h"
+
+/* The response of a request in flight, until the worker moves it to out.
+   The owner sets done once it is in response. */
+typedef struct shardSlot {
+    tfsBuffer response;
+    tfsBuffer* out;
+    int done;
+} shardSlot;
+
+/* A request handed to an owner, with the slot its response goes to */
+typedef struct shardTask {
+    tfsRequest request;
+    shardSlot* slot;
+    session* client;
+} shardTask;
+
+/* Only the worker writes tail and only the owner writes head, so a
+   release store of either publishes the tasks up to it */
+typedef struct shardQueue {
+    shardTask tasks[SHARD_QUEUE];
+    unsigned long head __attribute__((aligned(CACHE_LINE)));
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));
+} shardQueue;
+
+/* A thread that sleeps when it runs out of work. Whoever gives it work
+   stores it before reading sleeping, and it sets sleeping before looking
+   for work once more, so one of them always sees the other. */
+typedef struct sleeper {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sleeping;
+} sleeper;
+
+/* Requests sent..flushed - 1 are in flight, in slots[i % SHARD_QUEUE] */
+typedef struct shardWorker {
+    shardQueue* queues;     /* one per owner */
+    shardSlot slots[SHARD_QUEUE];
+    unsigned long sent, flushed;
+    int alone;              /* the last one sent must be done before the next */
+    sleeper wait;
+} shardWorker;
+
+typedef struct shardOwner {
+    pthread_t tid;
+    int index;
+    sleeper wait;
+} shardOwner;
+
+static int numShards, numWorkers, registered, stopping;
+static shardOwner* owners;
+static shardWorker* workers;
+static requestHandler handle;
+static requestRouter router;
+static __thread shardWorker* mine;
+
+static void sleeper_init(sleeper* s, const char* name, int index) {
+    mutex_init(&s->lock);
+    cond_init(&s->cond);
+    sync_profile_name(&s->lock, name, index);
+    s->sleeping = 0;
+}
+
+static void sleeper_destroy(sleeper* s) {
+    mutex_destroy(&s->lock);
+    cond_destroy(&s->cond);
+}
+
+static void wake(sleeper* s) {
+    if (__atomic_load_n(&s->sleeping, __ATOMIC_SEQ_CST)) {
+        mutex_lock(&s->lock);
+        cond_broadcast(&s->cond);
+        mutex_unlock(&s->lock);
+    }
+}
+
+/* Returns once ready(arg), yielding the core a few times before sleeping */
+static void sleep_until(sleeper* s, int (*ready)(void*), void* arg) {
+    int i;
+
+    for (i = 0; i < SHARD_SPIN; i++) {
+        if (ready(arg))
+            return;
+        sched_yield();
+    }
+    mutex_lock(&s->lock);
+    __atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+    while (!ready(arg))
+        cond_wait(&s->cond, &s->lock);
+    __atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+    mutex_unlock(&s->lock);
+}
+
+static shardQueue* queue_of(shardWorker* w, int shard) {
+    return &w->queues[shard];
+}
+
+static int owner_has_work(void* arg) {
+    shardOwner* o = (shardOwner*) arg;
+    int w;
+
+    if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+        return 1;
+    for (w = 0; w < numWorkers; w++) {
+        shardQueue* q = queue_of(&workers[w], o->index);
+        if (__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) != q->head)
+            return 1;
+    }
+    return 0;
+}
+
+/* Runs the tasks queued by worker w for shard. Returns how many */
+static int run_queue(shardWorker* w, int shard) {
+    shardQueue* q = queue_of(w, shard);
+    unsigned long first = q->head, tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE), head;
+
+    for (head = first; head != tail; head++) {
+        shardTask* task = &q->tasks[head % SHARD_QUEUE];
+        handle(&task->request, &task->slot->response, task->client);
+        __atomic_store_n(&task->slot->done, 1, __ATOMIC_SEQ_CST);
+    }
+    if (first == tail)
+        return 0;
+    __atomic_store_n(&q->head, tail, __ATOMIC_RELEASE);
+    wake(&w->wait);
+    return (int) (tail - first);
+}
+
+static void pin(int core) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(core % (cores > 0 ? cores : 1), &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        fprintf(stderr, "shard %d: could not pin to a core\n", core);
+}
+
+static void* owner(void* arg) {
+    shardOwner* o = (shardOwner*) arg;
+
+    pin(o->index);
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        int w, ran = 0;
+
+        for (w = 0; w < numWorkers; w++)
+            ran += run_queue(&workers[w], o->index);
+        if (!ran)
+            sleep_until(&o->wait, owner_has_work, o);
+    }
+    return NULL;
+}
+
+/* Starts one owner per shard, for up to workers threads calling
+   shard_apply. handler runs the requests, on the owners or not, and
+   route picks their shard. */
+void shard_start(int shards, int workersCount, requestHandler handler, requestRouter route) {
+    int i;
+
+    numShards = shards;
+    numWorkers = workersCount;
+    handle = handler;
+    router = route;
+    owners = calloc(shards, sizeof(shardOwner));
+    workers = calloc(workersCount, sizeof(shardWorker));
+    if (!owners || !workers) {
+        perror("failed to allocate shards");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < workersCount; i++) {
+        workers[i].queues = aligned_alloc(CACHE_LINE, shards * sizeof(shardQueue));
+        if (!workers[i].queues) {
+            perror("failed to allocate shards");
+            exit(EXIT_FAILURE);
+        }
+        memset(workers[i].queues, 0, shards * sizeof(shardQueue));
+        sleeper_init(&workers[i].wait, "shard worker", i);
+    }
+    for (i = 0; i < shards; i++) {
+        owners[i].index = i;
+        sleeper_init(&owners[i].wait, "shard owner", i);
+        if (pthread_create(&owners[i].tid, NULL, owner, &owners[i]) != 0) {
+            perror("failed to create shard owner");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static shardWorker* this_worker() {
+    if (!mine) {
+        int index = __atomic_fetch_add(&registered, 1, __ATOMIC_RELAXED);
+
+        if (index >= numWorkers) {
+            fprintf(stderr, "Error: more threads than shard workers\n");
+            exit(EXIT_FAILURE);
+        }
+        mine = &workers[index];
+    }
+    return mine;
+}
+
+static int slot_done(void* arg) {
+    shardSlot* slot = (shardSlot*) arg;
+    return __atomic_load_n(&slot->done, __ATOMIC_SEQ_CST);
+}
+
+/* Moves the responses of the requests in flight to their out buffers, in
+   the order the requests were sent: all of them, or, when upTo is
+   given, up to that one and then those already done */
+static void flush_slots(shardWorker* w, unsigned long upTo) {
+    while (w->flushed != w->sent) {
+        shardSlot* slot = &w->slots[w->flushed % SHARD_QUEUE];
+
+        if (w->flushed >= upTo && !slot_done(slot))
+            return;
+        sleep_until(&w->wait, slot_done, slot);
+        buffer_append(slot->out, slot->response.data + slot->response.start,
+                      slot->response.end - slot->response.start);
+        buffer_consume(&slot->response, slot->response.end - slot->response.start);
+        slot->done = 0;
+        w->flushed++;
+    }
+    w->alone = 0;
+}
+
+/* Waits for the requests this thread has in flight */
+void shard_flush() {
+    flush_slots(this_worker(), ~0UL);
+}
+
+/* Whether request only reads or changes its own entry, in the root, so
+   that it may run before or after those of other shards sent around it:
+   a rename changes two entries, and a path is resolved through the
+   directories that the requests in flight may be creating or removing */
+static int on_own_entry(tfsRequest* request) {
+    return request->opcode != TFS_RENAME && !strchr(request->name1, '/');
+}
+
+/* requestHandler of the workers: the request goes to the owner of its
+   shard, and its response is in out once shard_flush returns. Requests
+   on entries of the root are in flight to several shards at once; the
+   others wait for those before them and hold back those after them, so
+   every request sees the effects of those sent before it. */
+void shard_apply(tfsRequest* request, tfsBuffer* out, session* client) {
+    shardWorker* w = this_worker();
+    int alone = !on_own_entry(request), shard;
+
+    if (alone || w->alone)
+        shard_flush();
+    shard = router(request);
+    if (shard < 0) {
+        shard_flush();
+        handle(request, out, client);
+        return;
+    }
+    if (w->sent - w->flushed == SHARD_QUEUE)
+        flush_slots(w, w->flushed + 1);
+
+    shardSlot* slot = &w->slots[w->sent % SHARD_QUEUE];
+    slot->out = out;
+    shardQueue* q = queue_of(w, shard);
+    shardTask* task = &q->tasks[q->tail % SHARD_QUEUE];
+    task->request = *request;
+    task->slot = slot;
+    task->client = client;
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_SEQ_CST);
+    w->alone = alone;
+    w->sent++;
+    wake(&owners[shard].wait);
+}
+
+/* Once no worker is calling shard_apply any more */
+void shard_stop() {
+    int i;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < numShards; i++) {
+        wake(&owners[i].wait);
+        pthread_join(owners[i].tid, NULL);
+        sleeper_destroy(&owners[i].wait);
+    }
+    for (i = 0; i < numWorkers; i++) {
+        int s;
+
+        for (s = 0; s < SHARD_QUEUE; s++)
+            buffer_free(&workers[i].slots[s].response);
+        sleeper_destroy(&workers[i].wait);
+        free(workers[i].queues);
+    }
+    free(workers);
+    free(owners);
+}
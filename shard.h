@@ -0,0 +1,45 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "server.h"
+#include "lib/ring.h"
+
+/* Sharded execution (TECNICOFS_SERVER=shards). The buckets are split
+   among a fixed set of owner threads, each pinned to a core: the shard
+   of an entry is the hash of its key modulo the number of shards, and as
+   that number divides the initial bucket count, bucket i holds entries of
+   shard i % shards only, before and after every split. The epoll workers
+   parse requests and hand those on one entry to the owner of its shard
+   through a single producer, single consumer queue per worker and owner,
+   so only that owner changes the buckets of a shard and their locks and
+   trees stay in the cache of its core. The bucket locks are still taken:
+   path resolution reads the buckets of every shard, and a dump or a split
+   started on another thread may lock them too; they are just no longer
+   contended between writers.
+
+   A worker keeps up to SHARD_QUEUE requests in flight, to any shards,
+   each with a slot for its response, and moves the responses to the
+   connections in the order the requests came. Those on entries of the
+   root only touch their own entry, whose requests all go to one owner in
+   order, so several shards run them at once; a rename or a request on a
+   path waits for those before it and holds back those after it, as does
+   a request the worker runs itself, so the requests of a connection are
+   still applied as if in the order they came. A rename is sent to the
+   owner of its source, which locks the bucket of the target as well, in
+   the bucket order move_entry always uses: the owner of the target may be
+   changing that bucket at the same time and simply waits its turn. */
+
+#define SHARD_QUEUE  64     /* requests in flight from a worker */
+#define SHARD_SPIN   64     /* polls before an idle thread sleeps */
+
+/* Shard of a request (0 to shards - 1), or -1 to run it on the worker */
+typedef int (*requestRouter)(tfsRequest* request);
+
+void shard_start(int shards, int workers, requestHandler handler, requestRouter route);
+void shard_apply(tfsRequest* request, tfsBuffer* out, session* client);
+void shard_flush();
+void shard_stop();
+
+#endif /* SHARD_H */
@@ -0,0 +1,305 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+/* Snapshots are images of the bucket table (image.h), written to
+   snapshot.tmp, synced and renamed over snapshot, so a crash leaves
+   either the old or the new one. The fs may still be using the old one
+   through its mapping, which outlives the rename. */
+
+#define _GNU_SOURCE     /* asprintf */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "snapshot.h"
+#include "sync.h"
+
+static char* data_path(char* dir, char* name) {
+    char* path;
+
+    if (asprintf(&path, "%s/%s", dir, name) < 0) {
+        perror("snapshot: no memory");
+        exit(EXIT_FAILURE);
+    }
+    return path;
+}
+
+/* Where the snapshot of the data directory dir is, to be freed */
+char* snapshot_path(char* dir) {
+    return data_path(dir, "snapshot");
+}
+
+/* The records are written as the buckets and then the directories are
+   visited, the names go to a temporary file appended after them, and so
+   do the contents of the files after the files */
+struct snapshotWriter {
+    FILE* fp;
+    FILE* strings;
+    uint64_t count;             /* records written so far */
+    uint64_t stringsSize;
+    uint64_t* buckets;
+    int bucketsSize;
+    imageDirectory* directories;
+    uint64_t directoriesCount;
+    FILE* data;
+    uint64_t dataSize;
+    imageFile* files;
+    uint64_t filesCount;
+    int maxINumber;
+};
+
+/* Grows array, with count elements of size, at powers of two */
+static void* grow(void* array, uint64_t count, size_t size) {
+    if (count & (count - 1))
+        return array;
+    array = realloc(array, (count ? 2 * count : 1) * size);
+    if (!array) {
+        perror("snapshot: no memory");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+static void write_record(char* name, int inumber, void* arg) {
+    struct snapshotWriter* writer = (struct snapshotWriter*) arg;
+    size_t length = strlen(name) + 1;
+    imageRecord record = { (uint32_t) writer->stringsSize, inumber };
+
+    if (writer->stringsSize + length > UINT32_MAX) {
+        fprintf(stderr, "snapshot: names do not fit in an image\n");
+        exit(EXIT_FAILURE);
+    }
+    fwrite(&record, sizeof(record), 1, writer->fp);
+    fwrite(name, 1, length, writer->strings);
+    writer->stringsSize += length;
+    writer->count++;
+    if (inumber > writer->maxINumber)
+        writer->maxINumber = inumber;
+}
+
+/* Directories are visited after the buckets, count restarts at 0 for
+   the children records */
+static void write_directory(int inumber, int parent, void* arg) {
+    struct snapshotWriter* writer = (struct snapshotWriter*) arg;
+    uint64_t n = writer->directoriesCount;
+
+    writer->directories = grow(writer->directories, n, sizeof(imageDirectory));
+    if (n > 0)
+        writer->directories[n - 1].count = writer->count - writer->directories[n - 1].children;
+    writer->directories[n].inumber = inumber;
+    writer->directories[n].parent = parent;
+    writer->directories[n].children = writer->count;
+    writer->directories[n].count = 0;
+    writer->directoriesCount++;
+}
+
+/* Called with the data lock of the file held, so the contents match
+   the size */
+static void write_file(int inumber, inode* file, void* arg) {
+    struct snapshotWriter* writer = (struct snapshotWriter*) arg;
+    imageFile* entry;
+    char buffer[65536];
+    uint64_t offset;
+
+    writer->files = grow(writer->files, writer->filesCount, sizeof(imageFile));
+    entry = &writer->files[writer->filesCount++];
+    memset(entry, 0, sizeof(imageFile));
+    entry->inumber = inumber;
+    entry->owner = file->owner;
+    entry->permissions = PERMISSIONS(file->ownerPermissions, file->othersPermissions);
+    entry->size = file->size;
+    entry->data = writer->dataSize;
+    entry->atime = __atomic_load_n(&file->atime, __ATOMIC_RELAXED);
+    entry->mtime = file->mtime;
+    entry->ctime = file->ctime;
+
+    for (offset = 0; offset < file->size; ) {
+        size_t n = inode_read(file, offset, buffer, sizeof(buffer));
+        fwrite(buffer, 1, n, writer->data);
+        offset += n;
+    }
+    writer->dataSize += file->size;
+}
+
+static void append_file(FILE* to, FILE* from) {
+    char buffer[65536];
+    size_t n;
+
+    rewind(from);
+    while ((n = fread(buffer, 1, sizeof(buffer), from)) > 0)
+        fwrite(buffer, 1, n, to);
+}
+
+static void end_bucket(int index, void* arg) {
+    struct snapshotWriter* writer = (struct snapshotWriter*) arg;
+
+    writer->buckets = realloc(writer->buckets, (index + 2) * sizeof(uint64_t));
+    if (!writer->buckets) {
+        perror("snapshot: no memory");
+        exit(EXIT_FAILURE);
+    }
+    writer->buckets[index + 1] = writer->count;
+    writer->bucketsSize = index + 1;
+}
+
+static void sync_dir(char* dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void write_failed(char* path) {
+    fprintf(stderr, "snapshot: could not write %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/* Writes a snapshot of fs while it keeps changing. The log is switched
+   to a new segment first: every change logged before that is already in
+   the buckets, and the ones after it are replayed over the snapshot at
+   startup, whether the traversal saw them or not. Once the snapshot is on
+   disk the older segments are deleted. Returns the lsn it covers. */
+uint64_t snapshot_write(tecnicofs* fs, char* dir) {
+    char* tmpPath = data_path(dir, "snapshot.tmp");
+    char* path = snapshot_path(dir);
+    uint64_t lsn = fs->log ? wal_rotate(fs->log) : 0;
+    int nextINumber = __atomic_load_n(&fs->nextINumber, __ATOMIC_RELAXED);
+    struct snapshotWriter writer;
+    imageHeader header;
+
+    memset(&writer, 0, sizeof(writer));
+    writer.fp = fopen(tmpPath, "w");
+    writer.strings = tmpfile();
+    writer.data = tmpfile();
+    writer.buckets = calloc(1, sizeof(uint64_t));
+    if (!writer.fp || !writer.strings || !writer.data || !writer.buckets)
+        write_failed(tmpPath);
+    setvbuf(writer.fp, NULL, _IOFBF, 1 << 20);
+
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, writer.fp);     /* filled in at the end */
+    traverse_tecnicofs(fs, write_record, end_bucket, &writer);
+    header.count = writer.count;
+    fwrite(writer.buckets, sizeof(uint64_t), writer.bucketsSize + 1, writer.fp);
+
+    writer.count = 0;
+    traverse_directories(fs, write_directory, write_record, &writer);
+    if (writer.directoriesCount > 0) {
+        imageDirectory* last = &writer.directories[writer.directoriesCount - 1];
+        last->count = writer.count - last->children;
+    }
+    header.childrenCount = writer.count;
+    fwrite(writer.directories, sizeof(imageDirectory), writer.directoriesCount, writer.fp);
+    traverse_files(fs, write_file, &writer);
+
+    if (writer.maxINumber > nextINumber)
+        nextINumber = writer.maxINumber;
+    memcpy(header.magic, IMAGE_MAGIC, 8);
+    header.version = IMAGE_VERSION;
+    header.nextINumber = nextINumber;
+    header.lsn = lsn;
+    header.baseBuckets = fs->baseBuckets;
+    header.sizeBuckets = writer.bucketsSize;
+    header.recordsOffset = sizeof(header);
+    header.bucketsOffset = header.recordsOffset + header.count * sizeof(imageRecord);
+    header.childrenOffset = header.bucketsOffset + (writer.bucketsSize + 1) * sizeof(uint64_t);
+    header.directoriesOffset = header.childrenOffset + header.childrenCount * sizeof(imageRecord);
+    header.directoriesCount = writer.directoriesCount;
+    header.stringsOffset = header.directoriesOffset + writer.directoriesCount * sizeof(imageDirectory);
+    header.stringsSize = writer.stringsSize;
+    /* the files are read in place, so they start aligned */
+    header.filesOffset = (header.stringsOffset + header.stringsSize + 7) & ~(uint64_t) 7;
+    header.filesCount = writer.filesCount;
+    header.dataOffset = header.filesOffset + writer.filesCount * sizeof(imageFile);
+    header.dataSize = writer.dataSize;
+
+    append_file(writer.fp, writer.strings);
+    fwrite("\0\0\0\0\0\0\0", 1, header.filesOffset - (header.stringsOffset + header.stringsSize),
+           writer.fp);
+    fwrite(writer.files, sizeof(imageFile), writer.filesCount, writer.fp);
+    append_file(writer.fp, writer.data);
+
+    if (ferror(writer.strings) || ferror(writer.data) || fseek(writer.fp, 0, SEEK_SET) < 0 ||
+        fwrite(&header, sizeof(header), 1, writer.fp) != 1 ||
+        fflush(writer.fp) != 0 || fsync(fileno(writer.fp)) < 0)
+        write_failed(tmpPath);
+    fclose(writer.fp);
+    fclose(writer.strings);
+    fclose(writer.data);
+
+    if (rename(tmpPath, path) < 0) {
+        perror("snapshot: rename failed");
+        exit(EXIT_FAILURE);
+    }
+    sync_dir(dir);
+
+    if (fs->log)
+        wal_remove_old(fs->log, lsn);
+
+    free(writer.buckets);
+    free(writer.directories);
+    free(writer.files);
+    free(tmpPath);
+    free(path);
+    return lsn;
+}
+
+/* Background snapshots, taken once SNAPSHOT_RECORDS changes were logged */
+static pthread_t snapshotThread;
+static pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshotWake = PTHREAD_COND_INITIALIZER;
+static int snapshotRunning = 0;
+static tecnicofs* snapshotFs;
+static char* snapshotDir;
+
+static void* snapshot_thread() {
+    uint64_t lastLsn = __atomic_load_n(&snapshotFs->log->lastLsn, __ATOMIC_RELAXED);
+
+    mutex_lock(&snapshotLock);
+    while (snapshotRunning) {
+        struct timespec deadline;
+
+        /* polls the log once a second */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&snapshotWake, &snapshotLock, &deadline);
+        if (!snapshotRunning)
+            break;
+
+        uint64_t lsn = __atomic_load_n(&snapshotFs->log->lastLsn, __ATOMIC_RELAXED);
+        if (lsn - lastLsn < SNAPSHOT_RECORDS)
+            continue;
+
+        mutex_unlock(&snapshotLock);
+        lastLsn = snapshot_write(snapshotFs, snapshotDir);
+        mutex_lock(&snapshotLock);
+    }
+    mutex_unlock(&snapshotLock);
+
+    return NULL;
+}
+
+void snapshot_start(tecnicofs* fs, char* dir) {
+    snapshotFs = fs;
+    snapshotDir = dir;
+    snapshotRunning = 1;
+    if (pthread_create(&snapshotThread, NULL, snapshot_thread, NULL) != 0) {
+        perror("failed to create snapshot thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void snapshot_stop() {
+    if (!snapshotRunning)
+        return;
+
+    mutex_lock(&snapshotLock);
+    snapshotRunning = 0;
+    cond_broadcast(&snapshotWake);
+    mutex_unlock(&snapshotLock);
+
+    pthread_join(snapshotThread, NULL);
+}
@@ -0,0 +1,20 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "fs.h"
+
+/* Image (image.h) of all the files, in the data directory next to the
+ * log. It records the lsn of the last change it is sure to include,
+ * startup maps it as the fs and replays the log records after that lsn. */
+
+#define SNAPSHOT_RECORDS  100000   /* logged changes between snapshots */
+
+char* snapshot_path(char* dir);
+uint64_t snapshot_write(tecnicofs* fs, char* dir);
+void snapshot_start(tecnicofs* fs, char* dir);
+void snapshot_stop();
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,237 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "fs.h"
+#include "sync.h"
+
+/* What one thread recorded. Only its thread writes it, with relaxed
+ * stores so that stats_json can read it at the same time. */
+typedef struct threadStats {
+    struct threadStats* next;
+    histogram ops[STATS_OPS];
+    histogram lockWait;     /* contended bucket locks only */
+    histogram queue;        /* requests found waiting on a connection */
+    uint64_t filter[3];     /* lookups by FILTER_SKIPPED, _FOUND and _MISSED */
+} threadStats;
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static threadStats* threads;    /* alive */
+static threadStats retired;     /* what the threads that exited recorded */
+static pthread_key_t retireKey;
+static __thread threadStats* mine;
+
+static uint64_t startTime;
+static long connections, accepted;
+
+uint64_t stats_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void hist_merge(histogram* into, histogram* h) {
+    int i;
+
+    into->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (max > into->max)
+        into->max = max;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        into->buckets[i] += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+}
+
+static void stats_merge(threadStats* into, threadStats* s) {
+    size_t i;
+
+    for (i = 0; i < STATS_OPS; i++)
+        hist_merge(&into->ops[i], &s->ops[i]);
+    hist_merge(&into->lockWait, &s->lockWait);
+    hist_merge(&into->queue, &s->queue);
+    for (i = 0; i < 3; i++)
+        into->filter[i] += __atomic_load_n(&s->filter[i], __ATOMIC_RELAXED);
+}
+
+/* Destructor of retireKey, when a thread that recorded exits */
+static void retire(void* arg) {
+    threadStats* s = (threadStats*) arg, **p;
+
+    mutex_lock(&registryLock);
+    stats_merge(&retired, s);
+    for (p = &threads; *p != s; p = &(*p)->next)
+        ;
+    *p = s->next;
+    mutex_unlock(&registryLock);
+    free(s);
+}
+
+void stats_init() {
+    startTime = stats_now();
+    sync_profile_name(&registryLock, "stats", -1);
+    if (pthread_key_create(&retireKey, retire) != 0) {
+        perror("failed to create stats key");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static threadStats* thread_stats() {
+    if (mine)
+        return mine;
+
+    mine = calloc(1, sizeof(threadStats));
+    if (!mine) {
+        perror("failed to allocate stats");
+        exit(EXIT_FAILURE);
+    }
+    mutex_lock(&registryLock);
+    mine->next = threads;
+    threads = mine;
+    mutex_unlock(&registryLock);
+    pthread_setspecific(retireKey, mine);
+    return mine;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB)
+        return (int) v;
+
+    int e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_EXP)
+        return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int) ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value that falls in bucket i */
+static uint64_t hist_value(int i) {
+    if (i < HIST_SUB)
+        return i;
+
+    int shift = i / HIST_SUB - 1;
+    return ((uint64_t) (HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+/* Written by its thread only: no atomic read-modify-write needed */
+static void add(uint64_t* counter, uint64_t v) {
+    __atomic_store_n(counter, *counter + v, __ATOMIC_RELAXED);
+}
+
+static void hist_record(histogram* h, uint64_t v) {
+    add(&h->buckets[hist_index(v)], 1);
+    add(&h->count, 1);
+    add(&h->sum, v);
+    if (v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+void stats_op(char opcode, uint64_t ns) {
+    char* op = opcode ? strchr(STATS_OPCODES, opcode) : NULL;
+    int slot = op ? op - STATS_OPCODES : (int) STATS_OPS - 1;
+
+    hist_record(&thread_stats()->ops[slot], ns);
+}
+
+void stats_lock_wait(uint64_t ns) {
+    hist_record(&thread_stats()->lockWait, ns);
+}
+
+void stats_queue(int requests) {
+    hist_record(&thread_stats()->queue, requests);
+}
+
+void stats_filter(int outcome) {
+    add(&thread_stats()->filter[outcome], 1);
+}
+
+/* Once per connection, so a shared counter is fine */
+void stats_connection(int opened) {
+    __atomic_add_fetch(&connections, opened ? 1 : -1, __ATOMIC_RELAXED);
+    if (opened)
+        __atomic_add_fetch(&accepted, 1, __ATOMIC_RELAXED);
+}
+
+/* Smallest bucket value with at least q of the values at or below it */
+static uint64_t hist_percentile(histogram* h, double q) {
+    uint64_t rank = (uint64_t) (q * h->count + 0.5), seen = 0;
+    int i;
+
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static void hist_json(FILE* fp, histogram* h) {
+    fprintf(fp, "{\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, "
+            "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+            (unsigned long long) h->count,
+            (unsigned long long) (h->count ? h->sum / h->count : 0),
+            (unsigned long long) hist_percentile(h, 0.5),
+            (unsigned long long) hist_percentile(h, 0.9),
+            (unsigned long long) hist_percentile(h, 0.99),
+            (unsigned long long) hist_percentile(h, 0.999),
+            (unsigned long long) h->max);
+}
+
+/* Everything recorded so far, added up. Latencies and waits are in ns */
+void stats_json(FILE* fp, tecnicofs* fs) {
+    bucketWait hot[STATS_HOT_BUCKETS];
+    threadStats* total = calloc(1, sizeof(threadStats));
+    threadStats* s;
+    int i, count, first = 1;
+    size_t op;
+
+    if (!total) {
+        perror("failed to allocate stats");
+        exit(EXIT_FAILURE);
+    }
+    mutex_lock(&registryLock);
+    stats_merge(total, &retired);
+    for (s = threads; s; s = s->next)
+        stats_merge(total, s);
+    mutex_unlock(&registryLock);
+
+    fprintf(fp, "{\n  \"uptime_ms\": %llu,\n",
+            (unsigned long long) ((stats_now() - startTime) / 1000000));
+    fprintf(fp, "  \"connections\": {\"active\": %ld, \"accepted\": %ld},\n",
+            __atomic_load_n(&connections, __ATOMIC_RELAXED),
+            __atomic_load_n(&accepted, __ATOMIC_RELAXED));
+
+    fprintf(fp, "  \"ops\": {");
+    for (op = 0; op < STATS_OPS; op++) {
+        char name[2] = { STATS_OPCODES[op], '\0' };
+
+        if (!total->ops[op].count)
+            continue;
+        fprintf(fp, "%s\n    \"%s\": ", first ? "" : ",", name[0] ? name : "other");
+        hist_json(fp, &total->ops[op]);
+        first = 0;
+    }
+    fprintf(fp, "%s},\n", first ? "" : "\n  ");
+
+    fprintf(fp, "  \"queue_depth\": ");
+    hist_json(fp, &total->queue);
+    fprintf(fp, ",\n  \"lock_wait\": ");
+    hist_json(fp, &total->lockWait);
+    fprintf(fp, ",\n  \"filter\": {\"checked\": %llu, \"skipped\": %llu, \"missed\": %llu}",
+            (unsigned long long) (total->filter[FILTER_SKIPPED] + total->filter[FILTER_FOUND] +
+                                  total->filter[FILTER_MISSED]),
+            (unsigned long long) total->filter[FILTER_SKIPPED],
+            (unsigned long long) total->filter[FILTER_MISSED]);
+
+    count = fs ? hottestBuckets(fs, hot, STATS_HOT_BUCKETS) : 0;
+    fprintf(fp, ",\n  \"hot_buckets\": [");
+    for (i = 0; i < count; i++)
+        fprintf(fp, "%s\n    {\"bucket\": %d, \"contended\": %llu, \"wait\": %llu}",
+                i ? "," : "", hot[i].index, (unsigned long long) hot[i].contended,
+                (unsigned long long) hot[i].waitNs);
+    fprintf(fp, "%s]\n}\n", count ? "\n  " : "");
+    free(total);
+}
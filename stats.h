@@ -0,0 +1,51 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Counters and latency histograms of the server. Every thread records
+ * into its own block, registered the first time it records, so the hot
+ * path writes no shared cache line; the blocks are only added up when
+ * the stats are asked for (stats_json). The blocks of threads that exit
+ * are folded into a total kept for them.
+ *
+ * Histograms are log-linear, like HdrHistogram: values below HIST_SUB
+ * have a bucket each, above that every power of two is split in HIST_SUB
+ * buckets, so a value is known to within 1/HIST_SUB of itself. */
+#define HIST_SUB_BITS  4
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP   40      /* values from 2^40 on (ns: 18 minutes) share the last bucket */
+#define HIST_BUCKETS   ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+#define STATS_OPCODES  "clmdrLpoxRWsDSB"     /* the one after the last is any other */
+#define STATS_OPS      (sizeof(STATS_OPCODES))
+
+#define STATS_HOT_BUCKETS  8    /* buckets listed by their lock wait */
+
+/* What the Bloom filter of a bucket did for a lookup, see stats_filter */
+#define FILTER_SKIPPED  0   /* ruled the key out, the tree was not walked */
+#define FILTER_FOUND    1
+#define FILTER_MISSED   2   /* let it through, and the key was not there */
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+struct tecnicofs;
+
+void stats_init();
+uint64_t stats_now();
+void stats_op(char opcode, uint64_t ns);
+void stats_lock_wait(uint64_t ns);
+void stats_queue(int requests);
+void stats_filter(int outcome);
+void stats_connection(int opened);
+void stats_json(FILE* fp, struct tecnicofs* fs);
+
+#endif /* STATS_H */
@@ -5,6 +5,293 @@
 #include <stdlib.h>
 #include <semaphore.h>
 #include <pthread.h>
+#include <sched.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <string.h>
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+#ifdef PROFILE
+typedef struct lockProfile {
+    void* lock;
+    const char* name;   /* or NULL, see sync_profile_name */
+    int index;
+    uint64_t acquired, contended;
+    uint64_t waitNs, holdNs, waitMax, holdMax;
+    uint64_t wait[PROFILE_HIST], hold[PROFILE_HIST];
+} lockProfile;
+
+/* Open addressing from the address of a lock to its profile. The
+ * profiles are handed out in order, so only the pages of the locks that
+ * were taken are ever touched */
+#define PROFILE_SLOTS  (2 * PROFILE_LOCKS)
+
+typedef struct profileSlot {
+    void* lock;
+    lockProfile* profile;   /* set by whoever claimed the slot, shortly after */
+} profileSlot;
+
+static profileSlot slots[PROFILE_SLOTS];
+static lockProfile profiles[PROFILE_LOCKS];
+static lockProfile others = { NULL, "(others)", -1 };
+static size_t used;
+
+/* Locks held by this thread, since when */
+static __thread struct {
+    void* lock;
+    lockProfile* profile;
+    uint64_t since;
+} held[PROFILE_HELD];
+static __thread int heldCount;
+
+static lockProfile* find_profile(void* lock) {
+    size_t i = (size_t) ((((uintptr_t) lock >> 3) * 0x9E3779B97F4A7C15ULL) % PROFILE_SLOTS);
+    size_t probes;
+
+    for (probes = 0; probes < PROFILE_SLOTS; probes++, i = (i + 1) % PROFILE_SLOTS) {
+        void* key = __atomic_load_n(&slots[i].lock, __ATOMIC_ACQUIRE);
+        lockProfile* p;
+
+        if (!key && __atomic_compare_exchange_n(&slots[i].lock, &key, lock, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            size_t n = __atomic_fetch_add(&used, 1, __ATOMIC_RELAXED);
+            p = n < PROFILE_LOCKS ? &profiles[n] : &others;
+            if (p != &others) {
+                p->lock = lock;
+                p->index = -1;
+            }
+            __atomic_store_n(&slots[i].profile, p, __ATOMIC_RELEASE);
+            return p;
+        }
+        if (key == lock) {
+            while (!(p = __atomic_load_n(&slots[i].profile, __ATOMIC_ACQUIRE)))
+                sched_yield();
+            return p;
+        }
+    }
+    return &others;
+}
+
+static void hist_add(uint64_t* hist, uint64_t* max, uint64_t ns) {
+    int i = ns ? 64 - __builtin_clzll(ns) : 0;
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&hist[i < PROFILE_HIST ? i : PROFILE_HIST - 1], 1, __ATOMIC_RELAXED);
+    while (ns > old && !__atomic_compare_exchange_n(max, &old, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* lock was taken, after waiting for it since waitStart if it was busy */
+static void profile_acquired(void* lock, uint64_t waitStart) {
+    lockProfile* p = find_profile(lock);
+    uint64_t now = now_ns();
+
+    __atomic_add_fetch(&p->acquired, 1, __ATOMIC_RELAXED);
+    if (waitStart) {
+        __atomic_add_fetch(&p->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&p->waitNs, now - waitStart, __ATOMIC_RELAXED);
+        hist_add(p->wait, &p->waitMax, now - waitStart);
+    }
+    if (heldCount < PROFILE_HELD) {
+        held[heldCount].lock = lock;
+        held[heldCount].profile = p;
+        held[heldCount++].since = now;
+    }
+}
+
+static void profile_released(void* lock) {
+    int i;
+
+    for (i = heldCount - 1; i >= 0 && held[i].lock != lock; i--)
+        ;
+    if (i < 0)
+        return;     /* taken while the thread held too many */
+
+    lockProfile* p = held[i].profile;
+    uint64_t hold = now_ns() - held[i].since;
+    __atomic_add_fetch(&p->holdNs, hold, __ATOMIC_RELAXED);
+    hist_add(p->hold, &p->holdMax, hold);
+    memmove(&held[i], &held[i + 1], (heldCount - i - 1) * sizeof(held[0]));
+    heldCount--;
+}
+
+/* Tries the lock first, so that only a busy lock is timed */
+#define PROFILE_LOCK(lock, try, acquire) ({ \
+    uint64_t waitStart = 0; \
+    int profileRet = (try); \
+    if (profileRet == EBUSY) { \
+        waitStart = now_ns(); \
+        profileRet = (acquire); \
+    } \
+    if (profileRet == 0) \
+        profile_acquired(lock, waitStart); \
+    profileRet; })
+#define PROFILE_ACQUIRED(lock)  profile_acquired(lock, 0)
+#define PROFILE_RELEASED(lock)  profile_released(lock)
+
+void sync_profile_name(void* lock, const char* name, int index) {
+    lockProfile* p = find_profile(lock);
+
+    if (p != &others) {
+        p->name = name;
+        p->index = index;
+    }
+}
+
+/* Largest time in the bucket of the q quantile */
+static uint64_t hist_quantile(uint64_t* hist, uint64_t count, double q) {
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < PROFILE_HIST; i++) {
+        seen += hist[i];
+        if (seen && seen >= q * count)
+            return i ? ((uint64_t) 1 << i) - 1 : 0;
+    }
+    return 0;
+}
+
+/* Longest wait first, then most taken */
+static int by_wait(const void* a, const void* b) {
+    lockProfile* pa = *(lockProfile**) a, *pb = *(lockProfile**) b;
+
+    if (pa->waitNs != pb->waitNs)
+        return pa->waitNs < pb->waitNs ? 1 : -1;
+    return pa->acquired < pb->acquired ? 1 : pa->acquired > pb->acquired ? -1 : 0;
+}
+
+static int is_bucket(lockProfile* p) {
+    return p->name && !strcmp(p->name, "bucket");
+}
+
+static void print_profile(FILE* fp, lockProfile* p) {
+    char name[64];
+    uint64_t holds = 0;
+    int i;
+
+    for (i = 0; i < PROFILE_HIST; i++)
+        holds += p->hold[i];
+    if (!p->name)
+        snprintf(name, sizeof(name), "%p", p->lock);
+    else if (p->index >= 0)
+        snprintf(name, sizeof(name), "%s %d", p->name, p->index);
+    else
+        snprintf(name, sizeof(name), "%s", p->name);
+
+    fprintf(fp, "%24s %10llu %7.2f%% %10.3f %8.1f %8.1f %8.1f %8.1f %10.1f\n", name,
+            (unsigned long long) p->acquired,
+            p->acquired ? 100.0 * p->contended / p->acquired : 0.0, p->waitNs / 1e6,
+            hist_quantile(p->wait, p->contended, 0.5) / 1e3,
+            hist_quantile(p->wait, p->contended, 0.99) / 1e3,
+            hist_quantile(p->hold, holds, 0.5) / 1e3,
+            hist_quantile(p->hold, holds, 0.99) / 1e3, p->holdMax / 1e3);
+}
+
+static void print_header(FILE* fp) {
+    fprintf(fp, "%24s %10s %8s %10s %8s %8s %8s %8s %10s\n", "lock", "acquired", "busy",
+            "wait ms", "w p50us", "w p99us", "h p50us", "h p99us", "h max us");
+}
+
+/* The locks waited for the longest, then how the buckets compare, to tell
+ * a few hot buckets (hashing) from all of them busy (too few buckets).
+ * The counts are read while they change, each is only roughly current */
+void sync_profile_report(FILE* fp) {
+    size_t count = __atomic_load_n(&used, __ATOMIC_RELAXED), n = 0, i;
+    uint64_t acquired = 0, contended = 0, waitNs = 0;
+    uint64_t buckets = 0, bucketAcquired = 0, bucketMax = 0;
+    double squares = 0;
+
+    if (count > PROFILE_LOCKS)
+        count = PROFILE_LOCKS;
+    lockProfile** sorted = malloc((count + 1) * sizeof(lockProfile*));
+    if (!sorted) {
+        perror("sync_profile_report failed");
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        lockProfile* p = &profiles[i];
+        if (!__atomic_load_n(&p->acquired, __ATOMIC_RELAXED))
+            continue;
+        sorted[n++] = p;
+        if (is_bucket(p)) {
+            buckets++;
+            bucketAcquired += p->acquired;
+            squares += (double) p->acquired * p->acquired;
+            if (p->acquired > bucketMax)
+                bucketMax = p->acquired;
+        }
+    }
+    if (others.acquired)
+        sorted[n++] = &others;
+    for (i = 0; i < n; i++) {
+        acquired += sorted[i]->acquired;
+        contended += sorted[i]->contended;
+        waitNs += sorted[i]->waitNs;
+    }
+
+    fprintf(fp, "lock profile: %zu locks, %llu acquisitions, %.2f%% busy, %.3f ms waiting\n",
+            n, (unsigned long long) acquired, acquired ? 100.0 * contended / acquired : 0.0,
+            waitNs / 1e6);
+    qsort(sorted, n, sizeof(lockProfile*), by_wait);
+    print_header(fp);
+    for (i = 0; i < n && i < PROFILE_TOP; i++)
+        print_profile(fp, sorted[i]);
+
+    if (buckets) {
+        double mean = (double) bucketAcquired / buckets;
+        double deviation = squares / buckets - mean * mean;
+
+        fprintf(fp, "buckets: %llu taken, %.0f acquisitions on average, max %.2fx the average, "
+                "deviation %.2f of it\n", (unsigned long long) buckets, mean, bucketMax / mean,
+                deviation > 0 && mean > 0 ? sqrt(deviation) / mean : 0.0);
+        print_header(fp);
+        for (i = 0, count = 0; i < n && count < PROFILE_TOP / 2; i++)
+            if (is_bucket(sorted[i])) {
+                print_profile(fp, sorted[i]);
+                count++;
+            }
+    }
+    fflush(fp);
+    free(sorted);
+}
+
+static void* report_on_signal(void* arg) {
+    sigset_t* set = (sigset_t*) arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0)
+        sync_profile_report(stderr);
+    return NULL;
+}
+
+/* SIGUSR1 prints the report to stderr. Call before creating any other
+ * thread, they have to inherit it blocked for the reporter to get it */
+void sync_profile_start() {
+    static sigset_t set;
+    pthread_t reporter;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+        pthread_create(&reporter, NULL, report_on_signal, &set) != 0) {
+        perror("sync_profile_start failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(reporter);
+}
+#else
+#define PROFILE_LOCK(lock, try, acquire)  (acquire)
+#define PROFILE_ACQUIRED(lock)
+#define PROFILE_RELEASED(lock)
+#endif
 
 void sync_init(syncMech* sync) {
     int ret = syncMech_init(sync, NULL);
@@ -23,7 +310,7 @@ void sync_destroy(syncMech* sync) {
 }
 
 void sync_wrlock(syncMech* sync) {
-    int ret = syncMech_wrlock(sync);
+    int ret = PROFILE_LOCK(sync, syncMech_trywrlock(sync), syncMech_wrlock(sync));
     if(ret != 0){
         perror("sync_wrlock failed");
         exit(EXIT_FAILURE);
@@ -31,14 +318,48 @@ void sync_wrlock(syncMech* sync) {
 }
 
 void sync_rdlock(syncMech* sync) {
-    int ret = syncMech_rdlock(sync);
+    int ret = PROFILE_LOCK(sync, syncMech_tryrdlock(sync), syncMech_rdlock(sync));
     if(ret != 0){
         perror("sync_rdlock failed");
         exit(EXIT_FAILURE);
     }
 }
 
+/* Like sync_wrlock and sync_rdlock, but return the ns spent waiting for
+   the lock. A free lock is taken without reading the clock and counts as
+   0, so only contended acquisitions pay for the timing */
+uint64_t sync_wrlock_wait(syncMech* sync) {
+    int ret = syncMech_trywrlock(sync);
+    if (ret == 0) {
+        PROFILE_ACQUIRED(sync);
+        return 0;
+    }
+    if (ret != EBUSY) {
+        perror("sync_wrlock failed");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t start = now_ns();
+    sync_wrlock(sync);
+    return now_ns() - start;
+}
+
+uint64_t sync_rdlock_wait(syncMech* sync) {
+    int ret = syncMech_tryrdlock(sync);
+    if (ret == 0) {
+        PROFILE_ACQUIRED(sync);
+        return 0;
+    }
+    if (ret != EBUSY) {
+        perror("sync_rdlock failed");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t start = now_ns();
+    sync_rdlock(sync);
+    return now_ns() - start;
+}
+
 void sync_unlock(syncMech* sync) {
+    PROFILE_RELEASED(sync);
     int ret = syncMech_unlock(sync);
     if(ret != 0){
         perror("sync_unlock failed");
@@ -47,7 +368,7 @@ void sync_unlock(syncMech* sync) {
 }
 
 void mutex_init(pthread_mutex_t* mutex) {
-    #if defined (RWLOCK) || defined (MUTEX)
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
         int ret = pthread_mutex_init(mutex, NULL);
         if(ret != 0){
             perror("mutex_init failed");
@@ -57,7 +378,7 @@ void mutex_init(pthread_mutex_t* mutex) {
 }
 
 void mutex_destroy(pthread_mutex_t* mutex) {
-    #if defined (RWLOCK) || defined (MUTEX)
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
         int ret = pthread_mutex_destroy(mutex);
         if(ret != 0){
             perror("mutex_destroy failed");
@@ -67,8 +388,8 @@ void mutex_destroy(pthread_mutex_t* mutex) {
 }
 
 void mutex_lock(pthread_mutex_t* mutex) {
-    #if defined (RWLOCK) || defined (MUTEX)
-        int ret = pthread_mutex_lock(mutex);
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        int ret = PROFILE_LOCK(mutex, pthread_mutex_trylock(mutex), pthread_mutex_lock(mutex));
         if(ret != 0){
             perror("mutex_lock failed");
             exit(EXIT_FAILURE);
@@ -77,7 +398,8 @@ void mutex_lock(pthread_mutex_t* mutex) {
 }
 
 void mutex_unlock(pthread_mutex_t* mutex) {
-    #if defined (RWLOCK) || defined (MUTEX)
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        PROFILE_RELEASED(mutex);
         int ret = pthread_mutex_unlock(mutex);
         if(ret != 0){
             perror("mutex_unlock failed");
@@ -86,8 +408,105 @@ void mutex_unlock(pthread_mutex_t* mutex) {
      #endif
 }
 
+/* Reader-writer locks used whatever the flavour of the buckets is */
+void rwlock_init(pthread_rwlock_t* rwlock) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        int ret = pthread_rwlock_init(rwlock, NULL);
+        if (ret != 0) {
+            perror("rwlock_init failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
+void rwlock_destroy(pthread_rwlock_t* rwlock) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        int ret = pthread_rwlock_destroy(rwlock);
+        if (ret != 0) {
+            perror("rwlock_destroy failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
+void rwlock_rdlock(pthread_rwlock_t* rwlock) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        int ret = PROFILE_LOCK(rwlock, pthread_rwlock_tryrdlock(rwlock),
+                               pthread_rwlock_rdlock(rwlock));
+        if (ret != 0) {
+            perror("rwlock_rdlock failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
+void rwlock_wrlock(pthread_rwlock_t* rwlock) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        int ret = PROFILE_LOCK(rwlock, pthread_rwlock_trywrlock(rwlock),
+                               pthread_rwlock_wrlock(rwlock));
+        if (ret != 0) {
+            perror("rwlock_wrlock failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
+void rwlock_unlock(pthread_rwlock_t* rwlock) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        PROFILE_RELEASED(rwlock);
+        int ret = pthread_rwlock_unlock(rwlock);
+        if (ret != 0) {
+            perror("rwlock_unlock failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
+void cond_init(pthread_cond_t* cond) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        int ret = pthread_cond_init(cond, NULL);
+        if (ret != 0) {
+            perror("cond_init failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
+void cond_destroy(pthread_cond_t* cond) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        int ret = pthread_cond_destroy(cond);
+        if (ret != 0) {
+            perror("cond_destroy failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
+void cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        /* the mutex is not held while waiting */
+        PROFILE_RELEASED(mutex);
+        int ret = pthread_cond_wait(cond, mutex);
+        PROFILE_ACQUIRED(mutex);
+        if (ret != 0) {
+            perror("cond_wait failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
+void cond_broadcast(pthread_cond_t* cond) {
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
+        int ret = pthread_cond_broadcast(cond);
+        if (ret != 0) {
+            perror("cond_broadcast failed");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+}
+
 void init_sem(sem_t* sem, int value) {
-    #if defined (RWLOCK) || defined (MUTEX)
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
         int ret = sem_init(sem, 0, value);
         if (ret != 0) {
             perror("sem_init failed");
@@ -97,7 +516,7 @@ void init_sem(sem_t* sem, int value) {
 }
 
 void destroy_sem(sem_t* sem) {
-    #if defined (RWLOCK) || defined (MUTEX)
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
         int ret = sem_destroy(sem);
         if (ret != 0) {
             perror("sem_destroy failed");
@@ -107,7 +526,7 @@ void destroy_sem(sem_t* sem) {
 }
 
 void wait_sem(sem_t* sem) {
-    #if defined (RWLOCK) || defined (MUTEX)
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
         int ret = sem_wait(sem);
         if (ret != 0) {
             perror("sem_wait failed");
@@ -117,7 +536,7 @@ void wait_sem(sem_t* sem) {
 }
 
 void trywait_sem(sem_t* sem) {
-    #if defined (RWLOCK) || defined (MUTEX)
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
         int ret = sem_trywait(sem);
         if (ret != 0) {
             perror("sem_trywait failed");
@@ -127,7 +546,7 @@ void trywait_sem(sem_t* sem) {
 }
 
 void post_sem(sem_t* sem) {
-    #if defined (RWLOCK) || defined (MUTEX)
+    #if defined (RWLOCK) || defined (MUTEX) || defined (SEQLOCK)
         int ret = sem_post(sem);
         if(ret != 0) {
             perror("sem_post failed");
@@ -136,6 +555,39 @@ void post_sem(sem_t* sem) {
     #endif
 }
 
+/* Sequence counters: odd while a writer (already holding the bucket lock)
+ * is changing the protected data. Only the seqlock build maintains them. */
+void seq_write_begin(seqCount* seq) {
+    #ifdef SEQLOCK
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    #else
+        (void) seq;
+    #endif
+}
+
+void seq_write_end(seqCount* seq) {
+    #ifdef SEQLOCK
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+    #else
+        (void) seq;
+    #endif
+}
+
+unsigned int seq_read_begin(seqCount* seq) {
+    unsigned int start;
+
+    while ((start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+        sched_yield();
+    return start;
+}
+
+/* returns 1 if a writer ran since start, and whatever was read must be discarded */
+int seq_read_retry(seqCount* seq, unsigned int start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
 int do_nothing(void* a){
     (void)a;
     return 0;
@@ -3,6 +3,8 @@
 #ifndef SYNC_H
 #define SYNC_H
 
+#include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
@@ -14,13 +16,20 @@
     #define syncMech_destroy(a)   pthread_rwlock_destroy(a)
     #define syncMech_wrlock(a)    pthread_rwlock_wrlock(a)
     #define syncMech_rdlock(a)    pthread_rwlock_rdlock(a)
+    #define syncMech_trywrlock(a) pthread_rwlock_trywrlock(a)
+    #define syncMech_tryrdlock(a) pthread_rwlock_tryrdlock(a)
     #define syncMech_unlock(a)    pthread_rwlock_unlock(a)
-#elif MUTEX
+#elif defined (MUTEX) || defined (SEQLOCK)
+    /* the seqlock build only locks writers, lookups are validated by the
+     * bucket's sequence counter and fall back to the lock when they keep
+     * racing with writers */
     #define syncMech              pthread_mutex_t
     #define syncMech_init(a,b)    pthread_mutex_init(a,b)
     #define syncMech_destroy(a)   pthread_mutex_destroy(a)
     #define syncMech_wrlock(a)    pthread_mutex_lock(a)
     #define syncMech_rdlock(a)    pthread_mutex_lock(a)
+    #define syncMech_trywrlock(a) pthread_mutex_trylock(a)
+    #define syncMech_tryrdlock(a) pthread_mutex_trylock(a)
     #define syncMech_unlock(a)    pthread_mutex_unlock(a)
 #else //Abstract Sequential
     #define syncMech              void*
@@ -28,23 +37,60 @@
     #define syncMech_destroy(a)   do_nothing(a)
     #define syncMech_wrlock(a)    do_nothing(a)
     #define syncMech_rdlock(a)    do_nothing(a)
+    #define syncMech_trywrlock(a) do_nothing(a)
+    #define syncMech_tryrdlock(a) do_nothing(a)
     #define syncMech_unlock(a)    do_nothing(a)
 #endif
 
+typedef unsigned int seqCount;
+
+#ifdef PROFILE
+/* Lock profiler (the tecnicofs-profile build): every lock taken through
+ * the functions below is counted by its address, with how often it was
+ * busy, how long it was waited for and how long it was held. Locks can
+ * be given a name to be reported by (sync_profile_name); a lock
+ * destroyed and created again at the same address keeps its counts. */
+#define PROFILE_LOCKS  (1 << 18)   /* locks counted apart, the rest count as one */
+#define PROFILE_HIST   40          /* times by power of two of ns, up to 2^39 */
+#define PROFILE_HELD   32          /* locks held at once by a thread whose hold is timed */
+#define PROFILE_TOP    20          /* locks listed, longest wait first */
+
+void sync_profile_name(void* lock, const char* name, int index);
+void sync_profile_start();
+void sync_profile_report(FILE* fp);
+#else
+#define sync_profile_name(lock, name, index)
+#endif
+
 void sync_init(syncMech* sync);
 void sync_destroy(syncMech* sync);
 void sync_wrlock(syncMech* sync);
 void sync_rdlock(syncMech* sync);
 void sync_unlock(syncMech* sync);
+uint64_t sync_wrlock_wait(syncMech* sync);
+uint64_t sync_rdlock_wait(syncMech* sync);
 void mutex_init(pthread_mutex_t* mutex);
 void mutex_lock(pthread_mutex_t* mutex);
 void mutex_unlock(pthread_mutex_t* mutex);
 void mutex_destroy(pthread_mutex_t* mutex);
+void rwlock_init(pthread_rwlock_t* rwlock);
+void rwlock_destroy(pthread_rwlock_t* rwlock);
+void rwlock_rdlock(pthread_rwlock_t* rwlock);
+void rwlock_wrlock(pthread_rwlock_t* rwlock);
+void rwlock_unlock(pthread_rwlock_t* rwlock);
+void cond_init(pthread_cond_t* cond);
+void cond_destroy(pthread_cond_t* cond);
+void cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+void cond_broadcast(pthread_cond_t* cond);
 void init_sem(sem_t* sem, int value);
 void destroy_sem(sem_t* sem);
 void wait_sem(sem_t* sem);
 void trywait_sem(sem_t* sem);
 void post_sem(sem_t* sem);
+void seq_write_begin(seqCount* seq);
+void seq_write_end(seqCount* seq);
+unsigned int seq_read_begin(seqCount* seq);
+int seq_read_retry(seqCount* seq, unsigned int start);
 int do_nothing(void* a);
 
 #endif /* SYNC_H */
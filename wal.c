@@ -0,0 +1,397 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#define _GNU_SOURCE     /* asprintf */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "sync.h"
+
+/* record: u32 length | u32 checksum | u64 lsn | u64 arg | i32 inumber
+           | u8 type | u8 0 | u16 len1 | u16 len2 | u16 0 | name1 | name2
+           | data (the rest of the record)
+   the checksum covers everything after itself, so a torn write at the
+   end of a segment is detected and ends the replay */
+#define RECORD_HEADER 36
+
+static uint32_t checksum(const char* data, size_t size) {
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static char* segment_path(char* dir, uint64_t firstLsn) {
+    char* path;
+
+    if (asprintf(&path, "%s/wal.%016llx", dir, (unsigned long long) firstLsn) < 0) {
+        perror("wal: no memory");
+        exit(EXIT_FAILURE);
+    }
+    return path;
+}
+
+static int open_segment(char* dir, uint64_t firstLsn) {
+    char* path = segment_path(dir, firstLsn);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "wal: could not open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+    return fd;
+}
+
+static void sync_dir(char* dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* Starts a new segment after lastLsn, whatever the older segments hold
+   (a torn tail included) is only ever read by wal_replay */
+wal* wal_open(char* dir, uint64_t lastLsn, int syncEach) {
+    wal* log = calloc(1, sizeof(wal));
+
+    if (!log || !(log->dir = strdup(dir))) {
+        perror("wal: no memory");
+        exit(EXIT_FAILURE);
+    }
+    log->fd = open_segment(dir, lastLsn + 1);
+    sync_dir(dir);
+    log->syncEach = syncEach;
+    log->lastLsn = log->durableLsn = lastLsn;
+    mutex_init(&log->lock);
+    sync_profile_name(&log->lock, "wal", -1);
+    cond_init(&log->flushed);
+    return log;
+}
+
+void wal_close(wal* log) {
+    wal_commit(log, log->lastLsn);
+    close(log->fd);
+    mutex_destroy(&log->lock);
+    cond_destroy(&log->flushed);
+    free(log->buffer);
+    free(log->spare);
+    free(log->dir);
+    free(log);
+}
+
+static void put_record(char* p, uint64_t lsn, char type, int inumber, uint64_t arg,
+                       char* name1, size_t len1, char* name2, size_t len2,
+                       const char* data, size_t dataSize) {
+    uint32_t length = RECORD_HEADER + len1 + len2 + dataSize;
+    uint16_t l1 = len1, l2 = len2, zero = 0;
+
+    memcpy(p, &length, 4);
+    memcpy(p + 8, &lsn, 8);
+    memcpy(p + 16, &arg, 8);
+    memcpy(p + 24, &inumber, 4);
+    p[28] = type;
+    p[29] = 0;
+    memcpy(p + 30, &l1, 2);
+    memcpy(p + 32, &l2, 2);
+    memcpy(p + 34, &zero, 2);
+    if (len1)
+        memcpy(p + RECORD_HEADER, name1, len1);
+    if (len2)
+        memcpy(p + RECORD_HEADER + len1, name2, len2);
+    if (dataSize)
+        memcpy(p + RECORD_HEADER + len1 + len2, data, dataSize);
+
+    uint32_t sum = checksum(p + 8, length - 8);
+    memcpy(p + 4, &sum, 4);
+}
+
+static uint64_t append(wal* log, char type, int inumber, uint64_t arg,
+                       char* name1, char* name2, const char* data, size_t dataSize) {
+    size_t len1 = name1 ? strlen(name1) : 0, len2 = name2 ? strlen(name2) : 0;
+    size_t size = RECORD_HEADER + len1 + len2 + dataSize;
+
+    mutex_lock(&log->lock);
+    if (log->used + size > log->capacity) {
+        size_t capacity = log->capacity ? log->capacity : 65536;
+        while (capacity < log->used + size)
+            capacity *= 2;
+        log->buffer = realloc(log->buffer, capacity);
+        if (!log->buffer) {
+            perror("wal: no memory");
+            exit(EXIT_FAILURE);
+        }
+        log->capacity = capacity;
+    }
+
+    uint64_t lsn = ++log->lastLsn;
+    put_record(log->buffer + log->used, lsn, type, inumber, arg,
+               name1, len1, name2, len2, data, dataSize);
+    log->used += size;
+    mutex_unlock(&log->lock);
+
+    return lsn;
+}
+
+/* Buffers a record and returns its lsn. Cheap, meant to be called
+   while holding the locks of the change being logged */
+uint64_t wal_append(wal* log, char type, char* name1, char* name2, int inumber, uint64_t arg) {
+    return append(log, type, inumber, arg, name1, name2, NULL, 0);
+}
+
+/* Same, for a change to the contents of inumber */
+uint64_t wal_append_data(wal* log, char type, int inumber, uint64_t arg,
+                         const char* data, size_t size) {
+    return append(log, type, inumber, arg, NULL, NULL, data, size);
+}
+
+static void write_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("wal: write failed");
+            exit(EXIT_FAILURE);
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+/* Called with the lock held and flushing set, returns with the lock held */
+static void flush_buffer(wal* log) {
+    /* swap buffers, appends go on while the old one is written */
+    char* data = log->buffer;
+    size_t size = log->used, capacity = log->capacity;
+    uint64_t upTo = log->lastLsn;
+    int fd = log->fd;
+
+    log->buffer = log->spare;
+    log->capacity = log->spareCapacity;
+    log->used = 0;
+    log->spare = data;
+    log->spareCapacity = capacity;
+
+    if (!log->syncEach)
+        mutex_unlock(&log->lock);
+
+    write_all(fd, data, size);
+    if (fdatasync(fd) < 0) {
+        perror("wal: fdatasync failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!log->syncEach)
+        mutex_lock(&log->lock);
+    log->syncs++;
+    log->durableLsn = upTo;
+}
+
+/* Returns once the record lsn (and all before it) is on disk */
+void wal_commit(wal* log, uint64_t lsn) {
+    mutex_lock(&log->lock);
+
+    if (log->syncEach) {
+        /* every commit writes and syncs by itself, holding the lock */
+        flush_buffer(log);
+        mutex_unlock(&log->lock);
+        return;
+    }
+
+    while (log->durableLsn < lsn) {
+        if (log->flushing) {
+            /* the running flush may not cover lsn, check again after it */
+            cond_wait(&log->flushed, &log->lock);
+            continue;
+        }
+        log->flushing = 1;
+        flush_buffer(log);
+        log->flushing = 0;
+        cond_broadcast(&log->flushed);
+    }
+
+    mutex_unlock(&log->lock);
+}
+
+/* Closes the current segment and starts a new one. Returns the last lsn
+   of the closed segments: a snapshot taken from now on covers them */
+uint64_t wal_rotate(wal* log) {
+    mutex_lock(&log->lock);
+    while (log->flushing)
+        cond_wait(&log->flushed, &log->lock);
+
+    log->flushing = 1;
+    if (log->used > 0 || log->durableLsn < log->lastLsn)
+        flush_buffer(log);
+    /* nobody else flushes, so the segment can be switched */
+    uint64_t lastLsn = log->lastLsn;
+    close(log->fd);
+    log->fd = open_segment(log->dir, lastLsn + 1);
+    sync_dir(log->dir);
+    log->flushing = 0;
+    cond_broadcast(&log->flushed);
+
+    mutex_unlock(&log->lock);
+    return lastLsn;
+}
+
+static int segment_first_lsn(const char* name, uint64_t* lsn) {
+    unsigned long long value;
+    char end;
+
+    if (sscanf(name, "wal.%16llx%c", &value, &end) != 1)
+        return 0;
+    *lsn = value;
+    return 1;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/* Sorted first lsns of the segments in dir */
+static uint64_t* list_segments(char* dir, int* count) {
+    DIR* d = opendir(dir);
+    struct dirent* entry;
+    uint64_t* segments = NULL;
+    int n = 0;
+
+    if (!d) {
+        fprintf(stderr, "wal: could not open %s: %s\n", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while ((entry = readdir(d))) {
+        uint64_t lsn;
+        if (!segment_first_lsn(entry->d_name, &lsn))
+            continue;
+        segments = realloc(segments, (n + 1) * sizeof(uint64_t));
+        if (!segments) {
+            perror("wal: no memory");
+            exit(EXIT_FAILURE);
+        }
+        segments[n++] = lsn;
+    }
+    closedir(d);
+
+    qsort(segments, n, sizeof(uint64_t), cmp_u64);
+    *count = n;
+    return segments;
+}
+
+/* Deletes the segments holding only records up to coveredLsn, once a
+   durable snapshot includes them. The segment being appended to always
+   starts after the lsn returned by the wal_rotate that preceded it */
+void wal_remove_old(wal* log, uint64_t coveredLsn) {
+    int i, count;
+    uint64_t* segments = list_segments(log->dir, &count);
+
+    for (i = 0; i < count && segments[i] <= coveredLsn; i++) {
+        char* path = segment_path(log->dir, segments[i]);
+        unlink(path);
+        free(path);
+    }
+    free(segments);
+}
+
+/* Reads a whole segment into memory */
+static char* read_segment(char* path, size_t* size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char* data;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "wal: could not read %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    data = malloc(st.st_size ? st.st_size : 1);
+    if (!data) {
+        perror("wal: no memory");
+        exit(EXIT_FAILURE);
+    }
+    size_t done = 0;
+    while (done < (size_t) st.st_size) {
+        ssize_t n = read(fd, data + done, st.st_size - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+    *size = done;
+    return data;
+}
+
+/* Calls apply on every valid record after afterLsn, in lsn order.
+   Returns the last lsn found in the log (or afterLsn) */
+uint64_t wal_replay(char* dir, uint64_t afterLsn,
+                    void (*apply)(walRecord*, void*), void* arg) {
+    int i, count;
+    uint64_t* segments = list_segments(dir, &count);
+    uint64_t last = afterLsn;
+
+    for (i = 0; i < count; i++) {
+        char* path = segment_path(dir, segments[i]);
+        size_t size, offset = 0;
+        char* data = read_segment(path, &size);
+
+        while (offset + RECORD_HEADER <= size) {
+            char* p = data + offset;
+            uint32_t length, sum;
+            uint16_t len1, len2;
+            char name1[65536], name2[65536];
+            walRecord record;
+
+            memcpy(&length, p, 4);
+            memcpy(&sum, p + 4, 4);
+            if (length < RECORD_HEADER || offset + length > size ||
+                checksum(p + 8, length - 8) != sum)
+                break;  /* torn or garbage tail */
+
+            memcpy(&record.lsn, p + 8, 8);
+            memcpy(&record.arg, p + 16, 8);
+            memcpy(&record.inumber, p + 24, 4);
+            record.type = p[28];
+            memcpy(&len1, p + 30, 2);
+            memcpy(&len2, p + 32, 2);
+            if ((size_t) RECORD_HEADER + len1 + len2 > length)
+                break;
+            memcpy(name1, p + RECORD_HEADER, len1);
+            name1[len1] = '\0';
+            memcpy(name2, p + RECORD_HEADER + len1, len2);
+            name2[len2] = '\0';
+            record.name1 = name1;
+            record.name2 = name2;
+            record.data = p + RECORD_HEADER + len1 + len2;
+            record.dataSize = length - (RECORD_HEADER + len1 + len2);
+
+            if (record.lsn > afterLsn) {
+                apply(&record, arg);
+                last = record.lsn;
+            }
+            offset += length;
+        }
+
+        /* cut a torn tail off, new records may be appended to this file */
+        if (offset < size && truncate(path, offset) < 0) {
+            fprintf(stderr, "wal: could not truncate %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        free(data);
+        free(path);
+    }
+
+    free(segments);
+    return last;
+}
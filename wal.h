@@ -0,0 +1,63 @@
+/* Sistemas Operativos, DEI/IST/ULisboa 2019-20 */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Write-ahead log of the changes to the namespace and to the contents of
+   the files, in the data directory as segments named wal.<first lsn>.
+   Every record gets a log sequence number (lsn) when it is appended,
+   which happens inside the critical section of the change, so the log
+   order is the order the changes were applied in. Records name entries
+   by their keys in the buckets (parent inumber and name), not by path.
+   Making the records durable (wal_commit) is done after the locks are
+   released: with group commit the first thread to wait writes and syncs
+   everything appended so far on behalf of all others. */
+
+#define WAL_CREATE  'c'
+#define WAL_DELETE  'd'
+#define WAL_RENAME  'r'
+#define WAL_MKDIR   'm'
+#define WAL_WRITE   'w'   /* data written to inumber at offset arg */
+
+typedef struct walRecord {
+    uint64_t lsn;
+    char type;
+    int inumber;
+    char* name1;
+    char* name2;    /* only for renames */
+    uint64_t arg;   /* owner and permissions of a create, offset of a write */
+    char* data;     /* what a write wrote */
+    size_t dataSize;
+} walRecord;
+
+typedef struct wal {
+    char* dir;
+    int fd;                 /* current segment */
+    int syncEach;           /* fsync on every commit, no grouping */
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    char* buffer;           /* appended, not yet written */
+    size_t used, capacity;
+    char* spare;            /* the buffer being written by the flusher */
+    size_t spareCapacity;
+    uint64_t lastLsn;
+    uint64_t durableLsn;
+    int flushing;
+    long syncs;             /* fdatasync calls, to tell commit modes apart */
+} wal;
+
+wal* wal_open(char* dir, uint64_t lastLsn, int syncEach);
+void wal_close(wal* log);
+uint64_t wal_append(wal* log, char type, char* name1, char* name2, int inumber, uint64_t arg);
+uint64_t wal_append_data(wal* log, char type, int inumber, uint64_t arg,
+                         const char* data, size_t size);
+void wal_commit(wal* log, uint64_t lsn);
+uint64_t wal_rotate(wal* log);
+void wal_remove_old(wal* log, uint64_t coveredLsn);
+uint64_t wal_replay(char* dir, uint64_t afterLsn,
+                    void (*apply)(walRecord*, void*), void* arg);
+
+#endif /* WAL_H */